@@ -137,6 +137,9 @@ icu_lib_dirs = []
 zlib_inc_dirs = []
 zlib_lib_dirs = []
 
+jpg_inc_dirs = []
+jpg_lib_dirs = []
+
 hunspell_inc_dirs = []
 hunspell_lib_dirs = []
 
@@ -171,6 +174,8 @@ if iswindows:
     hunspell_lib_dirs = [sw_lib_dir]
     zlib_inc_dirs = [sw_inc_dir]
     zlib_lib_dirs = [sw_lib_dir]
+    jpg_inc_dirs = [sw_inc_dir]
+    jpg_lib_dirs = [sw_lib_dir]
     podofo_inc = os.path.join(sw_inc_dir, 'podofo')
     podofo_lib = sw_lib_dir
 elif ismacos:
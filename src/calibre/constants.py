@@ -248,6 +248,7 @@ class ExtensionsImporter:
             'msdes',
             'podofo',
             'cPalmdoc',
+            'huffcdic',
             'progress_indicator',
             'rcc_backend',
             'icu',
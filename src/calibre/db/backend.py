@@ -18,7 +18,6 @@ import time
 import uuid
 from contextlib import closing, suppress
 from typing import Optional
-from functools import partial
 
 from calibre import as_unicode, force_unicode, isbytestring, prints
 from calibre.constants import (
@@ -54,10 +53,10 @@ from calibre.utils.formatter_functions import (
     compile_user_template_functions, formatter_functions, load_user_template_functions,
     unload_user_template_functions,
 )
-from calibre.utils.icu import lower as icu_lower, sort_key
+from calibre.utils.icu import lower as icu_lower
 from calibre.utils.resources import get_path as P
 from polyglot.builtins import (
-    cmp, iteritems, itervalues, native_string_type, reraise, string_or_bytes,
+    iteritems, itervalues, native_string_type, reraise, string_or_bytes,
 )
 
 # }}}
@@ -69,17 +68,28 @@ WINDOWS_RESERVED_NAMES = frozenset('CON PRN AUX NUL COM1 COM2 COM3 COM4 COM5 COM
 
 class DynamicFilter:  # {{{
 
-    'No longer used, present for legacy compatibility'
+    ''' No longer used, present for legacy compatibility. Membership is
+    checked natively by sqlite_extension using the filter_name book id
+    filter. '''
 
     def __init__(self, name):
+        from calibre_extensions.sqlite_extension import set_book_id_filter
         self.name = name
+        self.filter_name = f'dynamic_filter_{id(self)}'
         self.ids = frozenset()
+        set_book_id_filter(self.filter_name, self.ids)
+
+    def __del__(self):
+        from calibre_extensions.sqlite_extension import remove_book_id_filter
+        remove_book_id_filter(self.filter_name)
 
     def __call__(self, id_):
         return int(id_ in self.ids)
 
     def change(self, ids):
+        from calibre_extensions.sqlite_extension import set_book_id_filter
         self.ids = frozenset(ids)
+        set_book_id_filter(self.filter_name, self.ids)
 # }}}
 
 
@@ -183,21 +193,11 @@ class DBPrefs(dict):  # {{{
             return json.load(f, object_hook=from_json)
 # }}}
 
-# Extra collators {{{
-
+# Extra collators and functions {{{
 
-def pynocase(one, two, encoding='utf-8'):
-    if isbytestring(one):
-        try:
-            one = one.decode(encoding, 'replace')
-        except:
-            pass
-    if isbytestring(two):
-        try:
-            two = two.decode(encoding, 'replace')
-        except:
-            pass
-    return cmp(one.lower(), two.lower())
+# The icucollate and PYNOCASE collations and the sortconcat, sortconcat_bar,
+# sortconcat_amper, identifiers_concat, concat and aum_sortconcat aggregates
+# are implemented natively in sqlite_extension
 
 
 def _author_to_author_sort(x):
@@ -206,94 +206,29 @@ def _author_to_author_sort(x):
     return author_to_author_sort(x.replace('|', ','))
 
 
-def icu_collator(s1, s2):
-    return cmp(sort_key(force_unicode(s1, 'utf-8')),
-               sort_key(force_unicode(s2, 'utf-8')))
-
-# }}}
-
-# Unused aggregators {{{
-
-
-def Concatenate(sep=','):
-    '''String concatenation aggregator for sqlite'''
-
-    def step(ctxt, value):
-        if value is not None:
-            ctxt.append(value)
-
-    def finalize(ctxt):
-        try:
-            if not ctxt:
-                return None
-            return sep.join(ctxt)
-        except Exception:
-            import traceback
-            traceback.print_exc()
-            raise
-
-    return ([], step, finalize)
-
-
-def SortedConcatenate(sep=','):
-    '''String concatenation aggregator for sqlite, sorted by supplied index'''
-
-    def step(ctxt, ndx, value):
-        if value is not None:
-            ctxt[ndx] = value
-
-    def finalize(ctxt):
-        try:
-            if len(ctxt) == 0:
-                return None
-            return sep.join(map(ctxt.get, sorted(ctxt)))
-        except Exception:
-            import traceback
-            traceback.print_exc()
-            raise
-
-    return ({}, step, finalize)
-
-
-def IdentifiersConcat():
-    '''String concatenation aggregator for the identifiers map'''
-
-    def step(ctxt, key, val):
-        ctxt.append('%s:%s'%(key, val))
-
-    def finalize(ctxt):
-        try:
-            return ','.join(ctxt)
-        except Exception:
-            import traceback
-            traceback.print_exc()
-            raise
-
-    return ([], step, finalize)
-
-
-def AumSortedConcatenate():
-    '''String concatenation aggregator for the author sort map'''
-
-    def step(ctxt, ndx, author, sort, link):
-        if author is not None:
-            ctxt[ndx] = ':::'.join((author, sort, link))
+def configure_native_sort_functions():
+    ''' Pass the current tweak values to the native title_sort() and
+    author_to_author_sort() SQL functions. Returns False if the tweaks cannot
+    be represented natively, in which case the python functions must be used. '''
+    from calibre.ebooks.metadata import get_title_sort_pat
+    from calibre_extensions.sqlite_extension import set_author_sort_config, set_title_sort_config
 
-    def finalize(ctxt):
-        try:
-            keys = list(ctxt)
-            l = len(keys)
-            if l == 0:
-                return None
-            if l == 1:
-                return ctxt[keys[0]]
-            return ':#:'.join([ctxt[v] for v in sorted(keys)])
-        except Exception:
-            import traceback
-            traceback.print_exc()
-            raise
+    def words(key, with_periods=False):
+        ans = {force_unicode(x).lower() for x in tweaks[key]}
+        if with_periods:
+            ans |= {x + '.' for x in ans}
+        return tuple(ans)
 
-    return ({}, step, finalize)
+    try:
+        set_title_sort_config(tweaks['title_series_sorting'], get_title_sort_pat().pattern)
+        set_author_sort_config(
+            tweaks['author_sort_copy_method'], words('author_name_copywords'),
+            tweaks['author_use_surname_prefixes'], words('author_surname_prefixes'),
+            words('author_name_prefixes', True), words('author_name_suffixes', True))
+    except Exception as e:
+        prints('Using slow python title and author sort functions as the tweaks could not be used natively, with error:', as_unicode(e))
+        return False
+    return True
 
 # }}}
 
@@ -333,8 +268,10 @@ class Connection(apsw.Connection):  # {{{
 
     def __init__(self, path):
         from calibre.utils.localization import get_lang
-        from calibre_extensions.sqlite_extension import set_ui_language
+        from calibre_extensions.sqlite_extension import set_sort_collation, set_ui_language
         set_ui_language(get_lang())
+        set_sort_collation(tweaks['locale_for_sorting'] or '', prefs['numeric_collation'])
+        native_sort_functions = configure_native_sort_functions()
         super().__init__(path)
         plugins.load_apsw_extension(self, 'sqlite_extension')
         self.fts_dbpath = self.notes_dbpath = None
@@ -342,35 +279,17 @@ class Connection(apsw.Connection):  # {{{
         self.setbusytimeout(self.BUSY_TIMEOUT)
         self.execute('PRAGMA cache_size=-5000; PRAGMA temp_store=2; PRAGMA foreign_keys=ON;')
 
-        encoding = next(self.execute('PRAGMA encoding'))[0]
-        self.createcollation('PYNOCASE', partial(pynocase,
-            encoding=encoding))
-
-        self.createscalarfunction('title_sort', title_sort, 1)
-        self.createscalarfunction('author_to_author_sort',
-                _author_to_author_sort, 1)
+        if not native_sort_functions:
+            self.createscalarfunction('title_sort', title_sort, 1)
+            self.createscalarfunction('author_to_author_sort',
+                    _author_to_author_sort, 1)
         self.createscalarfunction('uuid4', lambda: str(uuid.uuid4()),
                 0)
 
-        # Dummy functions for dynamically created filters
-        self.createscalarfunction('books_list_filter', lambda x: 1, 1)
-        self.createcollation('icucollate', icu_collator)
-
-        # Legacy aggregators (never used) but present for backwards compat
-        self.createaggregatefunction('sortconcat', SortedConcatenate, 2)
-        self.createaggregatefunction('sortconcat_bar',
-                partial(SortedConcatenate, sep='|'), 2)
-        self.createaggregatefunction('sortconcat_amper',
-                partial(SortedConcatenate, sep='&'), 2)
-        self.createaggregatefunction('identifiers_concat',
-                IdentifiersConcat, 2)
-        self.createaggregatefunction('concat', Concatenate, 1)
-        self.createaggregatefunction('aum_sortconcat',
-                AumSortedConcatenate, 4)
-
     def create_dynamic_filter(self, name):
         f = DynamicFilter(name)
-        self.createscalarfunction(name, f, 1)
+        self.execute('SELECT create_book_id_filter(?, ?)', (name, f.filter_name))
+        return f
 
     def get(self, *args, **kw):
         ans = self.cursor().execute(*args)
@@ -17,7 +17,9 @@ from calibre.db.utils import force_to_bool
 from calibre.utils.config_base import prefs
 from calibre.utils.date import UNDEFINED_DATE, dt_as_local, now, parse_date
 from calibre.utils.icu import (
-    lower as icu_lower, primary_contains, primary_no_punc_contains, sort_key,
+    current_locale, lower as icu_lower, primary_collator,
+    primary_collator_without_punctuation, primary_contains,
+    primary_no_punc_contains, sort_key,
 )
 from calibre.utils.localization import canonicalize_lang, lang_map
 from calibre.utils.search_query_parser import ParseException, SearchQueryParser
@@ -91,6 +93,35 @@ def _match(query, value, matchkind, use_primary_find_in_search=True, case_sensit
             elif query in t:
                 return True
     return False
+
+
+def native_matches(query, vals, matchkind, use_primary_find_in_search=True, case_sensitive=False):
+    '''
+    Match query against all (values, book_ids) pairs in vals in a single
+    native call, which releases the GIL and compiles the query only once.
+    Equivalent to calling _match() for every pair. Falls back to _match() if
+    the native matcher is not available or cannot handle the query.
+    '''
+    if not isinstance(vals, (list, tuple)):
+        vals = tuple(vals)
+    collator = None
+    if matchkind == ACCENT_MATCH:
+        collator = primary_collator()
+    elif matchkind == CONTAINS_MATCH and use_primary_find_in_search and not case_sensitive:
+        collator = primary_collator_without_punctuation()
+    try:
+        from calibre_extensions.sqlite_extension import match_values
+        return match_values(query, matchkind, vals, case_sensitive, current_locale(),
+                            None if collator is None else collator.capsule)
+    except (ImportError, ValueError):
+        matches = set()
+        for val, book_ids in vals:
+            if val is not None:
+                if isinstance(val, string_or_bytes):
+                    val = (val,)
+                if _match(query, val, matchkind, use_primary_find_in_search=use_primary_find_in_search, case_sensitive=case_sensitive):
+                    matches |= book_ids
+        return matches
 # }}}
 
 
@@ -774,19 +805,13 @@ class Parser(SearchQueryParser):  # {{{
                 continue
 
             if location in text_fields:
-                for val, book_ids in self.field_iter(location, current_candidates):
-                    if val is not None:
-                        if isinstance(val, string_or_bytes):
-                            val = (val,)
-                        if _match(q, val, matchkind, use_primary_find_in_search=upf, case_sensitive=case_sensitive):
-                            matches |= book_ids
+                matches |= native_matches(q, self.field_iter(location, current_candidates), matchkind,
+                                          use_primary_find_in_search=upf, case_sensitive=case_sensitive)
 
             if location == 'series_sort':
                 book_lang_map = self.dbcache.fields['languages'].book_value_map
-                for val, book_ids in self.dbcache.fields['series'].iter_searchable_values_for_sort(current_candidates, book_lang_map):
-                    if val is not None:
-                        if _match(q, (val,), matchkind, use_primary_find_in_search=upf, case_sensitive=case_sensitive):
-                            matches |= book_ids
+                svals = self.dbcache.fields['series'].iter_searchable_values_for_sort(current_candidates, book_lang_map)
+                matches |= native_matches(q, svals, matchkind, use_primary_find_in_search=upf, case_sensitive=case_sensitive)
 
         return matches
 
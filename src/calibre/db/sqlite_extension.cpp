@@ -13,8 +13,14 @@
 #include <locale>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <exception>
 #include <sqlite3ext.h>
 #include <unicode/unistr.h>
 #include <unicode/uchar.h>
@@ -22,6 +28,11 @@
 #include <unicode/errorcode.h>
 #include <unicode/brkiter.h>
 #include <unicode/uscript.h>
+#include <unicode/ucol.h>
+#include <unicode/ustring.h>
+#include <unicode/regex.h>
+#include <unicode/utext.h>
+#include <unicode/usearch.h>
 #if __has_include(<libstemmer.h>)
 #include <libstemmer.h>
 #else
@@ -97,6 +108,46 @@ populate_icu_string(const char *text, int text_sz, icu::UnicodeString &str, std:
 static char ui_language[16] = {'e', 'n', 0};
 static std::mutex global_mutex;
 
+// Instrumentation {{{
+enum TokenizerPhase { PHASE_BREAK_ITERATION, PHASE_REMOVE_DIACRITICS, PHASE_STEMMING, PHASE_CALLBACK, NUM_OF_PHASES };
+static const char* phase_names[NUM_OF_PHASES] = {"break_iteration_ns", "remove_diacritics_ns", "stemming_ns", "callback_ns"};
+
+struct TokenizerStats {
+    uint64_t calls, tokens, bytes, iterator_creations, stemmer_creations;
+    uint64_t phase_ns[NUM_OF_PHASES];
+
+    TokenizerStats() { reset(); }
+    void reset() {
+        calls = 0; tokens = 0; bytes = 0; iterator_creations = 0; stemmer_creations = 0;
+        for (size_t i = 0; i < NUM_OF_PHASES; i++) phase_ns[i] = 0;
+    }
+    void add(const TokenizerStats &other) {
+        calls += other.calls; tokens += other.tokens; bytes += other.bytes;
+        iterator_creations += other.iterator_creations; stemmer_creations += other.stemmer_creations;
+        for (size_t i = 0; i < NUM_OF_PHASES; i++) phase_ns[i] += other.phase_ns[i];
+    }
+};
+
+// Collection is off by default, so the only cost in production is one
+// relaxed atomic load per tokenize() call. Per tokenizer counters are merged
+// into global_stats (protected by global_mutex) at the end of every call.
+static std::atomic<bool> stats_enabled(false);
+static TokenizerStats global_stats;
+
+class PhaseTimer {
+private:
+    uint64_t *target;
+    std::chrono::steady_clock::time_point start;
+public:
+    PhaseTimer(TokenizerStats *stats, TokenizerPhase phase) : target(stats ? stats->phase_ns + phase : NULL), start() {
+        if (target) start = std::chrono::steady_clock::now();
+    }
+    ~PhaseTimer() {
+        if (target) *target += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+// }}}
+
 class IteratorDescription {
     public:
         const char *language;
@@ -142,11 +193,42 @@ public:
 
 typedef std::unique_ptr<icu::BreakIterator> BreakIterator;
 typedef std::unique_ptr<Stemmer> StemmerPtr;
+
+// Process wide cache of word break iterators, keyed by locale name. Creating
+// the dictionary based iterators (Thai, CJK, etc.) is expensive, so every
+// Tokenizer gets a clone of a shared prototype instead. The prototypes are
+// never used for iteration, only cloned.
+static std::unordered_map<std::string, BreakIterator> iterator_prototypes;
+static std::mutex iterator_prototypes_mutex;
+
+static BreakIterator
+clone_word_iterator(const icu::Locale &locale) {
+    std::lock_guard<std::mutex> lock(iterator_prototypes_mutex);
+    const std::string key(locale.getName());
+    auto ans = iterator_prototypes.find(key);
+    if (ans == iterator_prototypes.end()) {
+        icu::ErrorCode status;
+        BreakIterator prototype(icu::BreakIterator::createWordInstance(locale, status));
+        if (status.isFailure() || !prototype) {
+            status.reset();
+            prototype.reset(icu::BreakIterator::createWordInstance(icu::Locale::getDefault(), status));
+            if (status.isFailure() || !prototype) throw std::bad_alloc();
+        }
+        ans = iterator_prototypes.emplace(key, std::move(prototype)).first;
+    }
+    BreakIterator clone(ans->second->clone());
+    if (!clone) throw std::bad_alloc();
+    return clone;
+}
 static const std::string empty_string("");
+// Prefix tokens are stored with a leading control byte so that they can never
+// collide with real words, which always contain at least one token character
+static const char PREFIX_TOKEN_MARKER = '\x01';
+static const int32_t MIN_PREFIX_TOKEN_LENGTH = 2, MAX_PREFIX_TOKEN_LENGTH = 4;
 
 class Tokenizer {
 private:
-    bool remove_diacritics, stem_words;
+    bool remove_diacritics, stem_words, prefix_tokens;
     std::unique_ptr<icu::Transliterator> diacritics_remover;
     std::vector<int> byte_offsets;
     std::string token_buf, current_ui_language;
@@ -154,6 +236,14 @@ private:
     void *current_callback_ctx;
     std::unordered_map<std::string, BreakIterator> iterators;
     std::unordered_map<std::string, StemmerPtr> stemmers;
+    TokenizerStats stats;
+    TokenizerStats *active_stats;
+    // Only the last token of a prefix query is a prefix, so query tokens are
+    // held back by one when tokenizing with FTS5_TOKENIZE_PREFIX
+    bool prefix_query, has_pending_token;
+    icu::UnicodeString pending_token;
+    int32_t pending_start, pending_end;
+    StemmerPtr *pending_stemmer;
 
     bool is_token_char(UChar32 ch) const {
         switch(u_charType(ch)) {
@@ -180,13 +270,59 @@ private:
         token.toUTF8String(token_buf);
         const char *root = token_buf.c_str(); int sz = (int)token_buf.size();
         if (stem_words && stemmer->operator bool()) {
+            PhaseTimer t(active_stats, PHASE_STEMMING);
             root = stemmer->stem(root, sz, &sz);
             if (!root) {
                 root = token_buf.c_str();
                 sz = (int)token_buf.size();
             }
         }
-        return current_callback(current_callback_ctx, flags, root, (int)sz, byte_offsets.at(start_offset), byte_offsets.at(end_offset));
+        return emit_token(root, sz, start_offset, end_offset, flags);
+    }
+
+    int emit_token(const char *text, int sz, int32_t start_offset, int32_t end_offset, int flags) {
+        if (active_stats) active_stats->tokens++;
+        PhaseTimer t(active_stats, PHASE_CALLBACK);
+        return current_callback(current_callback_ctx, flags, text, sz, byte_offsets.at(start_offset), byte_offsets.at(end_offset));
+    }
+
+    int send_prefix_token(const icu::UnicodeString &token, int32_t limit, int32_t start_offset, int32_t end_offset, int flags) {
+        token_buf.clear(); token_buf.push_back(PREFIX_TOKEN_MARKER);
+        token.tempSubString(0, limit).toUTF8String(token_buf);
+        return emit_token(token_buf.c_str(), (int)token_buf.size(), start_offset, end_offset, flags);
+    }
+
+    int send_prefix_tokens(const icu::UnicodeString &token, int32_t start_offset, int32_t end_offset, const icu::UnicodeString *already_sent = NULL) {
+        int32_t num = std::min(token.countChar32(), MAX_PREFIX_TOKEN_LENGTH);
+        int rc = SQLITE_OK;
+        for (int32_t n = MIN_PREFIX_TOKEN_LENGTH; n <= num; n++) {
+            int32_t limit = token.moveIndex32(0, n);
+            if (already_sent && already_sent->moveIndex32(0, n) == limit && already_sent->compare(0, limit, token, 0, limit) == 0) continue;
+            if ((rc = send_prefix_token(token, limit, start_offset, end_offset, FTS5_TOKEN_COLOCATED)) != SQLITE_OK) return rc;
+        }
+        return rc;
+    }
+
+    int send_query_token(const icu::UnicodeString &token, int32_t start_offset, int32_t end_offset, StemmerPtr &stemmer) {
+        if (!prefix_query) return send_token(token, start_offset, end_offset, stemmer);
+        int rc = flush_pending_token(false);
+        if (rc != SQLITE_OK) return rc;
+        pending_token = token; pending_start = start_offset; pending_end = end_offset; pending_stemmer = &stemmer;
+        has_pending_token = true;
+        return rc;
+    }
+
+    int flush_pending_token(bool is_last) {
+        if (!has_pending_token) return SQLITE_OK;
+        has_pending_token = false;
+        if (is_last && prefix_tokens) {
+            int32_t num = pending_token.countChar32();
+            // Short prefixes are looked up in the prefix tokens, which are
+            // generated from unstemmed words, instead of scanning every term
+            // in the index that starts with them
+            if (MIN_PREFIX_TOKEN_LENGTH <= num && num <= MAX_PREFIX_TOKEN_LENGTH) return send_prefix_token(pending_token, pending_token.length(), pending_start, pending_end, 0);
+        }
+        return send_token(pending_token, pending_start, pending_end, *pending_stemmer);
     }
 
     const char* iterator_language_for_script(UScriptCode script) const {
@@ -227,9 +363,9 @@ private:
         std::lock_guard<std::mutex> lock(global_mutex);
         if (current_ui_language != ui_language || iterators.find(empty_string) == iterators.end()) {
             current_ui_language.clear(); current_ui_language = ui_language;
-            icu::ErrorCode status;
             if (current_ui_language.empty()) {
-                iterators[empty_string] = BreakIterator(icu::BreakIterator::createWordInstance(icu::Locale::getDefault(), status));
+                iterators[empty_string] = clone_word_iterator(icu::Locale::getDefault());
+                if (active_stats) active_stats->iterator_creations++;
             } else {
                 ensure_lang_iterator(ui_language);
             }
@@ -239,11 +375,8 @@ private:
     BreakIterator& ensure_lang_iterator(const char *lang = "") {
         auto ans = iterators.find(lang);
         if (ans == iterators.end()) {
-            icu::ErrorCode status;
-            iterators[lang] = BreakIterator(icu::BreakIterator::createWordInstance(icu::Locale::createCanonical(lang), status));
-            if (status.isFailure()) {
-                iterators[lang] = BreakIterator(icu::BreakIterator::createWordInstance(icu::Locale::getDefault(), status));
-            }
+            iterators[lang] = clone_word_iterator(icu::Locale::createCanonical(lang));
+            if (active_stats) active_stats->iterator_creations++;
             ans = iterators.find(lang);
         }
         return ans->second;
@@ -254,34 +387,51 @@ private:
         auto ans = stemmers.find(lang);
         if (ans == stemmers.end()) {
             stemmers[lang] = stem_words ? std::make_unique<Stemmer>(lang) : std::make_unique<Stemmer>();
+            if (stem_words && active_stats) active_stats->stemmer_creations++;
             ans = stemmers.find(lang);
         }
         return ans->second;
     }
 
     int tokenize_script_block(const icu::UnicodeString &str, int32_t block_start, int32_t block_limit, bool for_query, token_callback_func callback, void *callback_ctx, BreakIterator &word_iterator, StemmerPtr &stemmer) {
-        word_iterator->setText(str.tempSubStringBetween(block_start, block_limit));
-        int32_t token_start_pos = word_iterator->first() + block_start, token_end_pos;
+        int32_t token_start_pos, token_end_pos;
+        {
+            PhaseTimer t(active_stats, PHASE_BREAK_ITERATION);
+            word_iterator->setText(str.tempSubStringBetween(block_start, block_limit));
+            token_start_pos = word_iterator->first() + block_start;
+        }
         int rc = SQLITE_OK;
         do {
-            token_end_pos = word_iterator->next();
-            if (token_end_pos == icu::BreakIterator::DONE) token_end_pos = block_limit;
-            else token_end_pos += block_start;
-            if (token_end_pos > token_start_pos) {
-                bool is_token = false;
+            bool is_token = false;
+            {
+                PhaseTimer t(active_stats, PHASE_BREAK_ITERATION);
+                token_end_pos = word_iterator->next();
+                if (token_end_pos == icu::BreakIterator::DONE) token_end_pos = block_limit;
+                else token_end_pos += block_start;
                 for (int32_t pos = token_start_pos; !is_token && pos < token_end_pos; pos = str.moveIndex32(pos, 1)) {
                     if (is_token_char(str.char32At(pos))) is_token = true;
                 }
+            }
+            if (token_end_pos > token_start_pos) {
                 if (is_token) {
                     icu::UnicodeString token(str, token_start_pos, token_end_pos - token_start_pos);
                     token.foldCase();
-                    if ((rc = send_token(token, token_start_pos, token_end_pos, stemmer)) != SQLITE_OK) return rc;
+                    if (for_query) {
+                        if ((rc = send_query_token(token, token_start_pos, token_end_pos, stemmer)) != SQLITE_OK) return rc;
+                    } else {
+                        if ((rc = send_token(token, token_start_pos, token_end_pos, stemmer)) != SQLITE_OK) return rc;
+                        if (prefix_tokens && (rc = send_prefix_tokens(token, token_start_pos, token_end_pos)) != SQLITE_OK) return rc;
+                    }
                     if (!for_query && remove_diacritics) {
                         icu::UnicodeString tt(str, token_start_pos, token_end_pos - token_start_pos);
-                        diacritics_remover->transliterate(tt);
+                        {
+                            PhaseTimer t(active_stats, PHASE_REMOVE_DIACRITICS);
+                            diacritics_remover->transliterate(tt);
+                        }
                         tt.foldCase();
                         if (tt != token) {
                             if ((rc = send_token(tt, token_start_pos, token_end_pos, stemmer, FTS5_TOKEN_COLOCATED)) != SQLITE_OK) return rc;
+                            if (prefix_tokens && (rc = send_prefix_tokens(tt, token_start_pos, token_end_pos, &token)) != SQLITE_OK) return rc;
                         }
                     }
                 }
@@ -295,10 +445,11 @@ public:
     int constructor_error;
 
     Tokenizer(const char **args, int nargs, bool stem_words = false) :
-        remove_diacritics(true), stem_words(stem_words), diacritics_remover(),
+        remove_diacritics(true), stem_words(stem_words), prefix_tokens(false), diacritics_remover(),
         byte_offsets(), token_buf(), current_ui_language(""),
         current_callback(NULL), current_callback_ctx(NULL),
-        iterators(), stemmers(),
+        iterators(), stemmers(), stats(), active_stats(NULL),
+        prefix_query(false), has_pending_token(false), pending_token(), pending_start(0), pending_end(0), pending_stemmer(NULL),
 
         constructor_error(SQLITE_OK)
     {
@@ -312,6 +463,10 @@ public:
                 if (i < nargs && strcmp(args[i], "0") == 0) stem_words = false;
                 else stem_words = true;
             }
+            else if (strcmp(args[i], "prefix_tokens") == 0) {
+                i++;
+                prefix_tokens = !(i < nargs && strcmp(args[i], "0") == 0);
+            }
         }
         if (remove_diacritics) {
             icu::ErrorCode status;
@@ -328,6 +483,20 @@ public:
     }
 
     int tokenize(void *callback_ctx, int flags, const char *text, int text_sz, token_callback_func callback) {
+        active_stats = stats_enabled.load(std::memory_order_relaxed) ? &stats : NULL;
+        int rc = tokenize_text(callback_ctx, flags, text, text_sz, callback);
+        if (active_stats) {
+            stats.calls++; stats.bytes += text_sz;
+            std::lock_guard<std::mutex> lock(global_mutex);
+            global_stats.add(stats);
+            stats.reset();
+            active_stats = NULL;
+        }
+        return rc;
+    }
+
+private:
+    int tokenize_text(void *callback_ctx, int flags, const char *text, int text_sz, token_callback_func callback) {
         ensure_basic_iterator();
         current_callback = callback; current_callback_ctx = callback_ctx;
         icu::UnicodeString str(text_sz, 0, 0);
@@ -337,6 +506,8 @@ public:
         int32_t offset = str.getChar32Start(0);
         int rc = SQLITE_OK;
         bool for_query = (flags & FTS5_TOKENIZE_QUERY) != 0;
+        prefix_query = for_query && (flags & FTS5_TOKENIZE_PREFIX) != 0;
+        has_pending_token = false;
         IteratorDescription state;
         state.language = ""; state.script = USCRIPT_COMMON;
         int32_t start_script_block_at = offset;
@@ -359,10 +530,788 @@ public:
         if (offset > start_script_block_at) {
             rc = tokenize_script_block(str, start_script_block_at, offset, for_query, callback, callback_ctx, word_iterator, stemmer);
         }
+        if (rc == SQLITE_OK) rc = flush_pending_token(true);
         return rc;
     }
 };
 
+// Collations {{{
+// Locale used for the icucollate collation, empty means use the UI language
+static char sort_locale[64] = {0};
+static bool numeric_collation = false;
+
+static UCollator*
+create_sort_collator(void) {
+    char loc[sizeof(sort_locale)];
+    bool numeric;
+    {
+        std::lock_guard<std::mutex> lock(global_mutex);
+        strncpy(loc, sort_locale[0] ? sort_locale : ui_language, sizeof(loc) - 1);
+        loc[sizeof(loc) - 1] = 0;
+        numeric = numeric_collation;
+    }
+    UErrorCode status = U_ZERO_ERROR;
+    UCollator *collator = ucol_open(loc, &status);
+    if (U_FAILURE(status)) {
+        status = U_ZERO_ERROR;
+        collator = ucol_open("en", &status);
+        if (U_FAILURE(status)) return NULL;
+    }
+    // Same settings as sort_collator() in calibre.utils.icu
+    ucol_setStrength(collator, UCOL_SECONDARY);
+    ucol_setAttribute(collator, UCOL_NUMERIC_COLLATION, numeric ? UCOL_ON : UCOL_OFF, &status);
+    return collator;
+}
+
+static void
+free_sort_collator(void *collator) { ucol_close(reinterpret_cast<UCollator*>(collator)); }
+
+static int
+compare_bytes(int la, const void *a, int lb, const void *b) {
+    int ans = memcmp(a, b, std::min(la, lb));
+    return ans ? ans : la - lb;
+}
+
+static int
+icu_collate(void *collator, int la, const void *a, int lb, const void *b) {
+    UErrorCode status = U_ZERO_ERROR;
+    UCollationResult ans = ucol_strcollUTF8(reinterpret_cast<UCollator*>(collator), reinterpret_cast<const char*>(a), la, reinterpret_cast<const char*>(b), lb, &status);
+    if (U_FAILURE(status)) return compare_bytes(la, a, lb, b);
+    return ans;
+}
+
+static int
+nocase_collate(void *ctx, int la, const void *pa, int lb, const void *pb) {
+    const unsigned char *a = reinterpret_cast<const unsigned char*>(pa), *b = reinterpret_cast<const unsigned char*>(pb);
+    // ASCII fast path, case folding is per code point, so once a non-ASCII
+    // byte is seen both strings are at a code point boundary and only the
+    // remainders need to be compared using ICU
+    int n = std::min(la, lb), i = 0;
+    for (; i < n; i++) {
+        unsigned char ca = a[i], cb = b[i];
+        if (ca >= 0x80 || cb >= 0x80) break;
+        if ('A' <= ca && ca <= 'Z') ca += 'a' - 'A';
+        if ('A' <= cb && cb <= 'Z') cb += 'a' - 'A';
+        if (ca != cb) return ca < cb ? -1 : 1;
+    }
+    if (i == n) return la == lb ? 0 : (la < lb ? -1 : 1);
+    icu::UnicodeString ua = icu::UnicodeString::fromUTF8(icu::StringPiece(reinterpret_cast<const char*>(a + i), la - i));
+    icu::UnicodeString ub = icu::UnicodeString::fromUTF8(icu::StringPiece(reinterpret_cast<const char*>(b + i), lb - i));
+    return ua.caseCompare(ub, U_FOLD_CASE_DEFAULT | U_COMPARE_CODE_POINT_ORDER);
+}
+
+static int
+register_collations(sqlite3 *db) {
+    UCollator *collator = create_sort_collator();
+    if (!collator) return SQLITE_ERROR;
+    int rc = sqlite3_create_collation_v2(db, "icucollate", SQLITE_UTF8, collator, icu_collate, free_sort_collator);
+    if (rc != SQLITE_OK) return rc;
+    return sqlite3_create_collation(db, "PYNOCASE", SQLITE_UTF8, NULL, nocase_collate);
+}
+// }}}
+
+// Title and author sort functions {{{
+// Native ports of title_sort() and author_to_author_sort() from
+// calibre.ebooks.metadata. The tweak values they depend on are set from
+// python via set_title_sort_config() and set_author_sort_config() and every
+// connection takes a snapshot of them when the extension is loaded into it.
+typedef std::unordered_set<std::string> WordSet;
+
+struct AuthorSortConfig {
+    std::string method;
+    bool use_surname_prefixes;
+    WordSet copy_words, surname_prefixes, name_prefixes, name_suffixes;
+    AuthorSortConfig() : method("invert"), use_surname_prefixes(false), copy_words(), surname_prefixes(), name_prefixes(), name_suffixes() {}
+};
+
+struct TitleSortConfig {
+    bool strictly_alphabetic;
+    std::unique_ptr<icu::RegexMatcher> articles;
+    std::mutex lock;
+    TitleSortConfig() : strictly_alphabetic(false), articles(), lock() {}
+};
+
+static AuthorSortConfig author_sort_config;
+static std::string title_sort_order("library_order");
+static icu::UnicodeString title_sort_articles(u"^(A\\s+|The\\s+|An\\s+)");
+
+static icu::RegexMatcher*
+compile_title_sort_articles(const icu::UnicodeString &pattern) {
+    UErrorCode status = U_ZERO_ERROR;
+    std::unique_ptr<icu::RegexMatcher> ans(new icu::RegexMatcher(pattern, UREGEX_CASE_INSENSITIVE, status));
+    if (U_FAILURE(status)) return NULL;
+    return ans.release();
+}
+
+static inline bool
+is_py_whitespace(UChar32 ch) {
+    // Same as str.isspace() which includes the information separators
+    return u_isUWhiteSpace(ch) || (0x1c <= ch && ch <= 0x1f);
+}
+
+static icu::UnicodeString
+py_strip(const icu::UnicodeString &src) {
+    int32_t start = 0, limit = src.length();
+    while (start < limit && is_py_whitespace(src.char32At(start))) start = src.moveIndex32(start, 1);
+    while (limit > start) {
+        int32_t prev = src.moveIndex32(limit, -1);
+        if (!is_py_whitespace(src.char32At(prev))) break;
+        limit = prev;
+    }
+    return icu::UnicodeString(src, start, limit - start);
+}
+
+static std::vector<icu::UnicodeString>
+py_split(const icu::UnicodeString &src) {
+    std::vector<icu::UnicodeString> ans;
+    int32_t pos = 0, limit = src.length();
+    while (pos < limit) {
+        while (pos < limit && is_py_whitespace(src.char32At(pos))) pos = src.moveIndex32(pos, 1);
+        if (pos >= limit) break;
+        int32_t start = pos;
+        while (pos < limit && !is_py_whitespace(src.char32At(pos))) pos = src.moveIndex32(pos, 1);
+        ans.emplace_back(src, start, pos - start);
+    }
+    return ans;
+}
+
+static bool
+in_word_set(const WordSet &words, const icu::UnicodeString &word) {
+    if (words.empty()) return false;
+    icu::UnicodeString lw(word);
+    lw.toLower(icu::Locale::getRoot());
+    std::string key;
+    lw.toUTF8String(key);
+    return words.find(key) != words.end();
+}
+
+static icu::UnicodeString
+remove_bracketed_text(const icu::UnicodeString &src) {
+    static const UChar32 openers[] = {'(', '[', '{'}, closers[] = {')', ']', '}'};
+    int counts[3] = {0}, total = 0;
+    icu::UnicodeString ans;
+    for (int32_t i = 0; i < src.length(); i = src.moveIndex32(i, 1)) {
+        UChar32 ch = src.char32At(i);
+        bool handled = false;
+        for (size_t b = 0; b < arraysz(openers) && !handled; b++) {
+            if (ch == openers[b]) { counts[b]++; total++; handled = true; }
+            else if (ch == closers[b]) {
+                if (counts[b] > 0) { counts[b]--; total--; }
+                handled = true;
+            }
+        }
+        if (!handled && total < 1) ans.append(ch);
+    }
+    return ans;
+}
+
+static icu::UnicodeString
+author_to_author_sort(const icu::UnicodeString &author, const AuthorSortConfig &c) {
+    if (author.isEmpty() || c.method == "copy") return author;
+    icu::UnicodeString sauthor = py_strip(remove_bracketed_text(author));
+    if (c.method == "comma" && sauthor.indexOf((UChar)',') > -1) return author;
+    std::vector<icu::UnicodeString> tokens = py_split(sauthor);
+    if (tokens.size() < 2) return author;
+    for (const auto &t : tokens) {
+        if (in_word_set(c.copy_words, t)) return author;
+    }
+    if (c.use_surname_prefixes && tokens.size() == 2 && in_word_set(c.surname_prefixes, tokens[0])) return author;
+
+    size_t first = 0;
+    while (first < tokens.size() && in_word_set(c.name_prefixes, tokens[first])) first++;
+    if (first >= tokens.size()) return author;
+    ptrdiff_t last = tokens.size() - 1;
+    while (last >= (ptrdiff_t)first && in_word_set(c.name_suffixes, tokens[last])) last--;
+    if (last < (ptrdiff_t)first) return author;
+
+    icu::UnicodeString suffix;
+    for (size_t i = last + 1; i < tokens.size(); i++) {
+        if (i > (size_t)last + 1) suffix.append((UChar)' ');
+        suffix.append(tokens[i]);
+    }
+    if (c.use_surname_prefixes && last > (ptrdiff_t)first && in_word_set(c.surname_prefixes, tokens[last - 1])) {
+        tokens[last - 1].append((UChar)' ').append(tokens[last]);
+        last--;
+    }
+    icu::UnicodeString ans(tokens[last]);
+    size_t num_toks = 1 + last - first;
+    if (c.method != "nocomma" && num_toks > 1) ans.append((UChar)',');
+    for (size_t i = first; i < (size_t)last; i++) ans.append((UChar)' ').append(tokens[i]);
+    if (!suffix.isEmpty()) ans.append((UChar)' ').append(suffix);
+    return ans;
+}
+
+static bool
+remove_quotes(icu::UnicodeString &title) {
+    // See quote_pairs in calibre.ebooks.metadata
+    if (title.isEmpty()) return false;
+    const char16_t *closers = NULL;
+    switch (title.char32At(0)) {
+        case u'"': closers = u"\""; break;
+        case u'\'': closers = u"'"; break;
+        case u'“': closers = u"”“"; break;
+        case u'”': closers = u"”"; break;
+        case u'„': closers = u"”“"; break;
+        case u'‚': case u'’': case u'‘': closers = u"’‘"; break;
+        case u'‹': closers = u"›"; break;
+        case u'›': closers = u"‹"; break;
+        case u'《': closers = u"》"; break;
+        case u'〈': closers = u"〉"; break;
+        case u'»': case u'«': closers = u"«»"; break;
+        case u'「': closers = u"」"; break;
+        case u'『': closers = u"』"; break;
+        default: return false;
+    }
+    title.remove(0, 1);
+    if (!title.isEmpty()) {
+        UChar last = title.charAt(title.length() - 1);
+        for (const char16_t *q = closers; *q; q++) {
+            if (last == *q) { title.truncate(title.length() - 1); break; }
+        }
+    }
+    return true;
+}
+
+static icu::UnicodeString
+title_sort(const icu::UnicodeString &raw, TitleSortConfig &c) {
+    icu::UnicodeString title = py_strip(raw);
+    if (c.strictly_alphabetic) return title;
+    remove_quotes(title);
+    icu::UnicodeString prep;
+    {
+        std::lock_guard<std::mutex> lock(c.lock);
+        UErrorCode status = U_ZERO_ERROR;
+        c.articles->reset(title);
+        if (c.articles->groupCount() > 0 && c.articles->find(0, status) && U_SUCCESS(status)) {
+            int32_t start = c.articles->start(1, status), end = c.articles->end(1, status);
+            if (U_SUCCESS(status) && start > -1 && end > start) prep = icu::UnicodeString(title, start, end - start);
+        }
+        c.articles->reset(icu::UnicodeString());
+    }
+    if (!prep.isEmpty()) {
+        title.remove(0, prep.length()).append(u", ").append(prep);
+        remove_quotes(title);
+    }
+    return py_strip(title);
+}
+
+static void
+set_text_result(sqlite3_context *ctx, const icu::UnicodeString &ans) {
+    std::string buf;
+    ans.toUTF8String(buf);
+    sqlite3_result_text(ctx, buf.data(), (int)buf.size(), SQLITE_TRANSIENT);
+}
+
+static void
+title_sort_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const char *text = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    if (!text) { sqlite3_result_null(ctx); return; }
+    try {
+        set_text_result(ctx, title_sort(icu::UnicodeString::fromUTF8(icu::StringPiece(text, sqlite3_value_bytes(argv[0]))), *reinterpret_cast<TitleSortConfig*>(sqlite3_user_data(ctx))));
+    } catch (std::bad_alloc const&) {
+        sqlite3_result_error_nomem(ctx);
+    }
+}
+
+static void
+author_sort_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const char *text = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    if (!text) { sqlite3_result_text(ctx, "", 0, SQLITE_STATIC); return; }
+    try {
+        icu::UnicodeString author = icu::UnicodeString::fromUTF8(icu::StringPiece(text, sqlite3_value_bytes(argv[0])));
+        author.findAndReplace(u"|", u",");
+        set_text_result(ctx, author_to_author_sort(author, *reinterpret_cast<AuthorSortConfig*>(sqlite3_user_data(ctx))));
+    } catch (std::bad_alloc const&) {
+        sqlite3_result_error_nomem(ctx);
+    }
+}
+
+static void free_title_sort_config(void *p) { delete reinterpret_cast<TitleSortConfig*>(p); }
+static void free_author_sort_config(void *p) { delete reinterpret_cast<AuthorSortConfig*>(p); }
+
+static int
+register_sort_functions(sqlite3 *db) {
+    std::unique_ptr<TitleSortConfig> tc(new TitleSortConfig());
+    std::unique_ptr<AuthorSortConfig> ac;
+    {
+        std::lock_guard<std::mutex> lock(global_mutex);
+        tc->strictly_alphabetic = title_sort_order == "strictly_alphabetic";
+        tc->articles.reset(compile_title_sort_articles(title_sort_articles));
+        ac.reset(new AuthorSortConfig(author_sort_config));
+    }
+    if (!tc->articles) return SQLITE_ERROR;
+    int rc = sqlite3_create_function_v2(db, "title_sort", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, tc.get(), title_sort_func, NULL, NULL, free_title_sort_config);
+    tc.release();  // sqlite calls the destructor even on failure
+    if (rc != SQLITE_OK) return rc;
+    rc = sqlite3_create_function_v2(db, "author_to_author_sort", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, ac.get(), author_sort_func, NULL, NULL, free_author_sort_config);
+    ac.release();
+    return rc;
+}
+// }}}
+
+// Aggregate functions {{{
+// Native versions of the concatenation aggregates that used to be
+// implemented in python in db/backend.py (and in C in
+// library/sqlite_custom.c for the legacy database).
+
+template<typename T> static T*
+aggregate_data(sqlite3_context *ctx) {
+    T **p = reinterpret_cast<T**>(sqlite3_aggregate_context(ctx, sizeof(T*)));
+    if (!p) return NULL;
+    if (!*p) *p = new (std::nothrow) T();
+    return *p;
+}
+
+template<typename T> static std::unique_ptr<T>
+take_aggregate_data(sqlite3_context *ctx) {
+    T **p = reinterpret_cast<T**>(sqlite3_aggregate_context(ctx, 0));
+    std::unique_ptr<T> ans(p ? *p : NULL);
+    if (p) *p = NULL;
+    return ans;
+}
+
+static inline void
+append_value(std::string &dest, sqlite3_value *val) {
+    const char *text = reinterpret_cast<const char*>(sqlite3_value_text(val));
+    if (text) dest.append(text, sqlite3_value_bytes(val));
+}
+
+typedef std::map<sqlite3_int64, std::string> SortedValues;
+typedef std::vector<std::string> Values;
+static inline const std::string& get_value(const std::string &x) { return x; }
+static inline const std::string& get_value(const SortedValues::value_type &x) { return x.second; }
+
+template<typename T> static void
+join_values(sqlite3_context *ctx, const T &vals, const char *sep) {
+    std::string ans;
+    size_t sz = 0, sep_sz = strlen(sep);
+    for (const auto &x : vals) sz += get_value(x).size() + sep_sz;
+    ans.reserve(sz);
+    for (auto it = vals.begin(); it != vals.end(); ++it) {
+        if (it != vals.begin()) ans.append(sep, sep_sz);
+        ans.append(get_value(*it));
+    }
+    sqlite3_result_text(ctx, ans.data(), (int)ans.size(), SQLITE_TRANSIENT);
+}
+
+static void
+sort_concat_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) return;
+    SortedValues *vals = aggregate_data<SortedValues>(ctx);
+    if (!vals) { sqlite3_result_error_nomem(ctx); return; }
+    try {
+        std::string &dest = (*vals)[sqlite3_value_int64(argv[0])];
+        dest.clear();
+        append_value(dest, argv[1]);
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static void
+aum_sort_concat_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) return;
+    SortedValues *vals = aggregate_data<SortedValues>(ctx);
+    if (!vals) { sqlite3_result_error_nomem(ctx); return; }
+    try {
+        std::string &dest = (*vals)[sqlite3_value_int64(argv[0])];
+        dest.clear();
+        append_value(dest, argv[1]); dest.append(":::");
+        append_value(dest, argv[2]); dest.append(":::");
+        append_value(dest, argv[3]);
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static void
+sort_concat_final(sqlite3_context *ctx) {
+    std::unique_ptr<SortedValues> vals = take_aggregate_data<SortedValues>(ctx);
+    if (!vals || vals->empty()) { sqlite3_result_null(ctx); return; }
+    try {
+        join_values(ctx, *vals, reinterpret_cast<const char*>(sqlite3_user_data(ctx)));
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static void
+concat_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) return;
+    }
+    Values *vals = aggregate_data<Values>(ctx);
+    if (!vals) { sqlite3_result_error_nomem(ctx); return; }
+    try {
+        vals->emplace_back();
+        append_value(vals->back(), argv[0]);
+        // identifiers_concat(key, val) produces key:val
+        if (argc > 1) { vals->back().push_back(':'); append_value(vals->back(), argv[1]); }
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static void
+concat_final(sqlite3_context *ctx) {
+    std::unique_ptr<Values> vals = take_aggregate_data<Values>(ctx);
+    if (!vals || vals->empty()) { sqlite3_result_null(ctx); return; }
+    try {
+        join_values(ctx, *vals, ",");
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static void
+identifiers_concat_final(sqlite3_context *ctx) {
+    std::unique_ptr<Values> vals = take_aggregate_data<Values>(ctx);
+    if (!vals || vals->empty()) { sqlite3_result_text(ctx, "", 0, SQLITE_STATIC); return; }
+    try {
+        join_values(ctx, *vals, ",");
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); }
+}
+
+static int
+register_aggregate_functions(sqlite3 *db) {
+    static const char *comma = ",", *bar = "|", *amper = "&", *aum_sep = ":#:";
+    int rc;
+#define A(name, nargs, user_data, step, final) if ((rc = sqlite3_create_function(db, name, nargs, SQLITE_UTF8, (void*)user_data, NULL, step, final)) != SQLITE_OK) return rc;
+    A("sortconcat", 2, comma, sort_concat_step, sort_concat_final);
+    A("sortconcat_bar", 2, bar, sort_concat_step, sort_concat_final);
+    A("sortconcat_amper", 2, amper, sort_concat_step, sort_concat_final);
+    A("aum_sortconcat", 4, aum_sep, aum_sort_concat_step, sort_concat_final);
+    A("identifiers_concat", 2, NULL, concat_step, identifiers_concat_final);
+    A("concat", 1, NULL, concat_step, concat_final);
+#undef A
+    return SQLITE_OK;
+}
+// }}}
+
+// Book id filters {{{
+// A compressed set of book ids in the style of roaring bitmaps: ids are
+// grouped by their upper 16 bits and each group is stored either as a sorted
+// array of the lower 16 bits or, when dense, as a 65536 bit bitmap. Sets are
+// immutable once built, filters are changed by atomically replacing the set.
+class BookIdSet {
+private:
+    static const size_t MAX_ARRAY_SIZE = 4096;
+    struct Container {
+        std::vector<uint16_t> values;
+        std::vector<uint64_t> bits;
+        bool contains(uint16_t x) const {
+            if (!bits.empty()) return (bits[x >> 6] >> (x & 63)) & 1;
+            return std::binary_search(values.begin(), values.end(), x);
+        }
+    };
+    std::vector<uint16_t> keys;
+    std::vector<Container> containers;
+    size_t count;
+
+public:
+    BookIdSet() : keys(), containers(), count(0) {}
+    explicit BookIdSet(std::vector<uint32_t> &ids) : keys(), containers(), count(0) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        count = ids.size();
+        for (size_t i = 0; i < ids.size();) {
+            uint16_t key = ids[i] >> 16;
+            size_t limit = i;
+            while (limit < ids.size() && (ids[limit] >> 16) == key) limit++;
+            keys.push_back(key);
+            containers.emplace_back();
+            Container &c = containers.back();
+            if (limit - i > MAX_ARRAY_SIZE) {
+                c.bits.resize(65536 / 64);
+                for (; i < limit; i++) { uint16_t x = ids[i] & 0xffff; c.bits[x >> 6] |= (uint64_t)1 << (x & 63); }
+            } else {
+                c.values.reserve(limit - i);
+                for (; i < limit; i++) c.values.push_back(ids[i] & 0xffff);
+            }
+        }
+    }
+    size_t size() const { return count; }
+
+    bool contains(sqlite3_int64 id) const {
+        if (id < 0 || id > UINT32_MAX) return false;
+        uint16_t key = (uint16_t)(id >> 16);
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        if (it == keys.end() || *it != key) return false;
+        return containers[it - keys.begin()].contains(id & 0xffff);
+    }
+};
+typedef std::shared_ptr<const BookIdSet> BookIdSetPtr;
+
+struct BookIdFilter {
+    BookIdSetPtr ids;  // accessed only via std::atomic_load/std::atomic_store
+    BookIdFilter() : ids(std::make_shared<const BookIdSet>()) {}
+    BookIdSetPtr current() const { return std::atomic_load(&ids); }
+};
+typedef std::shared_ptr<BookIdFilter> BookIdFilterPtr;
+
+static std::unordered_map<std::string, BookIdFilterPtr> book_id_filters;
+static std::mutex book_id_filters_mutex;
+
+static BookIdFilterPtr
+book_id_filter_for_name(const std::string &name) {
+    std::lock_guard<std::mutex> lock(book_id_filters_mutex);
+    auto it = book_id_filters.find(name);
+    if (it == book_id_filters.end()) it = book_id_filters.emplace(name, std::make_shared<BookIdFilter>()).first;
+    return it->second;
+}
+
+static void free_book_id_set(void *p) { delete reinterpret_cast<BookIdSetPtr*>(p); }
+static void free_book_id_filter(void *p) { delete reinterpret_cast<BookIdFilterPtr*>(p); }
+
+static void
+book_id_filter_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    // book_id_filter(filter_name, book_id), the set is looked up once per
+    // statement and cached as auxdata on the constant filter name argument
+    BookIdSetPtr *ids = reinterpret_cast<BookIdSetPtr*>(sqlite3_get_auxdata(ctx, 0));
+    if (!ids) {
+        const char *name = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+        if (!name) { sqlite3_result_int(ctx, 0); return; }
+        try {
+            ids = new BookIdSetPtr(book_id_filter_for_name(std::string(name, sqlite3_value_bytes(argv[0])))->current());
+        } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); return; }
+        sqlite3_set_auxdata(ctx, 0, ids, free_book_id_set);
+        ids = reinterpret_cast<BookIdSetPtr*>(sqlite3_get_auxdata(ctx, 0));
+        if (!ids) { sqlite3_result_error_nomem(ctx); return; }
+    }
+    sqlite3_result_int(ctx, (*ids)->contains(sqlite3_value_int64(argv[1])) ? 1 : 0);
+}
+
+static void
+named_book_id_filter_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const BookIdFilterPtr &f = *reinterpret_cast<BookIdFilterPtr*>(sqlite3_user_data(ctx));
+    sqlite3_result_int(ctx, f->current()->contains(sqlite3_value_int64(argv[0])) ? 1 : 0);
+}
+
+static void
+create_book_id_filter_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    // create_book_id_filter(function_name, filter_name) creates the SQL
+    // function function_name(book_id) on the current connection
+    const char *func_name = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    const char *name = reinterpret_cast<const char*>(sqlite3_value_text(argv[1]));
+    if (!func_name || !name) { sqlite3_result_error(ctx, "function and filter names must not be NULL", -1); return; }
+    BookIdFilterPtr *f;
+    try {
+        f = new BookIdFilterPtr(book_id_filter_for_name(std::string(name, sqlite3_value_bytes(argv[1]))));
+    } catch (std::bad_alloc const&) { sqlite3_result_error_nomem(ctx); return; }
+    int rc = sqlite3_create_function_v2(sqlite3_context_db_handle(ctx), func_name, 1, SQLITE_UTF8, f, named_book_id_filter_func, NULL, NULL, free_book_id_filter);
+    if (rc != SQLITE_OK) sqlite3_result_error_code(ctx, rc);
+    else sqlite3_result_null(ctx);
+}
+
+static void
+books_list_filter_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) { sqlite3_result_int(ctx, 1); }
+
+static int
+register_book_id_filter_functions(sqlite3 *db) {
+    int rc = sqlite3_create_function(db, "book_id_filter", 2, SQLITE_UTF8, NULL, book_id_filter_func, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "create_book_id_filter", 2, SQLITE_UTF8, NULL, create_book_id_filter_func, NULL, NULL);
+    // Dummy filter used in the tag browser views
+    if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "books_list_filter", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, books_list_filter_func, NULL, NULL);
+    return rc;
+}
+// }}}
+
+// Regular expressions {{{
+// Search using ICU regular expressions directly on UTF-8 text, without
+// converting it to UTF-16 first. Only \n is a line terminator for ., ^ and $
+// as with the regex module used by calibre.db.search
+class Regex {
+private:
+    std::unique_ptr<icu::RegexPattern> pattern;
+    std::unique_ptr<icu::RegexMatcher> matcher;
+
+public:
+    UErrorCode status;
+    UParseError parse_error;
+
+    Regex(const char *pat, int32_t sz, bool case_sensitive) : pattern(), matcher(), status(U_ZERO_ERROR), parse_error() {
+        UText ut = UTEXT_INITIALIZER;
+        utext_openUTF8(&ut, pat, sz, &status);
+        if (U_FAILURE(status)) return;
+        pattern.reset(icu::RegexPattern::compile(&ut, UREGEX_UNIX_LINES | (case_sensitive ? 0 : UREGEX_CASE_INSENSITIVE), parse_error, status));
+        utext_close(&ut);
+        if (U_FAILURE(status)) { pattern.reset(); return; }
+        matcher.reset(pattern->matcher(status));
+        if (U_FAILURE(status)) matcher.reset();
+    }
+
+    explicit operator bool() const noexcept { return matcher.get() != NULL; }
+    const char* error_name() const { return u_errorName(status); }
+
+    // Returns 1 on match, 0 on no match and -1 on error
+    int search(const char *text, int32_t sz) {
+        UErrorCode err = U_ZERO_ERROR;
+        UText ut = UTEXT_INITIALIZER;
+        utext_openUTF8(&ut, text, sz, &err);
+        if (U_FAILURE(err)) return -1;
+        matcher->reset(&ut);
+        bool found = matcher->find(err);
+        utext_close(&ut);
+        return U_FAILURE(err) ? -1 : (found ? 1 : 0);
+    }
+
+    int search(const icu::UnicodeString &text) {
+        UErrorCode err = U_ZERO_ERROR;
+        matcher->reset(text);
+        bool found = matcher->find(err);
+        return U_FAILURE(err) ? -1 : (found ? 1 : 0);
+    }
+};
+
+static void free_regex(void *p) { delete reinterpret_cast<Regex*>(p); }
+
+static void
+regexp_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    // regexp(pattern, value[, case_sensitive=1]) this is what the X REGEXP Y
+    // operator calls. The compiled pattern is cached for the whole statement.
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) { sqlite3_result_null(ctx); return; }
+    Regex *re = reinterpret_cast<Regex*>(sqlite3_get_auxdata(ctx, 0));
+    if (!re) {
+        const char *pat = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+        if (!pat) { sqlite3_result_null(ctx); return; }
+        bool case_sensitive = argc < 3 || sqlite3_value_int(argv[2]) != 0;
+        re = new (std::nothrow) Regex(pat, sqlite3_value_bytes(argv[0]), case_sensitive);
+        if (!re) { sqlite3_result_error_nomem(ctx); return; }
+        if (!*re) {
+            char *msg = sqlite3_mprintf("Invalid regular expression: %s with error: %s", pat, re->error_name());
+            sqlite3_result_error(ctx, msg ? msg : "Invalid regular expression", -1);
+            sqlite3_free(msg);
+            delete re;
+            return;
+        }
+        sqlite3_set_auxdata(ctx, 0, re, free_regex);
+        // sqlite may have freed re already if it could not be cached
+        re = reinterpret_cast<Regex*>(sqlite3_get_auxdata(ctx, 0));
+        if (!re) { sqlite3_result_error_nomem(ctx); return; }
+    }
+    const char *text = reinterpret_cast<const char*>(sqlite3_value_text(argv[1]));
+    int ans = re->search(text ? text : "", sqlite3_value_bytes(argv[1]));
+    if (ans < 0) sqlite3_result_error(ctx, "Failed to search with regular expression", -1);
+    else sqlite3_result_int(ctx, ans);
+}
+
+static int
+register_regexp_functions(sqlite3 *db) {
+    int rc = sqlite3_create_function(db, "regexp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, regexp_func, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "regexp", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, regexp_func, NULL, NULL);
+    return rc;
+}
+// }}}
+
+// Library search {{{
+// Native version of _match() from calibre.db.search. The query is compiled
+// once and then matched against any number of values, all without the GIL.
+enum { CONTAINS_MATCH = 0, EQUALS_MATCH = 1, REGEXP_MATCH = 2, ACCENT_MATCH = 3 };
+
+class ValueMatcher {
+private:
+    int kind;
+    bool case_sensitive, internal_match_ok;
+    icu::Locale locale;
+    icu::UnicodeString query, sub_query, text;
+    std::unique_ptr<Regex> regex;
+    UCollator *collator;
+    UStringSearch *search;
+
+    static bool is_space(UChar ch) { return u_isspace(ch); }
+
+    // Is sub_query one of the "." separated, stripped components of text
+    bool component_matches() const {
+        const int32_t len = text.length();
+        for (int32_t start = 0; start <= len; ) {
+            int32_t end = text.indexOf((UChar)'.', start);
+            if (end < 0) end = len;
+            int32_t a = start, b = end;
+            while (a < b && is_space(text.charAt(a))) a++;
+            while (b > a && is_space(text.charAt(b - 1))) b--;
+            if (b > a && text.compare(a, b - a, sub_query) == 0) return true;
+            start = end + 1;
+        }
+        return false;
+    }
+
+public:
+    std::string error;
+
+    ValueMatcher(const char *q, int32_t qsz, int kind, bool case_sensitive, const char *loc, const UCollator *col) :
+        kind(kind), case_sensitive(case_sensitive), internal_match_ok(false), locale(loc), query(), sub_query(), text(),
+        regex(), collator(NULL), search(NULL), error()
+    {
+        if (qsz > 1 && q[0] == '.' && q[1] == '.') {
+            q++; qsz--;
+            internal_match_ok = true;
+        }
+        if (kind == REGEXP_MATCH) {
+            regex.reset(new Regex(q, qsz, case_sensitive));
+            if (!*regex) error = std::string("Invalid regular expression: ") + regex->error_name();
+            return;
+        }
+        query = icu::UnicodeString::fromUTF8(icu::StringPiece(q, qsz));
+        if (internal_match_ok) sub_query = query.tempSubString(1);
+        if (kind == EQUALS_MATCH && query.isEmpty()) { error = "Empty query"; return; }
+        if (kind == ACCENT_MATCH && !col) { error = "A collator is needed for accent insensitive matching"; return; }
+        if (col && (kind == CONTAINS_MATCH || kind == ACCENT_MATCH) && !query.isEmpty()) {
+            // Collators are not thread safe, so use a private clone
+            UErrorCode status = U_ZERO_ERROR;
+#if U_ICU_VERSION_MAJOR_NUM > 70
+            collator = ucol_clone(col, &status);
+#else
+            collator = ucol_safeClone(col, NULL, NULL, &status);
+#endif
+            if (U_SUCCESS(status)) {
+                // The text is replaced for every value, this is just a placeholder
+                search = usearch_openFromCollator(query.getBuffer(), query.length(), query.getBuffer(), query.length(), collator, NULL, &status);
+            }
+            if (U_FAILURE(status)) error = std::string("Failed to create collator search with error: ") + u_errorName(status);
+        }
+    }
+
+    ~ValueMatcher() {
+        if (search) usearch_close(search);
+        if (collator) ucol_close(collator);
+        search = NULL; collator = NULL;
+    }
+
+    ValueMatcher(const ValueMatcher&) = delete;
+    ValueMatcher& operator=(const ValueMatcher&) = delete;
+
+    explicit operator bool() const noexcept { return error.empty(); }
+    // With a ".." prefix only the first value of every item is checked, like _match()
+    bool first_value_only() const noexcept { return internal_match_ok && kind == EQUALS_MATCH; }
+
+    // Returns 1 on match, 0 on no match and -1 on error
+    int matches(const char *val, int32_t sz) {
+        if (kind == REGEXP_MATCH && case_sensitive) return regex->search(val, sz);
+        text = icu::UnicodeString::fromUTF8(icu::StringPiece(val, sz));
+        if (kind == REGEXP_MATCH) {
+            // Like _match() search the lower cased value, which matters for
+            // things like \p{Lu} and characters whose lower case form is
+            // longer, such as İ
+            text.toLower(locale);
+            return regex->search(text);
+        }
+        if (kind == CONTAINS_MATCH || kind == ACCENT_MATCH) {
+            if (query.isEmpty()) return 1;
+            if (search) {
+                // Primary strength collation ignores case, so no lowercasing is needed
+                if (text.isEmpty()) return 0;
+                UErrorCode status = U_ZERO_ERROR;
+                usearch_setText(search, text.getBuffer(), text.length(), &status);
+                if (U_FAILURE(status)) return -1;
+                int32_t pos = usearch_first(search, &status);
+                if (U_FAILURE(status)) return -1;
+                return pos == USEARCH_DONE ? 0 : 1;
+            }
+            if (!case_sensitive) text.toLower(locale);
+            return text.indexOf(query) > -1 ? 1 : 0;
+        }
+        if (!case_sensitive) text.toLower(locale);
+        if (internal_match_ok) return (text == query || component_matches()) ? 1 : 0;
+        if (query.charAt(0) == '.') {
+            // Hierarchical match, the query matches the value and all its children
+            const int32_t ql = query.length() - 1;
+            return (text.startsWith(query, 1, ql) && (text.length() == ql || text.charAt(ql) == '.')) ? 1 : 0;
+        }
+        return text == query ? 1 : 0;
+    }
+};
+// }}}
+
 // boilerplate {{{
 static int
 fts5_api_from_db(sqlite3 *db, fts5_api **ppApi) {
@@ -446,6 +1395,26 @@ calibre_sqlite_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_ro
     fts5api->xCreateTokenizer(fts5api, "calibre", reinterpret_cast<void *>(fts5api), &tok, NULL);
     fts5_tokenizer tok2 = {tok_create_with_stemming, tok_delete, tok_tokenize};
     fts5api->xCreateTokenizer(fts5api, "porter", reinterpret_cast<void *>(fts5api), &tok2, NULL);
+    if ((rc = register_collations(db)) != SQLITE_OK) {
+        *pzErrMsg = (char*)"Failed to register ICU collations";
+        return rc;
+    }
+    if ((rc = register_sort_functions(db)) != SQLITE_OK) {
+        *pzErrMsg = (char*)"Failed to register sort functions";
+        return rc;
+    }
+    if ((rc = register_aggregate_functions(db)) != SQLITE_OK) {
+        *pzErrMsg = (char*)"Failed to register aggregate functions";
+        return rc;
+    }
+    if ((rc = register_book_id_filter_functions(db)) != SQLITE_OK) {
+        *pzErrMsg = (char*)"Failed to register book id filter functions";
+        return rc;
+    }
+    if ((rc = register_regexp_functions(db)) != SQLITE_OK) {
+        *pzErrMsg = (char*)"Failed to register regexp functions";
+        return rc;
+    }
     return SQLITE_OK;
 }
 
@@ -485,6 +1454,211 @@ set_ui_language(PyObject *self, PyObject *args) {
     Py_RETURN_NONE;
 }
 
+static PyObject*
+set_sort_collation(PyObject *self, PyObject *args) {
+    const char *val; int numeric = 0;
+    if (!PyArg_ParseTuple(args, "s|p", &val, &numeric)) return NULL;
+    std::lock_guard<std::mutex> lock(global_mutex);
+    strncpy(sort_locale, val, sizeof(sort_locale) - 1);
+    numeric_collation = numeric != 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_title_sort_config(PyObject *self, PyObject *args) {
+    const char *order; PyObject *pattern;
+    if (!PyArg_ParseTuple(args, "sU", &order, &pattern)) return NULL;
+    Py_ssize_t sz;
+    const char *raw = PyUnicode_AsUTF8AndSize(pattern, &sz);
+    if (!raw) return NULL;
+    icu::UnicodeString upat = icu::UnicodeString::fromUTF8(icu::StringPiece(raw, (int32_t)sz));
+    std::unique_ptr<icu::RegexMatcher> m(compile_title_sort_articles(upat));
+    if (!m) {
+        PyErr_Format(PyExc_ValueError, "The title sort articles pattern is not a valid ICU regular expression: %U", pattern);
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(global_mutex);
+    title_sort_order = order;
+    title_sort_articles = upat;
+    Py_RETURN_NONE;
+}
+
+static bool
+word_set_from_python(PyObject *src, WordSet &ans) {
+    pyobject_raii seq(PySequence_Fast(src, "word lists must be sequences"));
+    if (!seq) return false;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq.ptr()); i++) {
+        const char *w = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq.ptr(), i));
+        if (!w) return false;
+        ans.emplace(w);
+    }
+    return true;
+}
+
+static PyObject*
+set_author_sort_config(PyObject *self, PyObject *args) {
+    const char *method; int use_surname_prefixes; PyObject *copy_words, *surname_prefixes, *name_prefixes, *name_suffixes;
+    if (!PyArg_ParseTuple(args, "sOpOOO", &method, &copy_words, &use_surname_prefixes, &surname_prefixes, &name_prefixes, &name_suffixes)) return NULL;
+    AuthorSortConfig c;
+    c.method = method; c.use_surname_prefixes = use_surname_prefixes != 0;
+    if (
+        !word_set_from_python(copy_words, c.copy_words) || !word_set_from_python(surname_prefixes, c.surname_prefixes) ||
+        !word_set_from_python(name_prefixes, c.name_prefixes) || !word_set_from_python(name_suffixes, c.name_suffixes)
+    ) return NULL;
+    std::lock_guard<std::mutex> lock(global_mutex);
+    author_sort_config = c;
+    Py_RETURN_NONE;
+}
+
+// Set a Python exception for an exception captured while the GIL was released
+static PyObject*
+set_python_error(std::exception_ptr err) {
+    try {
+        std::rethrow_exception(err);
+    } catch (std::bad_alloc const&) {
+        PyErr_NoMemory();
+    } catch (std::exception const &e) {
+        PyErr_SetString(PyExc_RuntimeError, e.what());
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "An unknown error occurred");
+    }
+    return NULL;
+}
+
+static PyObject*
+set_book_id_filter(PyObject *self, PyObject *args) {
+    const char *name; PyObject *src;
+    if (!PyArg_ParseTuple(args, "sO", &name, &src)) return NULL;
+    pyobject_raii iter(PyObject_GetIter(src));
+    if (!iter) return NULL;
+    std::vector<uint32_t> ids;
+    Py_ssize_t hint = PyObject_LengthHint(src, 0);
+    if (hint > 0) ids.reserve(hint);
+    PyObject *item;
+    while ((item = PyIter_Next(iter.ptr()))) {
+        unsigned long long val = PyLong_AsUnsignedLongLong(item);
+        Py_DECREF(item);
+        if (val == (unsigned long long)-1 && PyErr_Occurred()) return NULL;
+        if (val > UINT32_MAX) { PyErr_SetString(PyExc_OverflowError, "book ids must fit in 32 bits"); return NULL; }
+        ids.push_back((uint32_t)val);
+    }
+    if (PyErr_Occurred()) return NULL;
+    BookIdSetPtr s;
+    std::exception_ptr err;
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        s = std::make_shared<const BookIdSet>(ids);
+        std::atomic_store(&book_id_filter_for_name(name)->ids, s);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) return set_python_error(err);
+    return PyLong_FromSize_t(s->size());
+}
+
+static PyObject*
+remove_book_id_filter(PyObject *self, PyObject *args) {
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+    std::lock_guard<std::mutex> lock(book_id_filters_mutex);
+    book_id_filters.erase(name);
+    Py_RETURN_NONE;
+}
+
+static bool
+add_match_value(PyObject *val, PyObject *keepalive, Py_ssize_t owner, std::vector<std::pair<const char*, Py_ssize_t>> &texts, std::vector<Py_ssize_t> &owners) {
+    if (PyBytes_Check(val)) {
+        pyobject_raii u(PyUnicode_DecodeUTF8(PyBytes_AS_STRING(val), PyBytes_GET_SIZE(val), "replace"));
+        if (!u || PyList_Append(keepalive, u.ptr()) != 0) return false;
+        val = u.ptr();
+    } else if (!PyUnicode_Check(val)) {
+        PyErr_Format(PyExc_TypeError, "%R is not a string", val);
+        return false;
+    }
+    Py_ssize_t sz;
+    const char *text = PyUnicode_AsUTF8AndSize(val, &sz);
+    if (!text) return false;
+    texts.emplace_back(text, sz);
+    owners.push_back(owner);
+    return true;
+}
+
+static PyObject*
+match_values(PyObject *self, PyObject *args) {
+    PyObject *query, *src, *collator_capsule = Py_None; int kind, case_sensitive = 0; const char *loc = "";
+    if (!PyArg_ParseTuple(args, "UiO|psO", &query, &kind, &src, &case_sensitive, &loc, &collator_capsule)) return NULL;
+    if (kind < CONTAINS_MATCH || kind > ACCENT_MATCH) { PyErr_Format(PyExc_ValueError, "Unknown match kind: %d", kind); return NULL; }
+    const UCollator *collator = NULL;
+    if (collator_capsule != Py_None) {
+        if (!PyCapsule_CheckExact(collator_capsule)) { PyErr_SetString(PyExc_TypeError, "Collator must be a capsule"); return NULL; }
+        if (!(collator = reinterpret_cast<const UCollator*>(PyCapsule_GetPointer(collator_capsule, NULL)))) return NULL;
+    }
+    Py_ssize_t qsz;
+    const char *q = PyUnicode_AsUTF8AndSize(query, &qsz);
+    if (!q) return NULL;
+    // A tuple, so that the strings cannot be changed while the GIL is released
+    pyobject_raii items(PySequence_Tuple(src)), keepalive(PyList_New(0));
+    if (!items || !keepalive) return NULL;
+    const Py_ssize_t num = PyTuple_GET_SIZE(items.ptr());
+    std::vector<std::pair<const char*, Py_ssize_t>> texts;
+    std::vector<Py_ssize_t> owners;
+    texts.reserve(num); owners.reserve(num);
+    for (Py_ssize_t i = 0; i < num; i++) {
+        PyObject *pair = PyTuple_GET_ITEM(items.ptr(), i);
+        if (!PyTuple_Check(pair) || PyTuple_GET_SIZE(pair) != 2) { PyErr_Format(PyExc_TypeError, "Item at index %zd is not a (value, book_ids) pair", i); return NULL; }
+        PyObject *val = PyTuple_GET_ITEM(pair, 0);
+        if (val == Py_None) continue;
+        if (PyUnicode_Check(val) || PyBytes_Check(val)) {
+            if (!add_match_value(val, keepalive.ptr(), i, texts, owners)) return NULL;
+        } else {
+            pyobject_raii seq(PySequence_Fast(val, "Values must be strings or sequences of strings"));
+            if (!seq) return NULL;
+            // Keep the sequence alive as it may be a temporary list
+            if (PyList_Append(keepalive.ptr(), seq.ptr()) != 0) return NULL;
+            for (Py_ssize_t j = 0; j < PySequence_Fast_GET_SIZE(seq.ptr()); j++) {
+                if (!add_match_value(PySequence_Fast_GET_ITEM(seq.ptr(), j), keepalive.ptr(), i, texts, owners)) return NULL;
+            }
+        }
+    }
+    std::vector<Py_ssize_t> matched;
+    std::string error;
+    bool ok = true;
+    std::exception_ptr err;
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        ValueMatcher m(q, (int32_t)qsz, kind, case_sensitive != 0, loc, collator);
+        if (m) {
+            const bool first_value_only = m.first_value_only();
+            for (size_t i = 0; ok && i < texts.size(); i++) {
+                const Py_ssize_t owner = owners[i];
+                // Values of an item are consecutive, skip the rest once one matches
+                if (!matched.empty() && matched.back() == owner) continue;
+                if (first_value_only && i > 0 && owners[i-1] == owner) continue;
+                int r = m.matches(texts[i].first, (int32_t)texts[i].second);
+                if (r < 0) ok = false;
+                else if (r) matched.push_back(owner);
+            }
+        } else error = m.error;
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) return set_python_error(err);
+    if (!error.empty()) { PyErr_Format(PyExc_ValueError, "%s for query: %R", error.c_str(), query); return NULL; }
+    if (!ok) { PyErr_SetString(PyExc_RuntimeError, "Failed to match values"); return NULL; }
+    pyobject_raii ans(PySet_New(NULL));
+    if (!ans) return NULL;
+    for (Py_ssize_t owner : matched) {
+        pyobject_raii it(PyObject_GetIter(PyTuple_GET_ITEM(PyTuple_GET_ITEM(items.ptr(), owner), 1)));
+        if (!it) return NULL;
+        PyObject *book_id;
+        while ((book_id = PyIter_Next(it.ptr()))) {
+            int rc = PySet_Add(ans.ptr(), book_id);
+            Py_DECREF(book_id);
+            if (rc != 0) return NULL;
+        }
+        if (PyErr_Occurred()) return NULL;
+    }
+    return ans.detach();
+}
+
 static int
 py_callback(void *ctx, int flags, const char *text, int text_length, int start_offset, int end_offset) {
     PyObject *ans = reinterpret_cast<PyObject*>(ctx);
@@ -496,10 +1670,11 @@ py_callback(void *ctx, int flags, const char *text, int text_length, int start_o
 
 static PyObject*
 tokenize(PyObject *self, PyObject *args) {
-    const char *text; Py_ssize_t text_length, remove_diacritics = 1, flags = FTS5_TOKENIZE_DOCUMENT;
-    if (!PyArg_ParseTuple(args, "s#|pi", &text, &text_length, &remove_diacritics, &flags)) return NULL;
-    const char *targs[2] = {"remove_diacritics", "2"};
+    const char *text; Py_ssize_t text_length; int remove_diacritics = 1, flags = FTS5_TOKENIZE_DOCUMENT, prefix_tokens = 0;
+    if (!PyArg_ParseTuple(args, "s#|pip", &text, &text_length, &remove_diacritics, &flags, &prefix_tokens)) return NULL;
+    const char *targs[4] = {"remove_diacritics", "2", "prefix_tokens", "0"};
     if (!remove_diacritics) targs[1] = "0";
+    if (prefix_tokens) targs[3] = "1";
     Tokenizer t(targs, sizeof(targs)/sizeof(targs[0]));
     pyobject_raii ans(PyList_New(0));
     if (!ans) return NULL;
@@ -523,6 +1698,35 @@ stem(PyObject *self, PyObject *args) {
     return Py_BuildValue("s#", result, a);
 }
 
+static PyObject*
+set_tokenizer_stats_enabled(PyObject *self, PyObject *args) {
+    int enabled;
+    if (!PyArg_ParseTuple(args, "p", &enabled)) return NULL;
+    bool previous = stats_enabled.exchange(enabled != 0);
+    return PyBool_FromLong(previous);
+}
+
+static PyObject*
+get_tokenizer_stats(PyObject *self, PyObject *args) {
+    int reset = 0;
+    if (!PyArg_ParseTuple(args, "|p", &reset)) return NULL;
+    TokenizerStats s;
+    {
+        std::lock_guard<std::mutex> lock(global_mutex);
+        s = global_stats;
+        if (reset) global_stats.reset();
+    }
+    pyobject_raii ans(Py_BuildValue("{sK sK sK sK sK}",
+        "calls", (unsigned long long)s.calls, "tokens", (unsigned long long)s.tokens, "bytes", (unsigned long long)s.bytes,
+        "iterator_creations", (unsigned long long)s.iterator_creations, "stemmer_creations", (unsigned long long)s.stemmer_creations));
+    if (!ans) return NULL;
+    for (size_t i = 0; i < NUM_OF_PHASES; i++) {
+        pyobject_raii val(PyLong_FromUnsignedLongLong(s.phase_ns[i]));
+        if (!val || PyDict_SetItemString(ans.ptr(), phase_names[i], val.ptr()) != 0) return NULL;
+    }
+    return ans.detach();
+}
+
 static PyMethodDef methods[] = {
     {"get_locales_for_break_iteration", get_locales_for_break_iteration, METH_NOARGS,
      "Get list of available locales for break iteration"
@@ -530,12 +1734,36 @@ static PyMethodDef methods[] = {
     {"set_ui_language", set_ui_language, METH_VARARGS,
      "Set the current UI language"
     },
+    {"set_sort_collation", set_sort_collation, METH_VARARGS,
+     "set_sort_collation(locale, numeric=False) -> Set the locale and numeric collation used by the icucollate collation in connections opened after this call. An empty locale means use the UI language."
+    },
+    {"set_title_sort_config", set_title_sort_config, METH_VARARGS,
+     "set_title_sort_config(order, articles_pattern) -> Configure the native title_sort() SQL function for connections opened after this call"
+    },
+    {"set_author_sort_config", set_author_sort_config, METH_VARARGS,
+     "set_author_sort_config(method, copy_words, use_surname_prefixes, surname_prefixes, name_prefixes, name_suffixes) -> Configure the native author_to_author_sort() SQL function for connections opened after this call. All words must be lower case."
+    },
+    {"set_book_id_filter", set_book_id_filter, METH_VARARGS,
+     "set_book_id_filter(name, book_ids) -> Atomically replace the set of book ids matched by the named filter, returns the number of ids in the set. Use in SQL as book_id_filter(name, book_id) or create a named function with create_book_id_filter(function_name, name)."
+    },
+    {"remove_book_id_filter", remove_book_id_filter, METH_VARARGS,
+     "remove_book_id_filter(name) -> Forget the named book id filter, functions already created for it keep working"
+    },
+    {"match_values", match_values, METH_VARARGS,
+     "match_values(query, matchkind, vals, case_sensitive=False, locale='', collator=None) -> Match the query against all (value, book_ids) pairs in vals, with the semantics of _match() in calibre.db.search, without holding the GIL. A value is None, a string or a sequence of strings. Returns the set of book ids of all matching pairs. The collator capsule is needed for accent insensitive and primary contains matches."
+    },
     {"tokenize", tokenize, METH_VARARGS,
      "Tokenize a string, useful for testing"
     },
     {"stem", stem, METH_VARARGS,
      "Stem a word in the specified language, defaulting to English"
     },
+    {"set_tokenizer_stats_enabled", set_tokenizer_stats_enabled, METH_VARARGS,
+     "set_tokenizer_stats_enabled(enabled) -> Turn collection of tokenizer performance counters on or off, returning the previous state"
+    },
+    {"get_tokenizer_stats", get_tokenizer_stats, METH_VARARGS,
+     "get_tokenizer_stats(reset=False) -> Return the tokenizer performance counters accumulated by all tokenizers, optionally resetting them"
+    },
     {NULL, NULL, 0, NULL}
 };
 
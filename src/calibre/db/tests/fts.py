@@ -20,13 +20,15 @@ def print(*args, **kwargs):
 
 class TestConn(Connection):
 
-    def __init__(self, remove_diacritics=True, language='en', stem_words=False):
+    def __init__(self, remove_diacritics=True, language='en', stem_words=False, prefix_tokens=False):
         from calibre_extensions.sqlite_extension import set_ui_language
         set_ui_language(language)
         super().__init__(':memory:')
         plugins.load_apsw_extension(self, 'sqlite_extension')
         options = []
         options.append('remove_diacritics'), options.append('2' if remove_diacritics else '0')
+        if prefix_tokens:
+            options.append('prefix_tokens'), options.append('1')
         options = ' '.join(options)
         tok = 'porter ' if stem_words else ''
         self.execute(f'''
@@ -52,11 +54,11 @@ CREATE VIRTUAL TABLE fts_row USING fts5vocab(fts_table, row);
         return list(self.execute(stmt, (unicode_normalize(query),)))
 
 
-def tokenize(text, flags=None, remove_diacritics=True):
+def tokenize(text, flags=None, remove_diacritics=True, prefix_tokens=False):
     from calibre_extensions.sqlite_extension import FTS5_TOKENIZE_DOCUMENT, tokenize
     if flags is None:
         flags = FTS5_TOKENIZE_DOCUMENT
-    return tokenize(unicode_normalize(text), remove_diacritics, flags)
+    return tokenize(unicode_normalize(text), remove_diacritics, flags, prefix_tokens)
 
 
 class FTSTest(BaseTest):
@@ -120,6 +122,26 @@ class FTSTest(BaseTest):
         set_ui_language('en')
     # }}}
 
+    def test_fts_tokenizer_stats(self):  # {{{
+        from calibre_extensions.sqlite_extension import get_tokenizer_stats, set_tokenizer_stats_enabled
+        was_enabled = set_tokenizer_stats_enabled(True)
+        try:
+            get_tokenizer_stats(True)
+            tokenize('Some wörds 你叫')
+            s = get_tokenizer_stats(True)
+            self.ae(s['calls'], 1)
+            self.ae(s['tokens'], 5)
+            self.ae(s['bytes'], len('Some wörds 你叫'.encode('utf-8')))
+            self.assertGreater(s['iterator_creations'], 0)
+            self.assertGreater(s['break_iteration_ns'], 0)
+            self.ae(get_tokenizer_stats()['calls'], 0)
+            set_tokenizer_stats_enabled(False)
+            tokenize('Some wörds')
+            self.ae(get_tokenizer_stats()['tokens'], 0)
+        finally:
+            set_tokenizer_stats_enabled(was_enabled)
+    # }}}
+
     def test_fts_basic(self):  # {{{
         conn = TestConn()
         conn.insert_text('two words, and a period. With another.')
@@ -168,6 +190,32 @@ class FTSTest(BaseTest):
 
     # }}}
 
+    def test_fts_prefix_tokens(self):  # {{{
+        from calibre_extensions.sqlite_extension import FTS5_TOKENIZE_PREFIX, FTS5_TOKENIZE_QUERY
+
+        def tt(text, *expected_tokens, flags=None):
+            self.ae(tuple(x['text'] for x in tokenize(text, flags=flags, prefix_tokens=True)), expected_tokens)
+
+        tt('wörds a', 'wörds', '\x01wö', '\x01wör', '\x01wörd', 'words', '\x01wo', '\x01wor', '\x01word', 'a')
+        tt('ab wör', 'ab', '\x01wör', flags=FTS5_TOKENIZE_QUERY | FTS5_TOKENIZE_PREFIX)
+        tt('ab wörds', 'ab', 'wörds', flags=FTS5_TOKENIZE_QUERY | FTS5_TOKENIZE_PREFIX)
+        tt('ab wör', 'ab', 'wör', flags=FTS5_TOKENIZE_QUERY)
+
+        for stem_words in (False, True):
+            conn = TestConn(prefix_tokens=True, stem_words=stem_words)
+            conn.insert_text('one two three')
+            conn.insert_text('a simplistic connection')
+            for q in ('th*', 'thr*', 'thre*', 'three*', '"one two th" *', 'one + two + thr*'):
+                self.ae(conn.search(q), [('>one two three<',) if ' ' in q or '+' in q else ('one two >three<',)])
+            self.ae(conn.search('simp*'), [('a >simplistic< connection',)])
+            self.ae(conn.search('t*'), [('one >two< >three<',)])
+            self.ae(conn.search('tw'), [])
+        conn = TestConn(prefix_tokens=True)
+        conn.insert_text('coộl')
+        self.ae(conn.search('coo*'), [('>coộl<',)])
+        self.ae(conn.search('coộ*'), [('>coộl<',)])
+    # }}}
+
     def test_fts_query_syntax(self):  # {{{
         conn = TestConn()
         conn.insert_text('one two three')
@@ -485,6 +485,129 @@ class ReadingTest(BaseTest):
 
     # }}}
 
+    def test_native_collations(self):  # {{{
+        'Test the collations implemented in sqlite_extension'
+        from calibre.utils.icu import sort_key
+        cache = self.init_cache()
+        conn = cache.backend.conn
+        vals = ['b', 'a10', 'A2', 'é', 'e', 'Zebra', 'zed', 'Éz']
+        q = 'SELECT x FROM (SELECT ? AS x{}) ORDER BY x COLLATE {}'.format(' UNION ALL SELECT ?' * (len(vals) - 1), '{}')
+        self.assertEqual([x[0] for x in conn.get(q.format('icucollate'), vals)], sorted(vals, key=sort_key))
+        self.assertEqual([x[0] for x in conn.get(q.format('PYNOCASE'), vals)], sorted(vals, key=lambda x: x.lower()))
+        self.assertEqual(conn.get("SELECT 'ÉZ' = 'éz' COLLATE PYNOCASE, 'Abc' < 'abd' COLLATE PYNOCASE", all=False), 1)
+    # }}}
+
+    def test_native_sort_functions(self):  # {{{
+        'Test the title_sort() and author_to_author_sort() SQL functions match their python counterparts'
+        from calibre.db.backend import _author_to_author_sort
+        from calibre.ebooks.metadata import title_sort
+        cache = self.init_cache()
+        conn = cache.backend.conn
+        for title in ('The Hobbit', ' A tale ', 'Theater', '"The Quoted"', '“The Curly”', 'Über alles', '« The x »', ''):
+            self.assertEqual(conn.get('SELECT title_sort(?)', (title,), all=False), title_sort(title), repr(title))
+        for author in (
+            'John Smith', 'Smith, John', 'Dr. John Smith Jr.', 'Mr John', 'Ludwig van Beethoven', 'John (Jack) Smith',
+            'Editorial Team', 'J. R. R. Tolkien', 'Smith|John', 'Ürsula Le Guin', '',
+        ):
+            self.assertEqual(conn.get('SELECT author_to_author_sort(?)', (author,), all=False), _author_to_author_sort(author), repr(author))
+    # }}}
+
+    def test_native_aggregates(self):  # {{{
+        'Test the aggregate functions implemented in sqlite_extension'
+        cache = self.init_cache()
+        conn = cache.backend.conn
+        conn.execute('CREATE TEMP TABLE agg_test(i, a, b, c)')
+        conn.executemany('INSERT INTO agg_test VALUES (?,?,?,?)', ((3, 'c', 'cs', 'cl'), (1, 'a', 'as', ''), (2, 'b', 'bs', 'bl'), (4, None, None, None)))
+        self.assertEqual(conn.get(
+            'SELECT sortconcat(i, a), sortconcat_bar(i, a), sortconcat_amper(i, a), identifiers_concat(a, b), concat(a),'
+            ' aum_sortconcat(i, a, b, c) FROM agg_test')[0], (
+                'a,b,c', 'a|b|c', 'a&b&c', 'c:cs,a:as,b:bs', 'c,a,b', 'a:::as::::#:b:::bs:::bl:#:c:::cs:::cl'))
+        self.assertEqual(conn.get('SELECT sortconcat(i, a), identifiers_concat(a, b), concat(a) FROM agg_test WHERE i > 10')[0], (None, '', None))
+    # }}}
+
+    def test_book_id_filters(self):  # {{{
+        'Test the native book id filter SQL functions'
+        from calibre_extensions.sqlite_extension import remove_book_id_filter, set_book_id_filter
+        cache = self.init_cache()
+        conn = cache.backend.conn
+        all_ids = {x[0] for x in conn.get('SELECT id FROM books')}
+        q = "SELECT id FROM books WHERE book_id_filter('test_filter', id)"
+        self.assertEqual(conn.get(q), [])
+        # Large enough to use both the array and bitmap containers
+        ids = set(range(2, 200000, 3)) | {70000, 1 << 20}
+        self.assertEqual(set_book_id_filter('test_filter', ids), len(ids))
+        self.assertEqual({x[0] for x in conn.get(q)}, all_ids & ids)
+        set_book_id_filter('test_filter', [1])
+        self.assertEqual(conn.get(q), [(1,)])
+        remove_book_id_filter('test_filter')
+        self.assertEqual(conn.get(q), [])
+        f = conn.create_dynamic_filter('test_dynamic_filter')
+        self.assertEqual(conn.get('SELECT id FROM books WHERE test_dynamic_filter(id)'), [])
+        f.change([2])
+        self.assertEqual(conn.get('SELECT id FROM books WHERE test_dynamic_filter(id)'), [(2,)])
+        self.assertEqual(conn.get('SELECT books_list_filter(1)', all=False), 1)
+    # }}}
+
+    def test_native_regexp(self):  # {{{
+        'Test the native regular expression SQL function and regular expression searches'
+        cache = self.init_cache()
+        conn = cache.backend.conn
+        self.assertEqual(conn.get("SELECT id FROM books WHERE title REGEXP 'One$'"), [(1,)])
+        self.assertEqual(conn.get("SELECT id FROM books WHERE regexp('one$', title, 0)"), [(1,)])
+        self.assertEqual(conn.get("SELECT id FROM books WHERE title REGEXP 'one$'"), [])
+        self.assertIsNone(conn.get("SELECT NULL REGEXP 'x'", all=False))
+        self.assertRaises(Exception, conn.get, "SELECT 'x' REGEXP '('")
+        # Only \n is a line terminator, as for the regex module
+        self.assertEqual(conn.get("SELECT 'a' || char(13) || 'b' REGEXP 'a.b'", all=False), 1)
+        self.assertEqual(conn.get("SELECT 'a' || char(10) || 'b' REGEXP 'a.b'", all=False), 0)
+        self.assertEqual(conn.get("SELECT 'line' || char(13) REGEXP 'line$'", all=False), 0)
+        self.assertEqual(cache.search('title:~"^title"'), {1, 2})
+        self.assertEqual(cache.search('title:~"^TITLE"'), {1, 2})
+        self.assertEqual(cache.search('series_sort:~"^series o"'), {1, 2})
+        self.assertRaises(Exception, cache.search, 'title:~"("')
+    # }}}
+
+    def test_native_match_values(self):  # {{{
+        'Test the native search matcher against the python implementation'
+        from calibre.db.search import (
+            ACCENT_MATCH, CONTAINS_MATCH, EQUALS_MATCH, _match, _matchkind, native_matches,
+        )
+        vals = (('Café au lait', {1}), (('fiction.Sci-Fi', 'Fiction'), {2, 3}), (None, {4}),
+                (b'ca-fe', {5}), ((), {6}), (('x', 'fiction.mystery . noir'), {7}), ('', {8}))
+        for raw in ('cafe', 'caf', 'CAFÉ', '^cafe', '=fiction', '=.fiction', '=..noir', '=..mystery', '..fe', '', 'x'):
+            for case_sensitive in (False, True):
+                for upf in (False, True):
+                    matchkind, q = _matchkind(raw, case_sensitive=case_sensitive)
+                    expected = set()
+                    for val, book_ids in vals:
+                        if val is not None:
+                            val = (val,) if isinstance(val, (str, bytes)) else val
+                            val = tuple(x.decode('utf-8') if isinstance(x, bytes) else x for x in val)
+                            if _match(q, val, matchkind, use_primary_find_in_search=upf, case_sensitive=case_sensitive):
+                                expected |= book_ids
+                    self.assertEqual(native_matches(q, vals, matchkind, use_primary_find_in_search=upf, case_sensitive=case_sensitive),
+                                     expected, f'Failed for query: {raw!r} with {case_sensitive=} and {upf=}')
+        # Regular expressions must behave as with the regex module, searching
+        # the lower cased value when case insensitive
+        rvals = tuple((v, {i}) for i, v in enumerate((
+            'a\nb', 'a\rb', 'line\r', 'x\x85y', 'STRASSE', 'straße', 'İstanbul', 'Title One', 'ΣΑΣ', 'ﬁne')))
+        for raw in ('a.b', '(?s)a.b', '^line$', '(?m)^b', 'x.y', 'strasse', 'STRASSE', 'straße', '^i.stanbul$', '^.{8}$', 'σας', 'fine', r'\p{Lu}', '^title one$'):
+            for case_sensitive in (False, True):
+                matchkind, q = _matchkind('~' + raw, case_sensitive=case_sensitive)
+                expected = set()
+                for val, book_ids in rvals:
+                    if _match(q, (val,), matchkind, case_sensitive=case_sensitive):
+                        expected |= book_ids
+                self.assertEqual(native_matches(q, rvals, matchkind, case_sensitive=case_sensitive), expected,
+                                 f'Failed for regexp: {raw!r} with {case_sensitive=}')
+        self.assertEqual(native_matches('cafe', vals, ACCENT_MATCH), {1})
+        self.assertEqual(native_matches('.fiction', vals, EQUALS_MATCH), {2, 3, 7})
+        self.assertEqual(native_matches('ca-', vals, CONTAINS_MATCH, use_primary_find_in_search=False), {5})
+        cache = self.init_cache()
+        self.assertEqual(cache.search('title:"=title one"'), {1})
+        self.assertEqual(cache.search('title:"^title one"'), {1})
+    # }}}
+
     def test_get_next_series_num(self):  # {{{
         'Test getting the next series number for a series'
         cache = self.init_cache()
@@ -153,7 +153,8 @@ class PageProcessor(list):  # {{{
 
             # Do the Photoshop "Auto Levels" equivalent
             if not self.opts.dont_normalize:
-                img = normalize_image(img)
+                # Pages are already rendered in one worker process per core
+                img = normalize_image(img, 1)
             sizex, sizey = img.width(), img.height()
 
             SCRWIDTH, SCRHEIGHT = self.opts.output_profile.comic_screen_size
@@ -0,0 +1,353 @@
+/*
+:mod:`huffcdic` -- MOBI HUFF/CDIC decompression
+=================================================
+
+.. module:: huffcdic
+    :platform: All
+    :synopsis: Decompression of HUFF/CDIC compressed MOBI text records implemented in C for speed
+
+Based on the Python implementation in calibre.ebooks.mobi.huffcdic
+
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same as the default Python recursion limit, which is what limited the
+// nesting of dictionary entries in the Python implementation
+#define MAX_DEPTH 1000
+
+typedef enum { UNEXPANDED, EXPANDING, EXPANDED } EntryState;
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+    EntryState state;
+} Entry;
+
+typedef struct {
+    uint8_t codelen, term;
+    uint64_t maxcode;
+} Dict1Entry;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, capacity;
+} Output;
+
+typedef struct {
+    PyObject_HEAD
+    Dict1Entry dict1[256];
+    uint64_t mincode[33], maxcode[33];
+    Entry *dictionary;
+    size_t dictionary_len;
+    // Copies of the CDIC records, entries point into these
+    uint8_t **cdics;
+    size_t num_cdics;
+    // Memoized expansions of dictionary entries
+    uint8_t **expansions;
+    size_t num_expansions, expansions_capacity;
+    PyThread_type_lock lock;
+} Decoder;
+
+// Utils {{{
+static inline uint32_t
+be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3]; }
+
+static inline uint16_t
+be16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+
+static inline uint64_t
+read_word(const uint8_t *data, size_t len, size_t pos) {
+    // Read 8 big endian bytes, as though data was padded with 8 zero bytes
+    uint64_t ans = 0;
+    if (pos + 8 <= len) {
+        for (size_t i = 0; i < 8; i++) ans = (ans << 8) | data[pos + i];
+    } else {
+        for (size_t i = 0; i < 8; i++) ans = (ans << 8) | (pos + i < len ? data[pos + i] : 0);
+    }
+    return ans;
+}
+
+static int
+ensure_space(Output *o, size_t extra) {
+    if (o->len + extra <= o->capacity) return 1;
+    size_t cap = o->capacity ? o->capacity : 4096;
+    while (cap < o->len + extra) cap *= 2;
+    uint8_t *n = realloc(o->data, cap);
+    if (!n) return 0;
+    o->data = n; o->capacity = cap;
+    return 1;
+}
+// }}}
+
+// Decompression {{{
+static const char*
+unpack(Decoder *self, const uint8_t *data, size_t len, Output *out, unsigned depth) {
+    if (depth > MAX_DEPTH) return "Dictionary entries are nested too deeply";
+    int64_t bitsleft = (int64_t)len * 8;
+    size_t pos = 0;
+    uint64_t x = read_word(data, len, pos);
+    int n = 32;
+    while (1) {
+        if (n <= 0) {
+            pos += 4;
+            x = read_word(data, len, pos);
+            n += 32;
+        }
+        const uint64_t code = (x >> n) & 0xffffffffu;
+        const Dict1Entry *d = self->dict1 + (code >> 24);
+        unsigned codelen = d->codelen;
+        uint64_t maxcode = d->maxcode;
+        if (!d->term) {
+            while (codelen < 33 && code < self->mincode[codelen]) codelen++;
+            if (codelen > 32) return "Invalid Huffman code";
+            maxcode = self->maxcode[codelen];
+        }
+        n -= codelen;
+        bitsleft -= codelen;
+        if (bitsleft < 0) break;
+        if (maxcode < code) return "Invalid Huffman code";
+        const uint64_t r = (maxcode - code) >> (32 - codelen);
+        if (r >= self->dictionary_len) return "Dictionary index out of range";
+        Entry *e = self->dictionary + r;
+        if (e->state == EXPANDING) return "Dictionary entry refers to itself";
+        if (e->state == UNEXPANDED) {
+            Output sub = {0};
+            e->state = EXPANDING;
+            const char *err = unpack(self, e->data, e->len, &sub, depth + 1);
+            if (err) { free(sub.data); e->state = UNEXPANDED; return err; }
+            if (self->num_expansions >= self->expansions_capacity) {
+                size_t cap = self->expansions_capacity ? 2 * self->expansions_capacity : 256;
+                uint8_t **ne = realloc(self->expansions, cap * sizeof(uint8_t*));
+                if (!ne) { free(sub.data); e->state = UNEXPANDED; return "Out of memory"; }
+                self->expansions = ne; self->expansions_capacity = cap;
+            }
+            if (sub.len > UINT32_MAX) { free(sub.data); e->state = UNEXPANDED; return "Dictionary entry too large"; }
+            self->expansions[self->num_expansions++] = sub.data;
+            e->data = sub.data; e->len = (uint32_t)sub.len; e->state = EXPANDED;
+        }
+        if (e->len) {
+            if (!ensure_space(out, e->len)) return "Out of memory";
+            memcpy(out->data + out->len, e->data, e->len);
+            out->len += e->len;
+        }
+    }
+    return NULL;
+}
+
+static PyObject*
+raise_error(const char *err) {
+    if (strcmp(err, "Out of memory") == 0) return PyErr_NoMemory();
+    PyErr_SetString(PyExc_ValueError, err);
+    return NULL;
+}
+
+static PyObject*
+output_as_bytes(Output *o) {
+    PyObject *ans = PyBytes_FromStringAndSize((const char*)o->data, o->len);
+    free(o->data); o->data = NULL; o->len = 0; o->capacity = 0;
+    return ans;
+}
+
+static PyObject*
+Decoder_unpack(Decoder *self, PyObject *args) {
+    Py_buffer data;
+    if (!PyArg_ParseTuple(args, "y*", &data)) return NULL;
+    Output out = {0};
+    const char *err;
+    Py_BEGIN_ALLOW_THREADS;
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    err = unpack(self, data.buf, (size_t)data.len, &out, 0);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS;
+    PyBuffer_Release(&data);
+    if (err) { free(out.data); return raise_error(err); }
+    return output_as_bytes(&out);
+}
+
+static PyObject*
+Decoder_unpack_many(Decoder *self, PyObject *records) {
+    PyObject *seq = PySequence_Fast(records, "records must be a sequence");
+    if (!seq) return NULL;
+    Py_ssize_t num = PySequence_Fast_GET_SIZE(seq);
+    PyObject *ans = NULL;
+    Py_buffer *buffers = PyMem_Calloc(num ? num : 1, sizeof(Py_buffer));
+    Output *outputs = PyMem_Calloc(num ? num : 1, sizeof(Output));
+    Py_ssize_t num_buffers = 0;
+    if (!buffers || !outputs) { PyErr_NoMemory(); goto end; }
+    for (; num_buffers < num; num_buffers++) {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, num_buffers), buffers + num_buffers, PyBUF_SIMPLE) != 0) goto end;
+    }
+    const char *err = NULL;
+    Py_BEGIN_ALLOW_THREADS;
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    for (Py_ssize_t i = 0; i < num && !err; i++) err = unpack(self, buffers[i].buf, (size_t)buffers[i].len, outputs + i, 0);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS;
+    if (err) { raise_error(err); goto end; }
+    if (!(ans = PyList_New(num))) goto end;
+    for (Py_ssize_t i = 0; i < num; i++) {
+        PyObject *b = output_as_bytes(outputs + i);
+        if (!b) { Py_CLEAR(ans); goto end; }
+        PyList_SET_ITEM(ans, i, b);
+    }
+end:
+    if (buffers) for (Py_ssize_t i = 0; i < num_buffers; i++) PyBuffer_Release(buffers + i);
+    if (outputs) for (Py_ssize_t i = 0; i < num; i++) free(outputs[i].data);
+    PyMem_Free(buffers); PyMem_Free(outputs);
+    Py_DECREF(seq);
+    return ans;
+}
+// }}}
+
+// Loading {{{
+static int
+load_huff(Decoder *self, const uint8_t *huff, size_t len) {
+    if (len < 16 || memcmp(huff, "HUFF\x00\x00\x00\x18", 8) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid HUFF header"); return 0;
+    }
+    size_t off1 = be32(huff + 8), off2 = be32(huff + 12);
+    if (off1 + 256 * 4 > len || off2 + 64 * 4 > len) {
+        PyErr_SetString(PyExc_ValueError, "Truncated HUFF record"); return 0;
+    }
+    for (size_t i = 0; i < 256; i++) {
+        uint32_t v = be32(huff + off1 + 4 * i);
+        Dict1Entry *d = self->dict1 + i;
+        d->codelen = v & 0x1f; d->term = (v & 0x80) ? 1 : 0;
+        if (d->codelen == 0 || (d->codelen <= 8 && !d->term)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid HUFF code table"); return 0;
+        }
+        d->maxcode = (((uint64_t)(v >> 8) + 1) << (32 - d->codelen)) - 1;
+    }
+    self->mincode[0] = 0; self->maxcode[0] = (((uint64_t)0 + 1) << 32) - 1;
+    for (size_t codelen = 1; codelen < 33; codelen++) {
+        const uint8_t *p = huff + off2 + 8 * (codelen - 1);
+        self->mincode[codelen] = (uint64_t)be32(p) << (32 - codelen);
+        self->maxcode[codelen] = (((uint64_t)be32(p + 4) + 1) << (32 - codelen)) - 1;
+    }
+    return 1;
+}
+
+static int
+load_cdic(Decoder *self, const uint8_t *src, size_t len) {
+    if (len < 16 || memcmp(src, "CDIC\x00\x00\x00\x10", 8) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid CDIC header"); return 0;
+    }
+    uint32_t phrases = be32(src + 8), bits = be32(src + 12);
+    if (phrases <= self->dictionary_len) return 1;
+    size_t n = phrases - self->dictionary_len;
+    if (bits < 32 && ((size_t)1 << bits) < n) n = (size_t)1 << bits;
+    if (16 + 2 * n > len) { PyErr_SetString(PyExc_ValueError, "Truncated CDIC record"); return 0; }
+    uint8_t *cdic = malloc(len);
+    if (!cdic) { PyErr_NoMemory(); return 0; }
+    memcpy(cdic, src, len);
+    uint8_t **nc = realloc(self->cdics, (self->num_cdics + 1) * sizeof(uint8_t*));
+    if (!nc) { free(cdic); PyErr_NoMemory(); return 0; }
+    self->cdics = nc; self->cdics[self->num_cdics++] = cdic;
+    Entry *nd = realloc(self->dictionary, (self->dictionary_len + n) * sizeof(Entry));
+    if (!nd) { PyErr_NoMemory(); return 0; }
+    self->dictionary = nd;
+    for (size_t i = 0; i < n; i++) {
+        size_t off = be16(cdic + 16 + 2 * i);
+        Entry *e = self->dictionary + self->dictionary_len + i;
+        if (18 + off > len) { PyErr_SetString(PyExc_ValueError, "Truncated CDIC record"); return 0; }
+        uint16_t blen = be16(cdic + 16 + off);
+        size_t start = 18 + off, sz = blen & 0x7fff;
+        // Match python slicing, which silently truncates
+        if (start + sz > len) sz = len - start;
+        e->data = cdic + start; e->len = (uint32_t)sz;
+        e->state = (blen & 0x8000) ? EXPANDED : UNEXPANDED;
+    }
+    self->dictionary_len += n;
+    return 1;
+}
+
+static int
+load_record(PyObject *rec, Decoder *self, int (*loader)(Decoder*, const uint8_t*, size_t)) {
+    Py_buffer buf;
+    if (PyObject_GetBuffer(rec, &buf, PyBUF_SIMPLE) != 0) return 0;
+    int ok = loader(self, buf.buf, (size_t)buf.len);
+    PyBuffer_Release(&buf);
+    return ok;
+}
+// }}}
+
+// Decoder type {{{
+static void
+Decoder_dealloc(Decoder *self) {
+    for (size_t i = 0; i < self->num_cdics; i++) free(self->cdics[i]);
+    for (size_t i = 0; i < self->num_expansions; i++) free(self->expansions[i]);
+    free(self->cdics); free(self->expansions); free(self->dictionary);
+    if (self->lock) PyThread_free_lock(self->lock);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+Decoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyObject *huff, *cdics;
+    if (!PyArg_ParseTuple(args, "OO", &huff, &cdics)) return NULL;
+    Decoder *self = (Decoder*)type->tp_alloc(type, 0);
+    if (!self) return NULL;
+    if (!(self->lock = PyThread_allocate_lock())) { Py_DECREF(self); return PyErr_NoMemory(); }
+    if (!load_record(huff, self, load_huff)) { Py_DECREF(self); return NULL; }
+    PyObject *seq = PySequence_Fast(cdics, "cdics must be a sequence");
+    if (!seq) { Py_DECREF(self); return NULL; }
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        if (!load_record(PySequence_Fast_GET_ITEM(seq, i), self, load_cdic)) { Py_DECREF(seq); Py_DECREF(self); return NULL; }
+    }
+    Py_DECREF(seq);
+    return (PyObject*)self;
+}
+
+static PyMethodDef Decoder_methods[] = {
+    {"unpack", (PyCFunction)Decoder_unpack, METH_VARARGS,
+     "unpack(record) -> Decompress a single text record"
+    },
+    {"unpack_many", (PyCFunction)Decoder_unpack_many, METH_O,
+     "unpack_many(records) -> Decompress a list of text records, returning a list of decompressed records. The GIL is not held while decompressing."
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "huffcdic.Decoder",
+    .tp_basicsize = sizeof(Decoder),
+    .tp_dealloc = (destructor)Decoder_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Decoder(huff_record, cdic_records) -> Decompress HUFF/CDIC compressed text records, memoizing expanded dictionary entries",
+    .tp_methods = Decoder_methods,
+    .tp_new = Decoder_new,
+};
+// }}}
+
+static char huffcdic_doc[] = "Decompress MOBI HUFF/CDIC compressed text records.";
+
+static PyMethodDef huffcdic_methods[] = {
+    {NULL, NULL, 0, NULL}
+};
+
+static int
+exec_module(PyObject *module) {
+    if (PyType_Ready(&DecoderType) < 0) return -1;
+    Py_INCREF(&DecoderType);
+    if (PyModule_AddObject(module, "Decoder", (PyObject*)&DecoderType) != 0) { Py_DECREF(&DecoderType); return -1; }
+    return 0;
+}
+
+static PyModuleDef_Slot slots[] = { {Py_mod_exec, exec_module}, {0, NULL} };
+
+static struct PyModuleDef module_def = {
+    .m_base     = PyModuleDef_HEAD_INIT,
+    .m_name     = "huffcdic",
+    .m_doc      = huffcdic_doc,
+    .m_methods  = huffcdic_methods,
+    .m_slots    = slots,
+};
+
+CALIBRE_MODINIT_FUNC PyInit_huffcdic(void) { return PyModuleDef_Init(&module_def); }
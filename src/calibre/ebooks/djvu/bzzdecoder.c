@@ -19,7 +19,9 @@
 
 #define STRFY(x) #x
 #define STRFY2(x) STRFY(x)
-#define CORRUPT PyErr_SetString(PyExc_ValueError, "Corrupt bitstream at line: " STRFY2(__LINE__))
+// The decoder runs without the GIL, so errors are recorded in the state and
+// turned into exceptions once the GIL has been re-acquired
+#define CORRUPT state->error = "Corrupt bitstream at line: " STRFY2(__LINE__)
 
 typedef uint8_t bool;
 
@@ -51,6 +53,7 @@ typedef struct State {
     bool      is_eof;
     uint32_t  xsize;
     uint8_t  *buf;
+    const char *error;
 
 } State;
 
@@ -322,6 +325,7 @@ static Table default_ztable[256] = // {{{
 #define MAXBLOCK 4096
 #define FREQMAX  4
 #define CTXIDS  3
+static const char OOM[] = "Out of memory";
 
 static inline bool read_byte(State *state) {
     if (state->raw <= state->end) {
@@ -336,7 +340,7 @@ static bool preload(State *state) {
         if (!read_byte(state)) {
             state->byte = 0xff;
             if (--state->delay < 1) {
-                PyErr_SetString(PyExc_ValueError, "Unexpected end of input"); return FALSE;
+                state->error = "Unexpected end of input"; return FALSE;
             }
         }
         state->buffer = ((state->buffer)<<8) | state->byte;
@@ -371,10 +375,6 @@ static bool init_state(State *state) {
     state->delay = 25; state->scount = 0;
     if (!preload(state)) return FALSE;
     state->fence = MIN(state->code, 0x7fff);
-
-    // Alloc buffer
-    state->buf = (uint8_t*) calloc(MAXBLOCK * 1024, sizeof(uint8_t));
-    if (state->buf == NULL) { PyErr_NoMemory(); return FALSE; }
     return TRUE;
 }
 
@@ -419,6 +419,7 @@ static inline int32_t decode_raw(State *state, int32_t bits) {
     int32_t n = 1, m = 1 << bits, b = 0;
     while (n < m) {
         b = zpcodec_decoder(state);
+        if (b < 0) return 0;
         n = (n << 1) | b;
     }
     return n - m;
@@ -476,13 +477,30 @@ static inline int32_t decode_binary(State *state, uint8_t *ctx, int32_t index, i
   int n = 1, m = (1<<bits), b = 0;
   while (n < m) {
       b = zpcodec_decode(state, ctx, index + n);
+      if (b < 0) return 0;
       n = (n<<1) | b;
     }
   return n - m;
 }
 
 
-static bool decode(State *state, uint8_t *ctx) {
+typedef struct Output {
+    uint8_t *data;
+    size_t len, capacity;
+} Output;
+
+static bool reserve(Output *o, size_t needed) {
+    uint8_t *tmp;
+    if (needed <= o->capacity) return TRUE;
+    tmp = (uint8_t*)realloc(o->data, needed);
+    if (tmp == NULL) return FALSE;
+    o->data = tmp; o->capacity = needed;
+    return TRUE;
+}
+
+// Decode one block directly into the output buffer, growing it by exactly
+// the size of the block, which is known before the block is decoded
+static bool decode(State *state, uint8_t *ctx, Output *output) {
     uint8_t mtf[256] = { // {{{
   0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
   0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
@@ -521,10 +539,13 @@ static bool decode(State *state, uint8_t *ctx) {
     uint8_t j = 0, c = 0;
 
     state->xsize = decode_raw(state, 24);
+    if (state->error) return FALSE;
     if (!state->xsize) return FALSE;
     if (state->xsize > MAXBLOCK * 1024)  { CORRUPT; goto end; }
+    if (!reserve(output, output->len + state->xsize)) { state->error = OOM; goto end; }
+    state->buf = output->data + output->len;
     posn = (uint32_t*)calloc(state->xsize, sizeof(uint32_t));
-    if (posn == NULL) { PyErr_NoMemory(); goto end; }
+    if (posn == NULL) { state->error = OOM; goto end; }
 
     // Decode Estimation Speed
     if (zpcodec_decoder(state)) {
@@ -533,7 +554,7 @@ static bool decode(State *state, uint8_t *ctx) {
     }
 
     for (i = 0; i < state->xsize; i++) {
-        if (PyErr_Occurred()) goto end;
+        if (state->error) goto end;
 
         ctxid = CTXIDS - 1; if (ctxid > mtfno) ctxid = mtfno;
         if (zpcodec_decode(state, ctx, ctxid)) { mtfno=0; state->buf[i] = mtf[mtfno]; goto rotate; }
@@ -614,74 +635,77 @@ static bool decode(State *state, uint8_t *ctx) {
         c = (posn[i]>>24);
         state->buf[--last] = c;
         i = count[c] + (n & 0xffffff);
+        if (i >= state->xsize) { CORRUPT; goto end; }
     }
     if (i != markerpos) { CORRUPT; goto end; }
 
 end:
     if (posn != NULL) { free(posn); posn = NULL; }
-    if (PyErr_Occurred()) return FALSE;
+    state->buf = NULL;
+    if (state->error) return FALSE;
     return state->xsize != 0;
 }
 
-static PyObject *
-bzz_decompress(PyObject *self, PyObject *args) {
-    Py_ssize_t input_len = 0, i;
+static bool
+bzz_decode(const char *data, size_t len, Output *output, const char **error) {
     State state = {0};
     uint8_t ctx[300] = {0};
-    char *buf = NULL, *pos = NULL, *tmp = NULL;
-    size_t buflen = 0, blocksize = MAXBLOCK * 1024;
-    PyObject *ans = NULL;
+    size_t total = 0;
 
-    if (!PyArg_ParseTuple(args, "y#", &(state.raw), &input_len))
-		return NULL;
-    state.end = state.raw + input_len - 1;
+    if (!len) { *error = "Unexpected end of input"; return FALSE; }
+    state.raw = (char*)data;
+    state.end = state.raw + len - 1;
 
     if (!init_state(&state)) goto end;
 
-    buf = (char *)calloc(blocksize, sizeof(char));
-    if (buf == NULL) { PyErr_NoMemory(); goto end; }
-    buflen = blocksize;
-    pos = buf;
-
     while (!state.is_eof) {
-        if (!state.xsize) {  // decode is needed
-            if (!decode(&state, ctx)) {
-                if (PyErr_Occurred()) goto end;
-                state.xsize = 1;
-                state.is_eof = TRUE;
+        if (!decode(&state, ctx, output)) {
+            if (state.error) goto end;
+            state.is_eof = TRUE;
+        } else {
+            // The last byte of each block is the BWT marker, which is not output
+            output->len += state.xsize - 1;
+            if (!total && output->len >= 3) {
+                // The first three bytes are the size of the decompressed
+                // data, use it to allocate all the space needed up front
+                total = (((size_t)output->data[0]) << 16) | (((size_t)output->data[1]) << 8) | output->data[2];
+                if (total <= MAXBLOCK * 1024 * 16 && !reserve(output, total + 3 + 1)) { state.error = OOM; goto end; }
             }
-            state.xsize -= 1;
-        }
-
-        if (state.xsize > 0) {
-            while (buflen - (pos - buf) <= state.xsize) {
-                size_t xpos = pos - buf;
-                tmp = (char*) realloc(buf, buflen + (buflen * sizeof(char)));
-                if (tmp == NULL) {
-                    PyErr_NoMemory(); goto end;
-                }
-                buflen += buflen * sizeof(char);
-                pos = tmp + xpos;
-                buf = tmp; tmp = NULL;
-            }
-            memcpy(pos, state.buf, state.xsize);
-            pos += state.xsize;
         }
         state.xsize = 0;
     }
 
 end:
-    if (state.buf != NULL) free(state.buf);
-    if (!PyErr_Occurred()) {
-        buflen = 0;
-        for (i = 0; i < 3; i++) {
-            buflen <<= 8; buflen += (uint8_t)buf[i];
+    *error = state.error;
+    return state.error == NULL;
+}
+
+static PyObject *
+bzz_decompress(PyObject *self, PyObject *args) {
+    Py_buffer input;
+    Output output = {0};
+    const char *error = NULL;
+    size_t sz = 0;
+    PyObject *ans = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*", &input))
+		return NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    bzz_decode(input.buf, input.len, &output, &error);
+    Py_END_ALLOW_THREADS;
+    PyBuffer_Release(&input);
+
+    if (error == OOM) PyErr_NoMemory();
+    else if (error) PyErr_SetString(PyExc_ValueError, error);
+    else {
+        if (output.len > 3) {
+            sz = (((size_t)output.data[0]) << 16) | (((size_t)output.data[1]) << 8) | output.data[2];
+            sz = MIN(sz, output.len - 3);
         }
-        Py_ssize_t psz = MIN(buflen, pos - buf);
-        ans = Py_BuildValue("y#", buf + 3, psz);
+        ans = PyBytes_FromStringAndSize(sz ? (const char*)output.data + 3 : "", sz);
     }
-    if (buf != NULL) free(buf);
-    if (PyErr_Occurred()) return NULL;
+    free(output.data);
     return ans;
 }
 
@@ -690,7 +714,7 @@ static char bzzdec_doc[] = "Decompress BZZ encoded strings (used in DJVU)";
 static PyMethodDef bzzdec_methods[] = {
     {"decompress", bzz_decompress, METH_VARARGS,
     "decompress(bytestring) -> decompressed bytestring\n\n"
-    		"Decompress a BZZ compressed byte string. "
+    		"Decompress a BZZ compressed byte string. The GIL is released while decompressing, so multiple chunks can be decompressed in parallel using threads."
     },
 
     {NULL, NULL, 0, NULL}
@@ -11,9 +11,16 @@ __copyright__ = '2011, Anthon van der Neut <A.van.der.Neut@ruamel.eu>'
 
 import sys
 import struct
+from contextlib import closing
+from multiprocessing.pool import ThreadPool
 
+from calibre import detect_ncpus
 from calibre.ebooks.djvu.djvubzzdec import BZZDecoder
 
+# Below this much compressed text, starting threads costs more than
+# decompressing all the TXTz chunks serially
+PARALLEL_TEXT_SIZE = 64 * 1024
+
 
 class DjvuChunk:
 
@@ -60,6 +67,23 @@ class DjvuChunk:
             if verbose > 0:
                 print('                  end of chunk %d (%x)' % (pos, pos))
 
+    def walk(self):
+        yield self
+        for schunk in self._subchunks:
+            yield from schunk.walk()
+
+    def text(self):
+        ''' The text in a TXTz or TXTa chunk. Decompressing TXTz chunks does
+        not hold the GIL, so it can be done for many chunks in parallel. '''
+        if self.type == b'TXTz':
+            return self.speedup.decompress(memoryview(self.buf)[self.datastart:self.dataend])
+        res = self.buf[self.datastart: self.dataend]
+        l = 0
+        for x in bytearray(res[:3]):
+            l <<= 8
+            l += x
+        return res[3:3+l]
+
     def dump(self, verbose=0, indent=1, out=None, txtout=None, maxlevel=100):
         if out:
             out.write(b'  ' * indent)
@@ -114,7 +138,18 @@ class DJVUFile:
         self.dc = DjvuChunk(buf, 0, len(buf), verbose=verbose)
 
     def get_text(self, outfile=None):
-        self.dc.dump(txtout=outfile)
+        if outfile is None:
+            outfile = sys.stdout.buffer
+        chunks = [c for c in self.dc.walk() if c.type in (b'TXTz', b'TXTa')]
+        compressed = [c for c in chunks if c.type == b'TXTz']
+        if len(compressed) > 1 and sum(c.dataend - c.datastart for c in compressed) >= PARALLEL_TEXT_SIZE:
+            with closing(ThreadPool(min(len(compressed), detect_ncpus()))) as pool:
+                texts = pool.map(DjvuChunk.text, chunks)
+        else:
+            texts = [c.text() for c in chunks]
+        for text in texts:
+            outfile.write(text)
+            outfile.write(b'\037')
 
     def dump(self, outfile=None, maxlevel=0):
         self.dc.dump(out=outfile, maxlevel=maxlevel)
@@ -122,7 +157,7 @@ class DJVUFile:
 
 def main():
     f = DJVUFile(open(sys.argv[-1], 'rb'))
-    print(f.get_text(sys.stdout))
+    f.get_text()
 
 
 if __name__ == '__main__':
@@ -0,0 +1,270 @@
+#!/usr/bin/env python
+# License: GPLv3 Copyright: 2023, Kovid Goyal <kovid at kovidgoyal.net>
+
+# A BZZ encoder, used to test the decoders. It is based on the encoder in
+# djvulibre (ZPCodec.cpp and BSEncodeByteStream.cpp) and is only suitable for
+# small inputs as the block sort is naive.
+
+import struct
+import unittest
+from io import BytesIO
+from unittest.mock import patch
+
+from calibre.ebooks.djvu.djvubzzdec import CTXIDS, FREQMAX, BZZDecoder, default_ztable
+
+
+class ZPEncoder:
+
+    def __init__(self):
+        self.output = bytearray()
+        self.a = self.subend = self.nrun = self.byte = self.scount = 0
+        self.buffer = 0xffffff
+        self.delay = 24
+        self.p, self.m, self.up, self.dn = (tuple(x[i] for x in default_ztable) for i in range(4))
+
+    def outbit(self, bit):
+        if self.delay > 0:
+            if self.delay < 0xff:
+                self.delay -= 1
+        else:
+            self.byte = (self.byte << 1) | bit
+            self.scount += 1
+            if self.scount == 8:
+                self.output.append(self.byte)
+                self.scount = self.byte = 0
+
+    def zemit(self, b):
+        self.buffer = (self.buffer << 1) + b
+        b = self.buffer >> 24
+        self.buffer &= 0xffffff
+        if b == 1:
+            self.outbit(1)
+            for i in range(self.nrun):
+                self.outbit(0)
+            self.nrun = 0
+        elif b == 0xff:
+            self.nrun += 1
+        elif b == 0:
+            self.outbit(0)
+            for i in range(self.nrun):
+                self.outbit(1)
+            self.nrun = 0
+        else:
+            raise AssertionError('Invalid carry')
+
+    def export_bits(self):
+        while self.a >= 0x8000:
+            self.zemit(1 - (self.subend >> 15))
+            self.subend = (self.subend << 1) & 0xffff
+            self.a = (self.a << 1) & 0xffff
+
+    def encode_mps(self, ctx, index, z):
+        d = 0x6000 + ((z + self.a) >> 2)
+        z = min(z, d)
+        if self.a >= self.m[ctx[index]]:
+            ctx[index] = self.up[ctx[index]]
+        self.a = z
+        self.export_bits()
+
+    def encode_lps(self, ctx, index, z):
+        d = 0x6000 + ((z + self.a) >> 2)
+        z = min(z, d)
+        ctx[index] = self.dn[ctx[index]]
+        z = 0x10000 - z
+        self.subend += z
+        self.a += z
+        self.export_bits()
+
+    def encode(self, bit, ctx, index):
+        z = self.a + self.p[ctx[index]]
+        if bit != (ctx[index] & 1):
+            self.encode_lps(ctx, index, z)
+        elif z >= 0x8000:
+            self.encode_mps(ctx, index, z)
+        else:
+            self.a = z
+
+    def encode_simple(self, bit):
+        z = 0x8000 + (self.a >> 1)
+        if bit:
+            z = 0x10000 - z
+            self.subend += z
+            self.a += z
+        else:
+            self.a = z
+        self.export_bits()
+
+    def encode_raw(self, bits, x):
+        n, m = 1, 1 << bits
+        x |= m
+        while n < m:
+            x = (x & (m - 1)) << 1
+            b = x >> bits
+            self.encode_simple(b)
+            n = (n << 1) | b
+
+    def encode_binary(self, ctx, index, bits, x):
+        n, m = 1, 1 << bits
+        x |= m
+        while n < m:
+            x = (x & (m - 1)) << 1
+            b = x >> bits
+            self.encode(b, ctx, index + n - 1)
+            n = (n << 1) | b
+
+    def flush(self):
+        if self.subend > 0x8000:
+            self.subend = 0x10000
+        elif self.subend > 0:
+            self.subend = 0x8000
+        while self.buffer != 0xffffff or self.subend:
+            self.zemit(1 - (self.subend >> 15))
+            self.subend = (self.subend << 1) & 0xffff
+        self.outbit(1)
+        for i in range(self.nrun):
+            self.outbit(1)
+        self.nrun = 0
+        while self.scount > 0:
+            self.outbit(1)
+        self.delay = 0xff
+        return bytes(self.output)
+
+
+def block_sort(block):
+    # Burrows-Wheeler transform of block followed by a marker that sorts
+    # before every byte. Returns the last column and the position of the
+    # marker in it.
+    data = [b + 1 for b in block] + [0]
+    rows = sorted(range(len(data)), key=lambda i: data[i:])
+    last = [data[i - 1] - 1 for i in rows]
+    markerpos = rows.index(0)
+    last[markerpos] = 0
+    return last, markerpos
+
+
+def encode_block(zp, ctx, block, fshift):
+    data, markerpos = block_sort(block)
+    zp.encode_raw(24, len(data))
+    zp.encode_simple(int(fshift > 0))
+    if fshift > 0:
+        zp.encode_simple(int(fshift > 1))
+    mtf = list(range(256))
+    rmtf = list(range(256))
+    freq = [0] * FREQMAX
+    fadd = 4
+    mtfno = 3
+    for i, c in enumerate(data):
+        ctxid = min(CTXIDS - 1, mtfno)
+        mtfno = 256 if i == markerpos else rmtf[c]
+        b = mtfno == 0
+        zp.encode(b, ctx, ctxid)
+        if not b:
+            b = mtfno == 1
+            zp.encode(b, ctx, ctxid + CTXIDS)
+            if not b:
+                base, index, found = 2, 2 * CTXIDS, False
+                for bits in range(1, 8):
+                    b = mtfno < 2 * base
+                    zp.encode(b, ctx, index)
+                    if b:
+                        zp.encode_binary(ctx, index + 1, bits, mtfno - base)
+                        found = True
+                        break
+                    index += 1 + (1 << bits) - 1
+                    base *= 2
+                if not found:
+                    continue
+        fadd = fadd + (fadd >> fshift)
+        if fadd > 0x10000000:
+            fadd >>= 24
+            freq = [f >> 24 for f in freq]
+        fc = fadd
+        if mtfno < FREQMAX:
+            fc += freq[mtfno]
+        k = mtfno
+        while k >= FREQMAX:
+            mtf[k] = mtf[k - 1]
+            rmtf[mtf[k]] = k
+            k -= 1
+        while k > 0 and fc >= freq[k - 1]:
+            mtf[k] = mtf[k - 1]
+            freq[k] = freq[k - 1]
+            rmtf[mtf[k]] = k
+            k -= 1
+        mtf[k] = c
+        freq[k] = fc
+        rmtf[c] = k
+
+
+def bzz_compress(data, blocksize=1024, fshift=0):
+    zp = ZPEncoder()
+    ctx = [0] * 300
+    for i in range(0, len(data), blocksize):
+        encode_block(zp, ctx, data[i:i+blocksize], fshift)
+    zp.encode_raw(24, 0)
+    return zp.flush()
+
+
+def txtz(text, **kw):
+    # The data in a TXTz chunk is the text prefixed by its length
+    return bzz_compress(struct.pack('>L', len(text))[1:] + text, **kw)
+
+
+def py_decompress(raw):
+    out = bytearray()
+    d = BZZDecoder(bytearray(raw), out)
+    while d.convert(1024 * 1024):
+        pass
+    return bytes(out)
+
+
+class TestBZZ(unittest.TestCase):
+
+    texts = (
+        b'a', b'hello world', b'abracadabra' * 37, bytes(range(256)) * 3,
+        b''.join(b'line %d of some text that repeats\n' % i for i in range(300)),
+        bytes((i * 7919) % 251 for i in range(5000)),
+    )
+
+    def test_bzz_round_trip(self):
+        from calibre_extensions.bzzdec import decompress
+        for text in self.texts:
+            for kw in ({}, {'blocksize': 97, 'fshift': 1}, {'blocksize': 4096, 'fshift': 2}):
+                raw = txtz(text, **kw)
+                self.assertEqual(py_decompress(raw)[3:], text)
+                self.assertEqual(decompress(raw), text)
+                self.assertEqual(decompress(memoryview(b'xx' + raw)[2:]), text)
+
+    def test_bzz_errors(self):
+        from calibre_extensions.bzzdec import decompress
+        self.assertRaises(ValueError, decompress, b'')
+        # A block that claims to be larger than the maximum block size
+        zp = ZPEncoder()
+        zp.encode_raw(24, 0xffffff)
+        self.assertRaises(ValueError, decompress, zp.flush())
+
+    def test_djvu_text(self):
+        from calibre.ebooks.djvu import djvu
+
+        def chunk(ctype, data):
+            return ctype + struct.pack('>L', len(data)) + data + (b'\0' if len(data) % 2 else b'')
+
+        texts = self.texts * 3
+        pages = b''.join(chunk(b'FORM', b'DJVU' + chunk(b'TXTz', txtz(t))) for t in texts)
+        pages += chunk(b'FORM', b'DJVU' + chunk(b'TXTa', struct.pack('>L', 4)[1:] + b'last'))
+        f = djvu.DJVUFile(BytesIO(b'AT&T' + chunk(b'FORM', b'DJVM' + pages)))
+        expected = b''.join(t + b'\037' for t in texts + (b'last',))
+        # Both serially and with the TXTz chunks decompressed in parallel in threads
+        for threshold in (djvu.PARALLEL_TEXT_SIZE, 0):
+            with patch.object(djvu, 'PARALLEL_TEXT_SIZE', threshold):
+                out = BytesIO()
+                f.get_text(out)
+                self.assertEqual(out.getvalue(), expected)
+
+
+def find_tests():
+    return unittest.defaultTestLoader.loadTestsFromTestCase(TestBZZ)
+
+
+if __name__ == '__main__':
+    unittest.TextTestRunner(verbosity=2).run(find_tests())
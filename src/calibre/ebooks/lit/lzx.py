@@ -25,3 +25,46 @@ class Decompressor:
 
     def reset(self):
         return _lzx.reset()
+
+
+def benchmark(size=8 * 1024 * 1024, wbits=17, repeat=5):
+    ''' Measure decompression throughput on a synthetic, text like corpus.
+    Run with: calibre-debug -c "from calibre.ebooks.lit.lzx import benchmark; benchmark()" '''
+    import random
+    import time
+    r = random.Random(1)
+    words = [''.join(r.choice('abcdefghijklmnopqrstuvwxyz') for i in range(r.randint(2, 10))).encode() for i in range(3000)]
+    parts, total = [], 0
+    while total < size:
+        x = r.random()
+        if x < 0.05:
+            p = bytes(r.getrandbits(8) for i in range(r.randint(1, 300)))
+        elif x < 0.15:
+            p = b'<p class="c%d">' % r.randint(0, 20)
+        else:
+            p = b' '.join(r.choice(words) for i in range(r.randint(5, 40))) + b'.\n'
+        parts.append(p)
+        total += len(p)
+    data = b''.join(parts)[:size]
+    cdata, rtable = Compressor(wbits).compress(data, flush=True)
+    window = 1 << wbits
+    # Split at the reset points that fall on window boundaries, as the LIT reader does
+    chunks, base, ubase = [], 0, 0
+    for uncomp, comp in rtable:
+        if 0 < uncomp < len(data) and uncomp % window == 0:
+            chunks.append((cdata[base:comp], uncomp - ubase))
+            base, ubase = comp, uncomp
+    chunks.append((cdata[base:], len(data) - ubase))
+    d = Decompressor(wbits)
+    best = None
+    for i in range(repeat):
+        st = time.monotonic()
+        out = []
+        for chunk, outlen in chunks:
+            d.reset()
+            out.append(d.decompress(chunk, outlen))
+        elapsed = time.monotonic() - st
+        if b''.join(out) != data:
+            raise LZXError('Decompressed data does not match the original')
+        best = elapsed if best is None else min(best, elapsed)
+    print(f'Decompressed {len(data)} bytes from {len(cdata)} bytes at {len(data) / best / 1e6:.1f} MB/s')
@@ -719,8 +719,8 @@ class LitFile:
         else:
             return
         if self.drmlevel < 5:
-            msdes.deskey(self.calculate_deskey(), msdes.DE1)
-            bookkey = msdes.des(self.get_file('/DRMStorage/DRMSealed'))
+            bookkey = msdes.KeySchedule(self.calculate_deskey()).decrypt(
+                self.get_file('/DRMStorage/DRMSealed'))
             if bookkey[0:1] != b'\0':
                 raise LitError('Unable to decrypt title key!')
             self.bookkey = bookkey[1:9]
@@ -796,8 +796,7 @@ class LitFile:
         if extra > 0:
             self.warn("content length not a multiple of block size")
             content += b"\0" * (8 - extra)
-        msdes.deskey(self.bookkey, msdes.DE1)
-        return msdes.des(content)
+        return msdes.KeySchedule(self.bookkey).decrypt(content)
 
     def decompress(self, content, control, reset_table):
         if len(control) < 32 or control[CONTROL_TAG:CONTROL_TAG+4] != b"LZXC":
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+# License: GPLv3 Copyright: 2023, Kovid Goyal <kovid at kovidgoyal.net>
+
+import os
+import unittest
+
+from calibre_extensions import msdes
+
+# LIT files use a DES variant whose combined S-box/P tables differ from the
+# standard ones, so the standard test vectors do not apply. These were
+# produced with the block by block deskey()/des() implementation from before
+# KeySchedule existed.
+VECTORS = (
+    ('133457799BBCDFF1', '0123456789ABCDEF', 'B95A0C9072207039'),
+    ('0E329232EA6D0D73', '8787878787878787', '7398C242DCF147C7'),
+    ('0123456789ABCDEF', '4E6F772069732074', '01F49E7642C62F0D'),
+    ('0000000000000000', '0000000000000000', '9FAB9A5B428477F2'),
+    ('FFFFFFFFFFFFFFFF', 'FFFFFFFFFFFFFFFF', '605465A4BD7B880D'),
+)
+
+
+def des_blocks(key, edf, data):
+    msdes.deskey(key, edf)
+    return b''.join(msdes.des(data[i:i+8]) for i in range(0, len(data), 8))
+
+
+def invert(data):
+    return bytes(255 - x for x in data)
+
+
+class TestMsDes(unittest.TestCase):
+
+    def test_vectors(self):
+        for key, plaintext, ciphertext in VECTORS:
+            key, plaintext, ciphertext = map(bytes.fromhex, (key, plaintext, ciphertext))
+            ks = msdes.KeySchedule(key)
+            self.assertEqual(ks.encrypt(plaintext), ciphertext)
+            self.assertEqual(ks.decrypt(ciphertext), plaintext)
+            self.assertEqual(des_blocks(key, msdes.EN0, plaintext), ciphertext)
+            self.assertEqual(des_blocks(key, msdes.DE1, ciphertext), plaintext)
+
+    def test_properties(self):
+        # Properties that come from the DES key schedule and structure, so
+        # hold for the variant too
+        data = os.urandom(64)
+        for key in ('0101010101010101', 'FEFEFEFEFEFEFEFE', 'E0E0E0E0F1F1F1F1', '1F1F1F1F0E0E0E0E'):
+            ks = msdes.KeySchedule(bytes.fromhex(key))
+            self.assertEqual(ks.encrypt(ks.encrypt(data)), data, f'{key} is not a weak key')
+        key = os.urandom(8)
+        self.assertEqual(msdes.KeySchedule(invert(key)).encrypt(invert(data)), invert(msdes.KeySchedule(key).encrypt(data)))
+
+    def test_bulk(self):
+        for size in (8, 16, 8 * 1023, 64 * 1024):
+            key, data = os.urandom(8), os.urandom(size)
+            ks = msdes.KeySchedule(key)
+            ciphertext = ks.encrypt(data)
+            self.assertEqual(ciphertext, des_blocks(key, msdes.EN0, data))
+            self.assertEqual(ks.decrypt(ciphertext), data)
+            self.assertEqual(ks.decrypt(data), des_blocks(key, msdes.DE1, data))
+            self.assertEqual(ks.encrypt(memoryview(data)), ciphertext)
+        ks = msdes.KeySchedule(b'12345678')
+        for data in (b'', b'1234567', b'123456789'):
+            self.assertRaises(msdes.MsDesError, ks.encrypt, data)
+        self.assertRaises(msdes.MsDesError, msdes.KeySchedule, b'1234567')
+
+
+def find_tests():
+    return unittest.defaultTestLoader.loadTestsFromTestCase(TestMsDes)
+
+
+if __name__ == '__main__':
+    unittest.TextTestRunner(verbosity=2).run(find_tests())
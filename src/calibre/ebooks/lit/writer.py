@@ -579,8 +579,7 @@ class LitWriter:
         drmsource = 'Free as in freedom\0'.encode('utf-16-le')
         self._add_file('/DRMStorage/DRMSource', drmsource)
         tempkey = self._calculate_deskey([self._meta, drmsource])
-        msdes.deskey(tempkey, msdes.EN0)
-        self._add_file('/DRMStorage/DRMSealed', msdes.des(b"\0" * 16))
+        self._add_file('/DRMStorage/DRMSealed', msdes.KeySchedule(tempkey).encrypt(b"\0" * 16))
         self._bookkey = b'\0' * 8
         self._add_file('/DRMStorage/ValidationStream', b'MSReader', 3)
 
@@ -613,11 +612,10 @@ class LitWriter:
                     cdata = MSDES_CONTROL + cdata
                     if not data:
                         continue
-                    msdes.deskey(self._bookkey, msdes.EN0)
                     pad = 8 - (len(data) & 0x7)
                     if pad != 8:
                         data = data + (b'\0' * pad)
-                    data = msdes.des(data)
+                    data = msdes.KeySchedule(self._bookkey).encrypt(data)
                 elif guid == LZXCOMPRESS_GUID:
                     cdata = LZXC_CONTROL + cdata
                     if not data:
@@ -23,17 +23,66 @@ def get_tools():
     return pdfinfo, pdftoppm
 
 
-def read_info(outputdir, get_cover):
+def pdf_date_to_iso(val):
+    # PDF dates look like D:YYYYMMDDHHmmSS+HH'mm', convert them to the ISO
+    # format output by pdfinfo -isodates
+    m = re.match(r"D?:?(\d{4})(\d{2})?(\d{2})?(\d{2})?(\d{2})?(\d{2})?([Z+-])?(\d{2})?'?(\d{2})?", val)
+    if m is None:
+        return val
+    y, mo, d, h, mi, sec, tz, tzh, tzm = m.groups()
+    ans = f'{y}-{mo or "01"}-{d or "01"}T{h or "00"}:{mi or "00"}:{sec or "00"}'
+    if tz == 'Z':
+        ans += 'Z'
+    elif tz:
+        ans += f'{tz}{tzh or "00"}:{tzm or "00"}'
+    return ans
+
+
+def read_info_natively(path):
+    ''' Read the info dict and XMP metadata using PoDoFo, in the same format as
+    :func:`read_info`. Returns None if PoDoFo fails to parse the file. Only
+    call this from the worker process run by :func:`read_info`, so that a
+    crash parsing a malicious PDF cannot take down the calling process. '''
+    from calibre.utils.podofo import read_pdf_metadata
+    try:
+        m = read_pdf_metadata(path)
+    except Exception as e:
+        prints('Failed to read PDF metadata with PoDoFo:', e)
+        return None
+    ans = {k: v.strip() for k, v in iteritems(m['info']) if v.strip()}
+    for k in ('CreationDate', 'ModDate'):
+        if k in ans:
+            ans[k] = pdf_date_to_iso(ans[k])
+    ans['Pages'] = str(m['page_count'])
+    if m['xmp_metadata']:
+        ans['xmp_metadata'] = m['xmp_metadata'].strip()
+    return ans
+
+
+def read_info(outputdir, get_cover, use_podofo=True):
     ''' Read info dict and cover from a pdf file named src.pdf in outputdir.
     Note that this function changes the cwd to outputdir and is therefore not
     thread safe. Run it using fork_job. This is necessary as there is no safe
     way to pass unicode paths via command line arguments. This also ensures
-    that if poppler crashes, no stale file handles are left for the original
-    file, only for src.pdf.'''
+    that if poppler or PoDoFo crash, no stale file handles are left for the
+    original file, only for src.pdf. If use_podofo is True the metadata is
+    read with PoDoFo, falling back to pdfinfo if PoDoFo cannot parse the
+    file. Should PoDoFo crash the worker, the caller must run this again with
+    use_podofo=False.'''
     os.chdir(outputdir)
     pdfinfo, pdftoppm = get_tools()
-    ans = {}
+    ans = read_info_natively('src.pdf') if use_podofo else None
+    if ans is None:
+        ans = read_info_with_pdfinfo(pdfinfo)
+        if ans is None:
+            return None
+    if get_cover:
+        render_cover(pdftoppm)
+    return ans
+
 
+def read_info_with_pdfinfo(pdfinfo):
+    ans = {}
     try:
         raw = subprocess.check_output([pdfinfo, '-enc', 'UTF-8', '-isodates', 'src.pdf'])
     except subprocess.CalledProcessError as e:
@@ -70,16 +119,17 @@ def read_info(outputdir, get_cover):
         if raw:
             ans['xmp_metadata'] = raw
 
-    if get_cover:
-        try:
-            subprocess.check_call([pdftoppm, '-singlefile', '-jpeg', '-cropbox',
-                'src.pdf', 'cover'])
-        except subprocess.CalledProcessError as e:
-            prints('pdftoppm errored out with return code: %d'%e.returncode)
-
     return ans
 
 
+def render_cover(pdftoppm):
+    try:
+        subprocess.check_call([pdftoppm, '-singlefile', '-jpeg', '-cropbox',
+            'src.pdf', 'cover'])
+    except subprocess.CalledProcessError as e:
+        prints('pdftoppm errored out with return code: %d'%e.returncode)
+
+
 def page_images(pdfpath, outputdir='.', first=1, last=1, image_format='jpeg', prefix='page-images'):
     pdftoppm = get_tools()[1]
     outputdir = os.path.abspath(outputdir)
@@ -113,8 +163,14 @@ def get_metadata(stream, cover=True):
             res = fork_job('calibre.ebooks.metadata.pdf', 'read_info',
                     (pdfpath, bool(cover)))
         except WorkerError as e:
+            # PoDoFo crashed on this file, use only poppler in a fresh worker
             prints(e.orig_tb)
-            raise RuntimeError('Failed to run pdfinfo')
+            try:
+                res = fork_job('calibre.ebooks.metadata.pdf', 'read_info',
+                        (pdfpath, bool(cover), False))
+            except WorkerError as e:
+                prints(e.orig_tb)
+                raise RuntimeError('Failed to run pdfinfo')
         info = res['result']
         with open(res['stdout_stderr'], 'rb') as f:
             raw = f.read().strip()
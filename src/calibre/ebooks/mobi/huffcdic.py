@@ -6,16 +6,20 @@ __copyright__ = '2011, Kovid Goyal <kovid@kovidgoyal.net>'
 __docformat__ = 'restructuredtext en'
 
 '''
-Decompress MOBI files compressed with the Huff/cdic algorithm. Code thanks to darkninja
+Decompress MOBI files compressed with the Huff/cdic algorithm. The actual decompression is
+implemented in C, see ebooks/compression/huffcdic.c. Code thanks to darkninja
 and igorsk.
 '''
 
 import struct
 
 from calibre.ebooks.mobi import MobiError
+from calibre_extensions.huffcdic import Decoder
 
 
 class Reader:
+    ''' Pure python implementation of the decompressor, used as a reference
+    when testing the C implementation. '''
 
     def __init__(self):
         self.q = struct.Struct(b'>Q').unpack_from
@@ -97,10 +101,81 @@ class Reader:
 class HuffReader:
 
     def __init__(self, huffs):
-        self.reader = Reader()
-        self.reader.load_huff(huffs[0])
-        for cdic in huffs[1:]:
-            self.reader.load_cdic(cdic)
+        try:
+            self.decoder = Decoder(huffs[0], huffs[1:])
+        except ValueError as e:
+            raise MobiError(str(e))
 
     def unpack(self, section):
-        return self.reader.unpack(section)
+        try:
+            return self.decoder.unpack(section)
+        except ValueError as e:
+            raise MobiError(str(e))
+
+    def unpack_many(self, sections):
+        ''' Decompress a list of sections in a single call, without holding the GIL '''
+        try:
+            return self.decoder.unpack_many(sections)
+        except ValueError as e:
+            raise MobiError(str(e))
+
+
+def find_tests():
+    import unittest
+
+    def build_records(num_literals=200, num_phrases=256):
+        # A code table where every code is eight bits long, so the byte
+        # 255 - i selects dictionary entry i
+        huff = b'HUFF\x00\x00\x00\x18' + struct.pack(b'>LL', 24, 24 + 256 * 4) + b'\0' * 8
+        huff += struct.pack(b'>256L', *((255 << 8) | 0x80 | 8 for i in range(256)))
+        huff += b'\0' * (64 * 4)
+        entries = []
+        for i in range(num_phrases):
+            if i < num_literals:
+                entries.append(struct.pack(b'>H', 0x8000 | 4) + b'w%03d' % i)
+            else:
+                # Entries that are themselves compressed, referring to
+                # literal entries and to other compressed entries
+                refs = (i - num_literals, (i * 7) % num_literals) + ((i - 1,) if i > num_literals else ())
+                payload = bytes(255 - r for r in refs)
+                entries.append(struct.pack(b'>H', len(payload)) + payload)
+        offsets, off = [], 2 * num_phrases
+        for e in entries:
+            offsets.append(off)
+            off += len(e)
+        cdic = b'CDIC\x00\x00\x00\x10' + struct.pack(b'>LL', num_phrases, 8)
+        cdic += struct.pack(b'>%dH' % num_phrases, *offsets) + b''.join(entries)
+        return huff, cdic
+
+    def py_unpack(huffs, sections):
+        r = Reader()
+        r.load_huff(huffs[0])
+        for cdic in huffs[1:]:
+            r.load_cdic(cdic)
+        return [r.unpack(s) for s in sections]
+
+    class Test(unittest.TestCase):
+
+        def test_huffcdic_decompression(self):
+            huffs = build_records()
+            sections = [
+                b'', bytes(range(256)), bytes(range(255, -1, -1)),
+                bytes((i * 31) % 256 for i in range(5000)),
+            ]
+            expected = py_unpack(huffs, sections)
+            self.assertEqual(expected[2][:8], b'w000w001')
+            reader = HuffReader(huffs)
+            self.assertEqual([reader.unpack(s) for s in sections], expected)
+            self.assertEqual(HuffReader(huffs).unpack_many(sections), expected)
+
+        def test_huffcdic_errors(self):
+            huff, cdic = build_records()
+            self.assertRaises(MobiError, HuffReader, (b'XXXX' + huff[4:], cdic))
+            self.assertRaises(MobiError, HuffReader, (huff, cdic[:20]))
+            # Only half the phrases are defined, so codes selecting the rest are invalid
+            cdic = cdic[:8] + struct.pack(b'>LL', 128, 7) + cdic[16:]
+            reader = HuffReader((huff, cdic))
+            self.assertRaises(MobiError, reader.unpack, b'\x00')
+            self.assertRaises(MobiError, reader.unpack_many, [b'\xff', b'\x00'])
+
+    return unittest.defaultTestLoader.loadTestsFromTestCase(Test)
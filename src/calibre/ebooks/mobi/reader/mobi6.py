@@ -820,18 +820,18 @@ class MobiReader:
                     self.book_header.huff_offset + self.book_header.huff_number)]
             processed_records += list(range(self.book_header.huff_offset,
                 self.book_header.huff_offset + self.book_header.huff_number))
-            huff = HuffReader(huffs)
-            unpack = huff.unpack
+            unpack_all = HuffReader(huffs).unpack_many
 
         elif self.book_header.compression_type == b'\x00\x02':
-            unpack = decompress_doc
+            def unpack_all(sections):
+                return map(decompress_doc, sections)
 
         elif self.book_header.compression_type == b'\x00\x01':
-            def unpack(x):
-                return x
+            def unpack_all(sections):
+                return sections
         else:
             raise MobiError('Unknown compression algorithm: %r' % self.book_header.compression_type)
-        self.mobi_html = b''.join(map(unpack, text_sections))
+        self.mobi_html = b''.join(unpack_all(text_sections))
         if self.mobi_html.endswith(b'#'):
             self.mobi_html = self.mobi_html[:-1]
 
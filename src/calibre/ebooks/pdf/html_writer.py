@@ -660,46 +660,31 @@ def get_anchor_locations(name, pdf_doc, first_page_num, toc_uuid, log):
 
 def fix_links(pdf_doc, anchor_locations, name_anchor_map, mark_links, log):
     pc = pdf_doc.page_count()
+    anchor_map = {}
 
-    def replace_link(url):
-        purl = urlparse(url)
-        if purl.scheme != 'https' or purl.netloc not in ('calibre-pdf-anchor.a', 'calibre-pdf-anchor.n'):
-            return
-        loc = None
-        if purl.netloc == 'calibre-pdf-anchor.a':
-            loc = anchor_locations.get(purl.fragment)
-            if loc is None:
-                log.warn(f'Anchor location for link to {purl.fragment} not found')
-        else:
-            loc = anchor_locations.get(name_anchor_map.get(purl.fragment))
-            if loc is None:
-                log.warn(f'Anchor location for link to {purl.fragment} not found')
-        if loc is None:
-            return None
+    def add(netloc, frag, loc):
         if loc.pagenum > pc:
-            log.warn(f'Anchor location for link to {purl.fragment} is past the end of the document, moving it to last page')
+            log.warn(f'Anchor location for {frag} is past the end of the document, moving it to last page')
             loc.pagenum = pc
-        return loc.as_tuple
-
-    pdf_doc.alter_links(replace_link, mark_links)
+        loc = loc.as_tuple
+        # Chromium may or may not normalize the empty path to /
+        anchor_map[f'https://{netloc}#{frag}'] = anchor_map[f'https://{netloc}/#{frag}'] = loc
+
+    for frag, loc in anchor_locations.items():
+        add('calibre-pdf-anchor.a', frag, loc)
+    for name, frag in name_anchor_map.items():
+        loc = anchor_locations.get(frag)
+        if loc is not None:
+            add('calibre-pdf-anchor.n', name, loc)
+
+    num_resolved, unresolved = pdf_doc.resolve_links(
+        anchor_map, mark_links, ('https://calibre-pdf-anchor.a', 'https://calibre-pdf-anchor.n'))
+    for url in unresolved:
+        log.warn(f'Anchor location for link to {urlparse(url).fragment} not found')
 # }}}
 
 
 # Outline creation {{{
-class PDFOutlineRoot:
-
-    def __init__(self, pdf_doc):
-        self.pdf_doc = pdf_doc
-        self.root_item = None
-
-    def create(self, title, pagenum, as_child, left, top, zoom):
-        if self.root_item is None:
-            self.root_item = self.pdf_doc.create_outline(title, pagenum, left, top, zoom)
-        else:
-            self.root_item = self.root_item.create(title, pagenum, False, left, top, zoom)
-        return self.root_item
-
-
 def annotate_toc(toc, anchor_locations, name_anchor_map, log):
     for child in toc.iterdescendants():
         frag = child.frag
@@ -714,20 +699,22 @@ def annotate_toc(toc, anchor_locations, name_anchor_map, log):
         child.pdf_loc = loc
 
 
-def add_toc(pdf_parent, toc_parent, log, pdf_doc):
-    for child in toc_parent:
-        title, loc = child.title, child.pdf_loc
-        try:
-            pdf_child = pdf_parent.create(title, loc.pagenum, True, loc.left, loc.top, loc.zoom)
-        except ValueError:
-            if loc.pagenum > 1:
-                log.warn(f'TOC node: {title} at page: {loc.pagenum} is beyond end of file, moving it to last page')
-                pdf_child = pdf_parent.create(title, pdf_doc.page_count(), True, loc.left, loc.top, loc.zoom)
-            else:
-                log.warn(f'Ignoring TOC node: {title} at page: {loc.pagenum}')
-                continue
-        if len(child):
-            add_toc(pdf_child, child, log, pdf_doc)
+def add_toc(pdf_doc, toc, log):
+    entries = []
+
+    def flatten(parent, level):
+        for child in parent:
+            loc = child.pdf_loc
+            entries.append((level, child.title, loc.pagenum, loc.left, loc.top, loc.zoom))
+            if len(child):
+                flatten(child, level + 1)
+
+    flatten(toc, 0)
+    clamped, skipped = pdf_doc.create_outline_tree(entries)
+    for i in clamped:
+        log.warn(f'TOC node: {entries[i][1]} at page: {entries[i][2]} is beyond end of file, moving it to last page')
+    for i in skipped:
+        log.warn(f'Ignoring TOC node: {entries[i][1]} at page: {entries[i][2]}')
 
 
 def get_page_number_display_map(render_manager, opts, num_pages, log):
@@ -858,7 +845,23 @@ def merge_font_files(fonts, log):
     return font_data, tuple(f['Reference'] for f in descendant_fonts)
 
 
-def merge_fonts(pdf_doc, log):
+def merge_fonts(pdf_doc, log, compress=True):
+    # Merging and subsetting is done natively, with the Python implementation
+    # used only for fonts the native code could not parse. When compress is
+    # False the merged font data is left uncompressed and the caller must run
+    # pdf_doc.compress_streams() before saving.
+    merged, failed = pdf_doc.merge_truetype_fonts(compress)
+    for name, num_fonts, old_size, new_size, subsetted in merged:
+        if not subsetted:
+            log.warn(f'Subsetting of {name} failed with no glyphs found, ignoring')
+        log(f'Merged {num_fonts} instances of {name} reducing size from {human_readable(old_size)} to {human_readable(new_size)}')
+    if failed:
+        for name, err in failed:
+            log.warn(f'Native merging of {name} failed with error: {err}, falling back to slower merging')
+        merge_fonts_slow(pdf_doc, log, frozenset(name for name, err in failed), compress)
+
+
+def merge_fonts_slow(pdf_doc, log, only_fonts=None, compress=True):
     all_fonts = pdf_doc.list_fonts(True)
     base_font_map = {}
 
@@ -882,11 +885,12 @@ def merge_fonts(pdf_doc, log):
         return has_type0
 
     for f in all_fonts:
-        base_font_map.setdefault(f['BaseFont'], []).append(f)
+        if only_fonts is None or f['BaseFont'] in only_fonts:
+            base_font_map.setdefault(f['BaseFont'], []).append(f)
     for name, fonts in iteritems(base_font_map):
         if mergeable(fonts):
             font_data, references = merge_font_files(fonts, log)
-            pdf_doc.merge_fonts(font_data, references)
+            pdf_doc.merge_fonts(font_data, references, compress)
 
 
 def test_merge_fonts():
@@ -1075,7 +1079,8 @@ def add_header_footer(manager, opts, pdf_doc, container, page_number_display_map
     if first_page_num != num_pages:
         raise ValueError(f'The number of header/footers pages ({num_pages}) < number of document pages ({first_page_num})')
     pdf_doc.append(doc)
-    pdf_doc.impose(1, first_page_num + 1, num_pages)
+    # The new content streams are compressed by convert() along with everything else
+    pdf_doc.impose(1, first_page_num + 1, num_pages, False)
     report_progress(0.9, _('Headers and footers added'))
 
 # }}}
@@ -1176,7 +1181,7 @@ def convert(opf_path, opts, metadata=None, output_path=None, log=default_log, co
 
     fix_links(pdf_doc, anchor_locations, name_anchor_map, opts.pdf_mark_links, log)
     if toc and len(toc):
-        add_toc(PDFOutlineRoot(pdf_doc), toc, log, pdf_doc)
+        add_toc(pdf_doc, toc, log)
     report_progress(0.75, _('Added links to PDF content'))
 
     pdf_metadata = PDFMetadata(metadata)
@@ -1189,7 +1194,7 @@ def convert(opf_path, opts, metadata=None, output_path=None, log=default_log, co
     if num_removed:
         log('Removed', num_removed, 'unused fonts')
 
-    merge_fonts(pdf_doc, log)
+    merge_fonts(pdf_doc, log, compress=False)
     num_removed = dedup_type3_fonts(pdf_doc)
     if num_removed:
         log('Removed', num_removed, 'duplicated Type3 glyphs')
@@ -1218,6 +1223,12 @@ def convert(opf_path, opts, metadata=None, output_path=None, log=default_log, co
 
     if opts.uncompressed_pdf:
         pdf_doc.uncompress()
+    else:
+        # The font merging and imposition above store their data uncompressed
+        # so that it can all be compressed here in parallel
+        num_compressed = pdf_doc.compress_streams()
+        if num_compressed:
+            log.debug('Compressed', num_compressed, 'streams')
 
     pdf_data = pdf_doc.write()
     if output_path is None:
@@ -161,6 +161,43 @@ class BuildTest(unittest.TestCase):
         from fontTools.subset import main
         main
 
+    def test_lzx(self):
+        from calibre.ebooks.lit.lzx import Compressor, Decompressor
+        data = b''.join(b'<p>%d lzx round trip</p>' % i for i in range(2000))
+        cdata = Compressor(17).compress(data, flush=True)[0]
+        d = Decompressor(17)
+        d.reset()
+        self.assertEqual(d.decompress(cdata, len(data)), data)
+
+    def test_lzx_corrupt(self):
+        from calibre.ebooks.lit.lzx import Compressor, Decompressor, LZXError
+        data = b''.join(b'<p>%d lzx corrupt</p>' % i for i in range(100))
+        cdata = Compressor(17).compress(data, flush=True)[0]
+        d = Decompressor(17)
+
+        def decompress(c, fill):
+            # leave freed blocks of garbage that the decoder window and input
+            # buffer may reuse
+            junk = [fill * size for size in (1 << 17, 1 << 12) for i in range(8)]
+            del junk[::2]
+            d.reset()
+            try:
+                return d.decompress(c, len(data))
+            except LZXError:
+                return None
+
+        # Corrupt streams can have matches that refer to data before the
+        # start of the output and can end in the middle of a 16 bit word,
+        # the result must not depend on heap contents
+        for i in range(len(cdata) * 8):
+            c = bytearray(cdata)
+            c[i // 8] ^= 1 << (i % 8)
+            c = bytes(c)
+            self.assertEqual(decompress(c, b'\xaa'), decompress(c, b'\x55'), f'Flipping bit {i} gave inconsistent results')
+        for i in range(len(cdata)):
+            c = cdata[:i]
+            self.assertEqual(decompress(c, b'\xaa'), decompress(c, b'\x55'), f'Truncating to {i} bytes gave inconsistent results')
+
     def test_msgpack(self):
         from calibre.utils.date import utcnow
         from calibre.utils.serialize import msgpack_dumps, msgpack_loads
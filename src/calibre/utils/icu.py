@@ -101,6 +101,13 @@ def change_locale(locale=None):
         pass
 
 
+def current_locale():
+    'The locale used for collation and case changes'
+    if _locale is None:
+        collator()  # sets _locale
+    return _locale
+
+
 def primary_collator():
     'Ignores case differences and accented chars'
     return collator(strength=_icu.UCOL_PRIMARY)
@@ -6,10 +6,16 @@
  */
 
 #include "imageops.h"
+#include "simd.h"
 #include <stdexcept>
 #include <QVector>
+#include <algorithm>
+#include <array>
 #include <cmath>
-#include <set>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 // Macros {{{
 #define SQUARE(x) (x)*(x)
@@ -132,16 +138,11 @@ QImage remove_borders(const QImage &image, double fuzz) {
 QImage grayscale(const QImage &image) { // {{{
     ScopedGILRelease PyGILRelease;
     QImage img = image;
-    QRgb *row = NULL, *pixel = NULL;
-    int r = 0, gray = 0, width = img.width(), height = img.height();
+    int r = 0, width = img.width(), height = img.height();
 
     ENSURE32(img);
     for (r = 0; r < height; r++) {
-		row = reinterpret_cast<QRgb*>(img.scanLine(r));
-        for (pixel = row; pixel < row + width; pixel++) {
-            gray = qGray(*pixel);
-            *pixel = qRgb(gray, gray, gray);
-        }
+        grayscale_pixels(reinterpret_cast<QRgb*>(img.scanLine(r)), width);
     }
 	return img;
 } // }}}
@@ -582,17 +583,10 @@ QImage despeckle(const QImage &image) {
 // }}}
 
 // overlay() {{{
-static inline unsigned int BYTE_MUL(unsigned int x, unsigned int a) {
-    quint64 t = (((quint64(x)) | ((quint64(x)) << 24)) & 0x00ff00ff00ff00ffULL) * a;
-    t = (t + ((t >> 8) & 0xff00ff00ff00ffULL) + 0x80008000800080ULL) >> 8;
-    t &= 0x00ff00ff00ff00ffULL;
-    return ((unsigned int)(t)) | ((unsigned int)(t >> 24));
-}
-
 void overlay(const QImage &image, QImage &canvas, unsigned int left, unsigned int top) {
     ScopedGILRelease PyGILRelease;
     QImage img(image);
-    unsigned int cw = canvas.width(), ch = canvas.height(), iw = img.width(), ih = img.height(), r, c, right = 0, bottom = 0, height, width, s;
+    unsigned int cw = canvas.width(), ch = canvas.height(), iw = img.width(), ih = img.height(), r, right = 0, bottom = 0, height, width;
     const QRgb* src;
     QRgb* dest;
 
@@ -614,16 +608,8 @@ void overlay(const QImage &image, QImage &canvas, unsigned int left, unsigned in
         for (r = 0; r < height; r++) {
             src = reinterpret_cast<const QRgb*>(img.constScanLine(r));
             dest = reinterpret_cast<QRgb*>(canvas.scanLine(r + top));
-            for (c = 0; c < width; c++) {
-                // Optimized Alpha blending, taken from qt_blend_argb32_on_argb32
-                // Since the canvas has no transparency
-                // the composite pixel is: canvas*(1-alpha) + src * alpha
-                // but src is pre-multiplied, so it is:
-                // canvas*(1-alpha) + src
-                s = src[c];
-                if (s >= 0xff000000) dest[left+c] = s;
-                else if (s != 0) dest[left+c] = s + BYTE_MUL(dest[left+c], qAlpha(~s));
-            }
+            // Optimized Alpha blending, taken from qt_blend_argb32_on_argb32
+            blend_premultiplied_pixels(src, dest + left, width);
         }
     } else {
         ENSURE32(img);
@@ -636,38 +622,83 @@ void overlay(const QImage &image, QImage &canvas, unsigned int left, unsigned in
 
 } // }}}
 
-QImage normalize(const QImage &image) { // {{{
+// normalize() {{{
+static unsigned int num_chunks_for(size_t count, unsigned int num_threads) {
+    // Small images are not worth the overhead of starting threads
+    static const size_t min_chunk_size = 1 << 16;
+    if (!num_threads) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    return static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(num_threads, count / min_chunk_size)));
+}
+
+// Split [0, count) into num_chunks ranges and call func(start, end, chunk) for
+// each of them concurrently
+static void run_in_chunks(size_t count, unsigned int num_chunks, const std::function<void(size_t, size_t, unsigned int)> &func) {
+    const size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+    std::vector<std::thread> threads;
+    // Reserve up front so that emplace_back() cannot throw bad_alloc with
+    // joinable threads in the vector, which would call std::terminate()
+    threads.reserve(num_chunks);
+    for (unsigned int i = 1; i < num_chunks && i * chunk_size < count; i++) {
+        const size_t start = i * chunk_size, end = std::min(count, start + chunk_size);
+        try {
+            threads.emplace_back(func, start, end, i);
+        } catch (const std::system_error &) {
+            func(start, end, i);
+        }
+    }
+    try {
+        func(0, std::min(count, chunk_size), 0);
+    } catch (...) {
+        for (auto &t : threads) t.join();
+        throw;
+    }
+    for (auto &t : threads) t.join();
+}
+
+QImage normalize(const QImage &image, unsigned int num_threads) {
     ScopedGILRelease PyGILRelease;
     IntegerPixel intensity;
     HistogramListItem histogram[256] = {{0, 0, 0, 0}};
     CharPixel normalize_map[256] = {{0, 0, 0, 0}};
     ShortPixel high, low;
     uint threshold_intensity;
-    int i, count;
-    QRgb pixel, *dest;
-    unsigned char r, g, b;
+    int i;
+    size_t count;
     QImage img(image);
-    std::set<QRgb> all_colors;
 
     ENSURE32(img);
 
-    count = img.width()*img.height();
-
-    // form histogram
-    dest = (QRgb *)img.bits();
-
-    for(i=0; i < count; ++i){
-        pixel = *dest++;
-        all_colors.insert(pixel);
-        histogram[qRed(pixel)].red++;
-        histogram[qGreen(pixel)].green++;
-        histogram[qBlue(pixel)].blue++;
-        histogram[qAlpha(pixel)].alpha++;
+    count = static_cast<size_t>(img.width())*img.height();
+    // bits() detaches the image, so it must be called before starting threads
+    QRgb *pixels = reinterpret_cast<QRgb *>(img.bits());
+    const QRgb first_pixel = pixels[0];
+
+    // form histogram, each thread builds a partial histogram of its part of
+    // the image and they are summed at the end
+    const unsigned int num_chunks = num_chunks_for(count, num_threads);
+    std::vector<std::array<HistogramListItem, 256>> partial_histograms(num_chunks);
+    std::vector<char> has_other_colors(num_chunks, 0);
+    run_in_chunks(count, num_chunks, [&](size_t start, size_t end, unsigned int chunk) {
+        HistogramListItem *h = partial_histograms[chunk].data();
+        bool other_colors = false;
+        for (size_t p = start; p < end; p++) {
+            const QRgb pixel = pixels[p];
+            other_colors |= pixel != first_pixel;
+            h[qRed(pixel)].red++;
+            h[qGreen(pixel)].green++;
+            h[qBlue(pixel)].blue++;
+        }
+        has_other_colors[chunk] = other_colors;
+    });
+    if (std::none_of(has_other_colors.begin(), has_other_colors.end(), [](char x) { return x != 0; })) return img;
+    for (const auto &h : partial_histograms) {
+        for (i = 0; i < 256; i++) {
+            histogram[i].red += h[i].red; histogram[i].green += h[i].green; histogram[i].blue += h[i].blue;
+        }
     }
-    if (all_colors.size() < 2) return img;
 
     // find the histogram boundaries by locating the .01 percent levels.
-    threshold_intensity = count/1000;
+    threshold_intensity = static_cast<uint>(count/1000);
 
     memset(&intensity, 0, sizeof(IntegerPixel));
     for(low.red=0; low.red < 256; ++low.red){
@@ -739,18 +770,16 @@ QImage normalize(const QImage &image) { // {{{
         }
     }
 
-    // write
-    dest = reinterpret_cast<QRgb *>(img.bits());
-    for(i=0; i < count; ++i){
-        pixel = *dest;
-        r = (low.red != high.red) ? normalize_map[qRed(pixel)].red :
-            qRed(pixel);
-        g = (low.green != high.green) ? normalize_map[qGreen(pixel)].green :
-            qGreen(pixel);
-        b = (low.blue != high.blue) ?  normalize_map[qBlue(pixel)].blue :
-            qBlue(pixel);
-        *dest++ = qRgba(r, g, b, qAlpha(pixel));
+    // write, channels whose histogram has no spread are left unchanged
+    uint8_t red_map[256], green_map[256], blue_map[256];
+    for(i=0; i < 256; i++){
+        red_map[i] = (low.red != high.red) ? normalize_map[i].red : i;
+        green_map[i] = (low.green != high.green) ? normalize_map[i].green : i;
+        blue_map[i] = (low.blue != high.blue) ? normalize_map[i].blue : i;
     }
+    run_in_chunks(count, num_chunks, [&](size_t start, size_t end, unsigned int) {
+        map_rgb_pixels(pixels + start, end - start, red_map, green_map, blue_map);
+    });
 
     return img;
 } // }}}
@@ -878,10 +907,7 @@ bool has_transparent_pixels(const QImage &image) {  // {{{
     }
     int w = image.width(), h = image.height();
     for (int r = 0; r < h; r++) {
-        const QRgb *line = reinterpret_cast<const QRgb*>(img.constScanLine(r));
-        for (int c = 0; c < w; c++) {
-            if (qAlpha(*(line + c)) != 0xff) return true;
-        }
+        if (has_non_opaque_pixels(reinterpret_cast<const QRgb*>(img.constScanLine(r)), w)) return true;
     }
     return false;
 } // }}}
@@ -894,12 +920,12 @@ QImage set_opacity(const QImage &image, double alpha) {  // {{{
         if (img.isNull()) throw std::bad_alloc();
     }
     int w = image.width(), h = image.height();
+    // Only the alpha channel changes, so map it with a lookup table computed
+    // exactly as qRgba(r, g, b, a * alpha) would
+    uint8_t alpha_map[256];
+    for (int a = 0; a < 256; a++) alpha_map[a] = static_cast<int>(a * alpha) & 0xff;
     for (int r = 0; r < h; r++) {
-        QRgb *line = reinterpret_cast<QRgb*>(img.scanLine(r));
-        for (int c = 0; c < w; c++) {
-            QRgb pixel = *(line + c);
-            *(line + c) = qRgba(qRed(pixel), qGreen(pixel), qBlue(pixel), qAlpha(pixel) * alpha);
-        }
+        map_alpha_pixels(reinterpret_cast<QRgb*>(img.scanLine(r)), w, alpha_map);
     }
     return img;
 } // }}}
@@ -932,12 +958,7 @@ QImage texture_image(const QImage &image, const QImage &texturei) {  // {{{
                 if (overwrite) {
                     memcpy(dest, src, xlimit * sizeof(QRgb));
                 } else {
-                    for (int c = 0; c < xlimit; c++) {
-                        // See the overlay function() for an explanation of the alpha blending code below
-                        QRgb s = src[c];
-                        if (s >= 0xff000000) dest[c] = s;
-                        else if (s != 0) dest[c] = s + BYTE_MUL(dest[c], qAlpha(~s));
-                    }
+                    blend_premultiplied_pixels(src, dest, xlimit);
                 }
             }
             x += tw;
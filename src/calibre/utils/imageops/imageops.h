@@ -17,7 +17,7 @@ QImage gaussian_sharpen(const QImage &img, const float radius, const float sigma
 QImage gaussian_blur(const QImage &img, const float radius, const float sigma);
 QImage despeckle(const QImage &image);
 void overlay(const QImage &image, QImage &canvas, unsigned int left, unsigned int top);
-QImage normalize(const QImage &image);
+QImage normalize(const QImage &image, unsigned int num_threads=0);
 QImage oil_paint(const QImage &image, const float radius=-1, const bool high_quality=true);
 QImage quantize(const QImage &image, unsigned int maximum_colors, bool dither, const QVector<QRgb> &palette);
 bool has_transparent_pixels(const QImage &image);
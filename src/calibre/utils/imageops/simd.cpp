@@ -0,0 +1,334 @@
+/*
+ * simd.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "simd.h"
+#include <atomic>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define IMAGEOPS_X86_64
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC allows AVX2 intrinsics in any function
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Dispatch {{{
+static int
+detect_simd_level() {
+#ifdef IMAGEOPS_X86_64
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7) {
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+        if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5)) return SIMD_AVX2;
+        }
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+#endif
+    // SSE2 is part of the x86_64 baseline
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+static const int best_simd_level = detect_simd_level();
+static std::atomic<int> current_simd_level(best_simd_level);
+
+int
+supported_simd_level() { return best_simd_level; }
+
+int
+set_simd_level(int level) {
+    if (level < 0 || level > best_simd_level) level = best_simd_level;
+    current_simd_level = level;
+    return level;
+}
+// }}}
+
+// Scalar {{{
+static inline uint32_t
+gray_pixel(uint32_t p) {
+    const uint32_t g = (((p >> 16) & 0xff) * 11 + ((p >> 8) & 0xff) * 16 + (p & 0xff) * 5) / 32;
+    return 0xff000000u | (g << 16) | (g << 8) | g;
+}
+
+// Multiply each channel of x by a/255, taken from BYTE_MUL in Qt
+static inline uint32_t
+byte_mul(uint32_t x, uint32_t a) {
+    uint64_t t = (((uint64_t(x)) | ((uint64_t(x)) << 24)) & 0x00ff00ff00ff00ffULL) * a;
+    t = (t + ((t >> 8) & 0xff00ff00ff00ffULL) + 0x80008000800080ULL) >> 8;
+    t &= 0x00ff00ff00ff00ffULL;
+    return ((uint32_t)(t)) | ((uint32_t)(t >> 24));
+}
+
+static inline uint32_t
+blend_pixel(uint32_t s, uint32_t d) {
+    // Since the canvas has no transparency the composite pixel is:
+    // canvas*(1-alpha) + src * alpha, but src is pre-multiplied, so it is:
+    // canvas*(1-alpha) + src
+    if (s >= 0xff000000u) return s;
+    if (s == 0) return d;
+    return s + byte_mul(d, (~s) >> 24);
+}
+
+static void
+grayscale_scalar(uint32_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++) pixels[i] = gray_pixel(pixels[i]);
+}
+
+static void
+map_alpha_scalar(uint32_t *pixels, size_t count, const uint8_t *alpha_map) {
+    for (size_t i = 0; i < count; i++) pixels[i] = (pixels[i] & 0x00ffffffu) | (uint32_t(alpha_map[pixels[i] >> 24]) << 24);
+}
+
+static void
+map_rgb_scalar(uint32_t *pixels, size_t count, const uint8_t *red_map, const uint8_t *green_map, const uint8_t *blue_map) {
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t p = pixels[i];
+        pixels[i] = (p & 0xff000000u) | (uint32_t(red_map[(p >> 16) & 0xff]) << 16) | (uint32_t(green_map[(p >> 8) & 0xff]) << 8) | blue_map[p & 0xff];
+    }
+}
+
+static void
+blend_scalar(const uint32_t *src, uint32_t *dest, size_t count) {
+    for (size_t i = 0; i < count; i++) dest[i] = blend_pixel(src[i], dest[i]);
+}
+
+static bool
+has_non_opaque_scalar(const uint32_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (pixels[i] < 0xff000000u) return true;
+    }
+    return false;
+}
+// }}}
+
+#ifdef IMAGEOPS_X86_64
+// SSE2 {{{
+static inline __m128i
+gray_sse2(__m128i p) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask), g = _mm_and_si128(_mm_srli_epi32(p, 8), mask), b = _mm_and_si128(p, mask);
+    // The channels fit in the low 16 bits of each 32 bit lane so a 16 bit
+    // multiply is enough
+    __m128i sum = _mm_add_epi32(_mm_mullo_epi16(r, _mm_set1_epi32(11)), _mm_slli_epi32(g, 4));
+    sum = _mm_add_epi32(sum, _mm_mullo_epi16(b, _mm_set1_epi32(5)));
+    const __m128i gray = _mm_srli_epi32(sum, 5);
+    return _mm_or_si128(_mm_set1_epi32((int)0xff000000u), _mm_or_si128(gray, _mm_or_si128(_mm_slli_epi32(gray, 8), _mm_slli_epi32(gray, 16))));
+}
+
+static void
+grayscale_sse2(uint32_t *pixels, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i *p = reinterpret_cast<__m128i*>(pixels + i);
+        _mm_storeu_si128(p, gray_sse2(_mm_loadu_si128(p)));
+    }
+    grayscale_scalar(pixels + i, count - i);
+}
+
+static void
+map_alpha_sse2(uint32_t *pixels, size_t count, const uint8_t *alpha_map) {
+    // There is no gather in SSE2, but runs of pixels with the same alpha,
+    // typically all opaque, are by far the common case
+    const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i *p = reinterpret_cast<__m128i*>(pixels + i);
+        const __m128i v = _mm_loadu_si128(p);
+        const __m128i alphas = _mm_srli_epi32(v, 24);
+        const uint32_t first = pixels[i] >> 24;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, _mm_set1_epi32((int)first))) == 0xffff) {
+            _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(v, rgb_mask), _mm_set1_epi32((int)(uint32_t(alpha_map[first]) << 24))));
+        } else map_alpha_scalar(pixels + i, 4, alpha_map);
+    }
+    map_alpha_scalar(pixels + i, count - i, alpha_map);
+}
+
+static void
+map_rgb_sse2(uint32_t *pixels, size_t count, const uint8_t *red_map, const uint8_t *green_map, const uint8_t *blue_map) {
+    // Table lookups need gathers or byte shuffles, neither of which SSE2 has
+    map_rgb_scalar(pixels, count, red_map, green_map, blue_map);
+}
+
+// Multiply 16 bit channel values by 16 bit alphas, divide by 255 as byte_mul()
+static inline __m128i
+byte_mul_sse2(__m128i x, __m128i a) {
+    __m128i t = _mm_mullo_epi16(x, a);
+    t = _mm_add_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), _mm_set1_epi16(0x80));
+    return _mm_srli_epi16(t, 8);
+}
+
+static void
+blend_sse2(const uint32_t *src, uint32_t *dest, size_t count) {
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        // Fully transparent source pixels leave the destination unchanged
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff) continue;
+        __m128i *dp = reinterpret_cast<__m128i*>(dest + i);
+        const __m128i d = _mm_loadu_si128(dp);
+        // 255 - alpha for each pixel, repeated for all four channels
+        __m128i ia = _mm_srli_epi32(_mm_xor_si128(s, ones), 24);
+        ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+        const __m128i lo = byte_mul_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(ia, ia));
+        const __m128i hi = byte_mul_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(ia, ia));
+        // This also handles opaque and transparent source pixels, for which
+        // the product is 0 and d respectively
+        _mm_storeu_si128(dp, _mm_add_epi32(s, _mm_packus_epi16(lo, hi)));
+    }
+    blend_scalar(src + i, dest + i, count - i);
+}
+
+static bool
+has_non_opaque_sse2(const uint32_t *pixels, size_t count) {
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i *p = reinterpret_cast<const __m128i*>(pixels + i);
+        const __m128i a = _mm_and_si128(_mm_and_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)), _mm_and_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(a, alpha), alpha)) != 0xffff) return true;
+    }
+    return has_non_opaque_scalar(pixels + i, count - i);
+}
+// }}}
+
+// AVX2 {{{
+TARGET_AVX2 static void
+grayscale_avx2(uint32_t *pixels, size_t count) {
+    const __m256i mask = _mm256_set1_epi32(0xff), alpha = _mm256_set1_epi32((int)0xff000000u);
+    const __m256i rw = _mm256_set1_epi32(11), bw = _mm256_set1_epi32(5);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *p = reinterpret_cast<__m256i*>(pixels + i);
+        const __m256i v = _mm256_loadu_si256(p);
+        const __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask), g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask), b = _mm256_and_si256(v, mask);
+        __m256i sum = _mm256_add_epi32(_mm256_mullo_epi16(r, rw), _mm256_slli_epi32(g, 4));
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi16(b, bw));
+        const __m256i gray = _mm256_srli_epi32(sum, 5);
+        _mm256_storeu_si256(p, _mm256_or_si256(alpha, _mm256_or_si256(gray, _mm256_or_si256(_mm256_slli_epi32(gray, 8), _mm256_slli_epi32(gray, 16)))));
+    }
+    grayscale_scalar(pixels + i, count - i);
+}
+
+TARGET_AVX2 static void
+map_alpha_avx2(uint32_t *pixels, size_t count, const uint8_t *alpha_map) {
+    uint32_t shifted_map[256];
+    for (unsigned a = 0; a < 256; a++) shifted_map[a] = uint32_t(alpha_map[a]) << 24;
+    const __m256i rgb_mask = _mm256_set1_epi32(0x00ffffff);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *p = reinterpret_cast<__m256i*>(pixels + i);
+        const __m256i v = _mm256_loadu_si256(p);
+        const __m256i alphas = _mm256_i32gather_epi32(reinterpret_cast<const int*>(shifted_map), _mm256_srli_epi32(v, 24), 4);
+        _mm256_storeu_si256(p, _mm256_or_si256(_mm256_and_si256(v, rgb_mask), alphas));
+    }
+    map_alpha_scalar(pixels + i, count - i, alpha_map);
+}
+
+TARGET_AVX2 static void
+map_rgb_avx2(uint32_t *pixels, size_t count, const uint8_t *red_map, const uint8_t *green_map, const uint8_t *blue_map) {
+    // Widen the tables to 32 bits, already shifted into place, so that each
+    // channel is a single gather
+    uint32_t maps[3][256];
+    for (unsigned i = 0; i < 256; i++) {
+        maps[0][i] = uint32_t(red_map[i]) << 16; maps[1][i] = uint32_t(green_map[i]) << 8; maps[2][i] = blue_map[i];
+    }
+    const __m256i mask = _mm256_set1_epi32(0xff), alpha = _mm256_set1_epi32((int)0xff000000u);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *p = reinterpret_cast<__m256i*>(pixels + i);
+        const __m256i v = _mm256_loadu_si256(p);
+        const __m256i r = _mm256_i32gather_epi32(reinterpret_cast<const int*>(maps[0]), _mm256_and_si256(_mm256_srli_epi32(v, 16), mask), 4);
+        const __m256i g = _mm256_i32gather_epi32(reinterpret_cast<const int*>(maps[1]), _mm256_and_si256(_mm256_srli_epi32(v, 8), mask), 4);
+        const __m256i b = _mm256_i32gather_epi32(reinterpret_cast<const int*>(maps[2]), _mm256_and_si256(v, mask), 4);
+        _mm256_storeu_si256(p, _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(v, alpha), r), _mm256_or_si256(g, b)));
+    }
+    map_rgb_scalar(pixels + i, count - i, red_map, green_map, blue_map);
+}
+
+TARGET_AVX2 static inline __m256i
+byte_mul_avx2(__m256i x, __m256i a) {
+    __m256i t = _mm256_mullo_epi16(x, a);
+    t = _mm256_add_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), _mm256_set1_epi16(0x80));
+    return _mm256_srli_epi16(t, 8);
+}
+
+TARGET_AVX2 static void
+blend_avx2(const uint32_t *src, uint32_t *dest, size_t count) {
+    const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        if (_mm256_testz_si256(s, s)) continue;
+        __m256i *dp = reinterpret_cast<__m256i*>(dest + i);
+        const __m256i d = _mm256_loadu_si256(dp);
+        // The unpack and pack instructions work within 128 bit lanes, so the
+        // pixel order is preserved as in blend_sse2()
+        __m256i ia = _mm256_srli_epi32(_mm256_xor_si256(s, ones), 24);
+        ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+        const __m256i lo = byte_mul_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(ia, ia));
+        const __m256i hi = byte_mul_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(ia, ia));
+        _mm256_storeu_si256(dp, _mm256_add_epi32(s, _mm256_packus_epi16(lo, hi)));
+    }
+    blend_scalar(src + i, dest + i, count - i);
+}
+
+TARGET_AVX2 static bool
+has_non_opaque_avx2(const uint32_t *pixels, size_t count) {
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000u);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i *p = reinterpret_cast<const __m256i*>(pixels + i);
+        const __m256i a = _mm256_and_si256(_mm256_and_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)), _mm256_and_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        // testc is true when every bit set in alpha is also set in a
+        if (!_mm256_testc_si256(a, alpha)) return true;
+    }
+    return has_non_opaque_scalar(pixels + i, count - i);
+}
+// }}}
+#endif
+
+// Public API {{{
+#ifdef IMAGEOPS_X86_64
+#define DISPATCH(name, ...) \
+    switch (current_simd_level.load(std::memory_order_relaxed)) { \
+        case SIMD_AVX2: return name##_avx2(__VA_ARGS__); \
+        case SIMD_SSE2: return name##_sse2(__VA_ARGS__); \
+        default: return name##_scalar(__VA_ARGS__); \
+    }
+#else
+#define DISPATCH(name, ...) return name##_scalar(__VA_ARGS__);
+#endif
+
+void
+grayscale_pixels(uint32_t *pixels, size_t count) { DISPATCH(grayscale, pixels, count) }
+
+void
+map_alpha_pixels(uint32_t *pixels, size_t count, const uint8_t alpha_map[256]) { DISPATCH(map_alpha, pixels, count, alpha_map) }
+
+void
+map_rgb_pixels(uint32_t *pixels, size_t count, const uint8_t red_map[256], const uint8_t green_map[256], const uint8_t blue_map[256]) { DISPATCH(map_rgb, pixels, count, red_map, green_map, blue_map) }
+
+void
+blend_premultiplied_pixels(const uint32_t *src, uint32_t *dest, size_t count) { DISPATCH(blend, src, dest, count) }
+
+bool
+has_non_opaque_pixels(const uint32_t *pixels, size_t count) { DISPATCH(has_non_opaque, pixels, count) }
+// }}}
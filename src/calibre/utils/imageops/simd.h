@@ -0,0 +1,37 @@
+/*
+ * simd.h
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Per pixel kernels operating on rows of 32-bit 0xAARRGGBB pixels, the layout
+// of QRgb. On x86_64 they use SSE2 or AVX2, chosen at runtime depending on
+// what the CPU supports; elsewhere they use scalar code. All implementations
+// produce identical output.
+
+enum SIMDLevel { SIMD_NONE = 0, SIMD_SSE2 = 1, SIMD_AVX2 = 2 };
+
+// The best level supported by this CPU
+int supported_simd_level();
+// Change the implementation used, for testing and benchmarking. The level is
+// clamped to the supported level, which is also returned. A negative level
+// selects the best supported level.
+int set_simd_level(int level);
+
+// Replace each pixel by its opaque gray equivalent, as qGray()
+void grayscale_pixels(uint32_t *pixels, size_t count);
+// Replace the alpha of each pixel with alpha_map[alpha]
+void map_alpha_pixels(uint32_t *pixels, size_t count, const uint8_t alpha_map[256]);
+// Replace the red, green and blue channels of each pixel using the lookup
+// tables, leaving alpha unchanged
+void map_rgb_pixels(uint32_t *pixels, size_t count, const uint8_t red_map[256], const uint8_t green_map[256], const uint8_t blue_map[256]);
+// Composite the premultiplied src pixels over the opaque dest pixels
+void blend_premultiplied_pixels(const uint32_t *src, uint32_t *dest, size_t count);
+// Return true if any pixel has an alpha other than 0xff
+bool has_non_opaque_pixels(const uint32_t *pixels, size_t count);
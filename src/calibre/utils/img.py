@@ -497,8 +497,11 @@ def oil_paint_image(img, radius=-1, high_quality=True):
     return imageops.oil_paint(image_from_data(img), radius, high_quality)
 
 
-def normalize_image(img):
-    return imageops.normalize(image_from_data(img))
+def normalize_image(img, num_threads=0):
+    ''' Stretch the histogram of the image to improve its contrast. Large
+    images are processed with up to `num_threads` threads, zero means one per
+    CPU core. '''
+    return imageops.normalize(image_from_data(img), num_threads)
 
 
 def quantize_image(img, max_colors=256, dither=True, palette=''):
@@ -662,6 +665,76 @@ def encode_webp(file_path, quality=75, m=6, metadata='all'):
 # }}}
 
 
+def random_image(width, height, opaque=False):
+    data = bytearray(os.urandom(width * height * 4))
+    if opaque:
+        data[3::4] = b'\xff' * (width * height)
+    return QImage(bytes(data), width, height, QImage.Format.Format_ARGB32).copy()
+
+
+def simd_kernel_ops(img, opaque, canvas):
+    return {
+        'grayscale': lambda: grayscale_image(img),
+        'set_opacity': lambda: set_image_opacity(img, 0.37),
+        'overlay': lambda: overlay_image(img, canvas.copy(), 3, 2),
+        'texture': lambda: texture_image(canvas, img),
+        'transparency_scan': lambda: image_has_transparent_pixels(opaque),
+        'normalize': lambda: normalize_image(img),
+        'normalize_single_thread': lambda: normalize_image(img, 1),
+    }
+
+
+def test_simd_kernels():
+    # Check that the vectorized pixel kernels give exactly the same results as
+    # the scalar ones
+    def as_bytes(x):
+        return x.constBits().asstring(x.sizeInBytes()) if isinstance(x, QImage) else x
+
+    supported = imageops.supported_simd_level()
+    try:
+        # The last size is large enough for normalize() to use multiple threads
+        for width, height in ((1, 1), (37, 23), (64, 16), (301, 7), (1001, 403)):
+            img = random_image(width, height)
+            opaque = random_image(width, height, opaque=True)
+            canvas = random_image(width + 5, height + 3, opaque=True).convertToFormat(QImage.Format.Format_RGB32)
+            ops = simd_kernel_ops(img, opaque, canvas)
+            imageops.set_simd_level(0)
+            expected = {name: as_bytes(op()) for name, op in ops.items()}
+            if expected['transparency_scan']:
+                raise SystemExit('Opaque image reported as transparent')
+            for level in range(1, supported + 1):
+                imageops.set_simd_level(level)
+                for name, op in ops.items():
+                    if as_bytes(op()) != expected[name]:
+                        raise SystemExit(f'SIMD level {level} {name} differs from scalar for a {width}x{height} image')
+                if width * height > 1:
+                    opaque.setPixel(width - 1, height - 1, 0xfe000000)
+                    if not image_has_transparent_pixels(opaque):
+                        raise SystemExit(f'SIMD level {level} transparency scan missed the last pixel')
+                    opaque.setPixel(width - 1, height - 1, 0xff000000)
+    finally:
+        imageops.set_simd_level(-1)
+
+
+def benchmark_simd_kernels(width=3840, height=2160, repeat=10):
+    import time
+    img = random_image(width, height)
+    opaque = random_image(width, height, opaque=True)
+    canvas = random_image(width, height, opaque=True).convertToFormat(QImage.Format.Format_RGB32)
+    ops = simd_kernel_ops(img, opaque, canvas)
+    try:
+        for level in range(imageops.supported_simd_level() + 1):
+            imageops.set_simd_level(level)
+            for name, op in ops.items():
+                st = time.monotonic()
+                for i in range(repeat):
+                    op()
+                t = (time.monotonic() - st) / repeat
+                print(f'level={level} {name:17} {t * 1000:8.2f} ms {width * height / t / 1e6:8.1f} Mpixels/s')
+    finally:
+        imageops.set_simd_level(-1)
+
+
 def test():  # {{{
     from glob import glob
 
@@ -686,6 +759,7 @@ def test():  # {{{
         ret = optimize_webp('test.webp')
         if ret is not None:
             raise SystemExit('optimize_webp failed: %s' % ret)
+    test_simd_kernels()
     quantize_image(img)
     oil_paint_image(img)
     gaussian_sharpen_image(img)
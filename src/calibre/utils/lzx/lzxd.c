@@ -80,9 +80,9 @@
  * mask any bits. So we have to know the bit width of the bit buffer
  * variable.
  *
- * The bit buffer datatype should be at least 32 bits wide: it must be
- * possible to ENSURE_BITS(16), so it must be possible to add 16 new bits
- * to the bit buffer when the bit buffer already has 1 to 15 bits left.
+ * The bit buffer is 64 bits wide. When there is enough input available
+ * and the buffer is at most a quarter full, ENSURE_BITS refills three
+ * 16 bit words at once, otherwise it reads a single word at a time.
  */
 
 #if HAVE_LIMITS_H
@@ -92,6 +92,7 @@
 # define CHAR_BIT (8)
 #endif
 #define BITBUF_WIDTH (sizeof(bit_buffer) * CHAR_BIT)
+#define WORD_AT(p) ((uint64_t)(((p)[1] << 8) | (p)[0]))
 
 #define STORE_BITS do {                                                 \
   lzx->i_ptr      = i_ptr;                                              \
@@ -107,17 +108,30 @@
   bits_left  = lzx->bits_left;                                          \
 } while (0)
 
+/* REFILL_BITS adds three words to the bit buffer, the caller must check
+ * there are at least 6 bytes of input and at most 16 bits in the buffer */
+#define REFILL_BITS do {                                                \
+  bit_buffer |= ((WORD_AT(i_ptr) << 32) | (WORD_AT(i_ptr + 2) << 16)    \
+                 | WORD_AT(i_ptr + 4)) << (BITBUF_WIDTH - 48 - bits_left); \
+  bits_left  += 48;                                                     \
+  i_ptr      += 6;                                                      \
+} while (0)
+
 #define ENSURE_BITS(nbits)                                              \
   while (bits_left < (nbits)) {                                         \
-    if (i_ptr >= i_end) {                                               \
-      if (lzxd_read_input(lzx)) return lzx->error;                      \
-      i_ptr = lzx->i_ptr;                                               \
-      i_end = lzx->i_end;                                               \
+    if ((i_end - i_ptr) >= 6 && bits_left <= (int)BITBUF_WIDTH - 48) {  \
+      REFILL_BITS;                                                      \
+    }                                                                   \
+    else {                                                              \
+      if (i_ptr >= i_end) {                                             \
+        if (lzxd_read_input(lzx)) return lzx->error;                    \
+        i_ptr = lzx->i_ptr;                                             \
+        i_end = lzx->i_end;                                             \
+      }                                                                 \
+      bit_buffer |= WORD_AT(i_ptr) << (BITBUF_WIDTH - 16 - bits_left);  \
+      bits_left  += 16;                                                 \
+      i_ptr      += 2;                                                  \
     }                                                                   \
-    bit_buffer |= ((i_ptr[1] << 8) | i_ptr[0])                          \
-                  << (BITBUF_WIDTH - 16 - bits_left);                   \
-    bits_left  += 16;                                                   \
-    i_ptr      += 2;                                                    \
   }
 
 #define PEEK_BITS(nbits) (bit_buffer >> (BITBUF_WIDTH - (nbits)))
@@ -147,6 +161,9 @@ static int lzxd_read_input(struct lzxd_stream *lzx) {
       lzx->input_end = 1;
     }
   }
+  /* bits are read a word at a time, so after an odd number of bytes the
+   * next byte in the buffer is read too, make it zero, not stale data */
+  else if (read & 1) lzx->inbuf[read] = 0;
 
   lzx->i_ptr = &lzx->inbuf[0];
   lzx->i_end = &lzx->inbuf[read];
@@ -164,116 +181,155 @@ static int lzxd_read_input(struct lzxd_stream *lzx) {
   ENSURE_BITS(16);                                                      \
   /* immediate table lookup of [tablebits] bits of the code */          \
   sym = lzx->tbl##_table[PEEK_BITS(LZX_##tbl##_TABLEBITS)];             \
-  /* is the symbol is longer than [tablebits] bits? (i=node index) */   \
-  if (sym >= LZX_##tbl##_MAXSYMBOLS) {                                  \
-    /* decode remaining bits by tree traversal */                       \
-    i = 1 << (BITBUF_WIDTH - LZX_##tbl##_TABLEBITS);                    \
-    do {                                                                \
-      /* one less bit. error if we run out of bits before decode */     \
-      i >>= 1;                                                          \
-      if (i == 0) {                                                     \
-        D(("out of bits in huffman decode"))                            \
-        return lzx->error = MSPACK_ERR_DECRUNCH;                        \
-      }                                                                 \
-      /* double node index and add 0 (left branch) or 1 (right) */      \
-      sym <<= 1; sym |= (bit_buffer & i) ? 1 : 0;                       \
-      /* hop to next node index / decoded symbol */                     \
-      sym = lzx->tbl##_table[sym];                                      \
-      /* while we are still in node indices, not decoded symbols */    \
-    } while (sym >= LZX_##tbl##_MAXSYMBOLS);                            \
+  /* is the symbol longer than [tablebits] bits? */                     \
+  if (sym & LZX_HUFF_SUBTABLE) {                                        \
+    /* look up the remaining bits in the secondary table */             \
+    i = (sym >> 16) & 0xFF;                                             \
+    if (i == 0) {                                                       \
+      D(("invalid huffman code"))                                       \
+      return lzx->error = MSPACK_ERR_DECRUNCH;                          \
+    }                                                                   \
+    sym = lzx->tbl##_table[(sym & 0xFFFF) +                             \
+      (PEEK_BITS(LZX_##tbl##_TABLEBITS + i) & ((1 << i) - 1))];         \
   }                                                                     \
   /* result */                                                          \
-  (var) = sym;                                                          \
-  /* look up the code length of that symbol and discard those bits */   \
-  i = lzx->tbl##_len[sym];                                              \
-  REMOVE_BITS(i);                                                       \
+  (var) = sym & 0xFFFF;                                                 \
+  /* discard the bits of the code, its length is stored in the entry */ \
+  REMOVE_BITS(sym >> 16);                                               \
+} while (0)
+
+/* DECODE_LITERALS decodes literals while they can be looked up directly
+ * in the primary main tree table, refilling the bit buffer only while the
+ * input buffer has enough data. Stops at the first match or long code,
+ * which READ_HUFFSYM then handles. */
+#define DECODE_LITERALS do {                                            \
+  while (this_run > 0) {                                                \
+    if (bits_left < LZX_MAINTREE_TABLEBITS) {                           \
+      if ((i_end - i_ptr) < 6) break;                                   \
+      REFILL_BITS;                                                      \
+    }                                                                   \
+    sym = lzx->MAINTREE_table[PEEK_BITS(LZX_MAINTREE_TABLEBITS)];       \
+    if ((sym & 0xFFFF) >= LZX_NUM_CHARS) break;                         \
+    window[window_posn++] = (unsigned char) sym;                        \
+    REMOVE_BITS(sym >> 16);                                             \
+    this_run--;                                                         \
+  }                                                                     \
 } while (0)
 
 /* BUILD_TABLE(tbl) builds a huffman lookup table from code lengths */
 #define BUILD_TABLE(tbl)                                                \
   if (make_decode_table(LZX_##tbl##_MAXSYMBOLS, LZX_##tbl##_TABLEBITS,  \
-			&lzx->tbl##_len[0], &lzx->tbl##_table[0]))      \
+			&lzx->tbl##_len[0], &lzx->tbl##_table[0],       \
+			sizeof(lzx->tbl##_table) / sizeof(uint32_t)))   \
   {                                                                     \
     D(("failed to build %s table", #tbl))                               \
     return lzx->error = MSPACK_ERR_DECRUNCH;                            \
   }
 
-/* make_decode_table(nsyms, nbits, length[], table[])
+/* make_decode_table(nsyms, nbits, length[], table[], table_size)
  *
- * This function was coded by David Tritscher. It builds a fast huffman
- * decoding table from a canonical huffman code lengths table.
+ * Builds a two level huffman decoding table from a canonical huffman code
+ * lengths table. Codes of nbits or less are decoded with one lookup in the
+ * primary table, whose entries hold the symbol and its code length. Longer
+ * codes have a primary entry pointing to a secondary table, indexed by the
+ * remaining bits of the code.
  *
- * nsyms  = total number of symbols in this huffman tree.
- * nbits  = any symbols with a code length of nbits or less can be decoded
- *          in one lookup of the table.
- * length = A table to get code lengths from [0 to syms-1]
- * table  = The table to fill up with decoded symbols and pointers.
+ * nsyms      = total number of symbols in this huffman tree.
+ * nbits      = number of bits in the primary table (at most 12).
+ * length     = A table to get code lengths from [0 to syms-1]
+ * table      = The table to fill up with decoded symbols and pointers.
+ * table_size = The number of entries in table.
  *
  * Returns 0 for OK or 1 for error
  */
 
 static int make_decode_table(unsigned int nsyms, unsigned int nbits,
-			     unsigned char *length, unsigned short *table)
+			     unsigned char *length, uint32_t *table,
+			     unsigned int table_size)
 {
-  register unsigned short sym;
-  register unsigned int leaf, fill;
-  register unsigned char bit_num;
-  unsigned int pos         = 0; /* the current position in the decode table */
-  unsigned int table_mask  = 1 << nbits;
-  unsigned int bit_mask    = table_mask >> 1; /* don't do 0 length codes */
-  unsigned int next_symbol = bit_mask; /* base of allocation for long codes */
-
-  /* fill entries for codes short enough for a direct mapping */
-  for (bit_num = 1; bit_num <= nbits; bit_num++) {
-    for (sym = 0; sym < nsyms; sym++) {
-      if (length[sym] != bit_num) continue;
-      leaf = pos;
-      if((pos += bit_mask) > table_mask) return 1; /* table overrun */
-      /* fill all possible lookups of this symbol with the symbol itself */
-      for (fill = bit_mask; fill-- > 0;) table[leaf++] = sym;
-    }
-    bit_mask >>= 1;
-  }
-
-  /* full table already? */
-  if (pos == table_mask) return 0;
+  unsigned int count[17] = {0}, next_code[17], codes[LZX_MAINTREE_MAXSYMBOLS];
+  unsigned char sub_bits[1 << 12];
+  unsigned int sym, len, code, left, i, fill, start, extra, next_sub;
+  unsigned int table_mask = 1 << nbits, max_len = 16;
 
-  /* clear the remainder of the table */
-  for (sym = pos; sym < table_mask; sym++) table[sym] = 0xFFFF;
+  if (nbits > 12 || nsyms > LZX_MAINTREE_MAXSYMBOLS) return 1;
 
-  /* allow codes to be up to nbits+16 long, instead of nbits */
-  pos <<= 16;
-  table_mask <<= 16;
-  bit_mask = 1 << 15;
+  /* count the codes of each length, and check that the code is complete */
+  for (sym = 0; sym < nsyms; sym++) {
+    if (length[sym] > 16) return 1;
+    count[length[sym]]++;
+  }
+  count[0] = 0;
+  for (left = 1, len = 1; len <= 16; len++) {
+    left <<= 1;
+    if (count[len] > left) return 1; /* over-subscribed */
+    left -= count[len];
+    /* if the short codes fill the primary table, any longer codes can
+     * never be decoded: ignore them, as earlier versions did */
+    if (!left && len == nbits) {
+      max_len = nbits;
+      for (i = nbits + 1; i <= 16; i++) count[i] = 0;
+      break;
+    }
+  }
+  if (left) {
+    /* either erroneous table, or all elements are 0 */
+    if (left != (1 << 16)) return 1;
+    for (i = 0; i < table_mask; i++) table[i] = LZX_HUFF_INVALID;
+    return 0;
+  }
 
-  for (bit_num = nbits+1; bit_num <= 16; bit_num++) {
+  /* assign canonical codes */
+  next_code[1] = 0;
+  for (len = 2; len <= 16; len++)
+    next_code[len] = (next_code[len-1] + count[len-1]) << 1;
+  for (sym = 0; sym < nsyms; sym++)
+    if (length[sym] && length[sym] <= max_len)
+      codes[sym] = next_code[length[sym]]++;
+
+  /* size the secondary tables by the longest code sharing each prefix,
+   * touching only the prefixes that have long codes */
+  for (len = nbits + 1; len <= 16 && !count[len]; len++);
+  if (len <= 16) {
+    for (sym = 0; sym < nsyms; sym++)
+      if (length[sym] > nbits) sub_bits[codes[sym] >> (length[sym] - nbits)] = 0;
     for (sym = 0; sym < nsyms; sym++) {
-      if (length[sym] != bit_num) continue;
-
-      leaf = pos >> 16;
-      for (fill = 0; fill < bit_num - nbits; fill++) {
-	/* if this path hasn't been taken yet, 'allocate' two entries */
-	if (table[leaf] == 0xFFFF) {
-	  table[(next_symbol << 1)] = 0xFFFF;
-	  table[(next_symbol << 1) + 1] = 0xFFFF;
-	  table[leaf] = next_symbol++;
-	}
-	/* follow the path and select either left or right for next bit */
-	leaf = table[leaf] << 1;
-	if ((pos >> (15-fill)) & 1) leaf++;
+      len = length[sym];
+      if (len > nbits) {
+	i = codes[sym] >> (len - nbits);
+	if (len - nbits > sub_bits[i]) sub_bits[i] = len - nbits;
       }
-      table[leaf] = sym;
-
-      if ((pos += bit_mask) > table_mask) return 1; /* table overflow */
     }
-    bit_mask >>= 1;
+    /* allocate each secondary table once, marking its prefix as done */
+    for (next_sub = table_mask, sym = 0; sym < nsyms; sym++) {
+      len = length[sym];
+      if (len <= nbits) continue;
+      i = codes[sym] >> (len - nbits);
+      if (sub_bits[i] & 0x80) continue;
+      if (next_sub + (1 << sub_bits[i]) > table_size) return 1;
+      table[i] = LZX_HUFF_SUBTABLE | (sub_bits[i] << 16) | next_sub;
+      next_sub += 1 << sub_bits[i];
+      sub_bits[i] |= 0x80;
+    }
   }
 
-  /* full table? */
-  if (pos == table_mask) return 0;
-
-  /* either erroneous table, or all elements are 0 - let's find out. */
-  for (sym = 0; sym < nsyms; sym++) if (length[sym]) return 1;
+  /* fill in the symbols */
+  for (sym = 0; sym < nsyms; sym++) {
+    len = length[sym];
+    if (!len || len > max_len) continue;
+    code = codes[sym];
+    if (len <= nbits) {
+      start = code << (nbits - len);
+      fill = 1 << (nbits - len);
+    }
+    else {
+      i = code >> (len - nbits);
+      extra = (sub_bits[i] & 0x7F) - (len - nbits);
+      start = (table[i] & 0xFFFF) + ((code & ((1 << (len - nbits)) - 1)) << extra);
+      fill = 1 << extra;
+    }
+    while (fill-- > 0) table[start++] = sym | (len << 16);
+  }
   return 0;
 }
 
@@ -293,9 +349,9 @@ static int lzxd_read_lens(struct lzxd_stream *lzx, unsigned char *lens,
 			  unsigned int first, unsigned int last)
 {
   /* bit buffer and huffman symbol decode variables */
-  register unsigned int bit_buffer;
+  register uint64_t bit_buffer;
   register int bits_left, i;
-  register unsigned short sym;
+  register unsigned int sym;
   unsigned char *i_ptr, *i_end;
 
   unsigned int x, y;
@@ -395,7 +451,7 @@ struct lzxd_stream *lzxd_init(struct mspack_system *system,
 			      int input_buffer_size,
 			      off_t output_length)
 {
-  unsigned int window_size = 1 << window_bits;
+  unsigned int window_size = 1 << window_bits, i;
   struct lzxd_stream *lzx;
 
   if (!system) return NULL;
@@ -428,6 +484,9 @@ struct lzxd_stream *lzxd_init(struct mspack_system *system,
     system->free(lzx);
     return NULL;
   }
+  /* corrupt streams can have matches reaching back before the start of
+   * the output, make them read zeros rather than whatever was on the heap */
+  for (i = 0; i < window_size; i++) lzx->window[i] = 0;
 
   /* initialise decompression state */
   lzx->sys             = system;
@@ -468,9 +527,9 @@ void lzxd_set_output_length(struct lzxd_stream *lzx, off_t out_bytes) {
 
 int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
   /* bitstream reading and huffman variables */
-  register unsigned int bit_buffer;
+  register uint64_t bit_buffer;
   register int bits_left, i=0;
-  register unsigned short sym;
+  register unsigned int sym;
   unsigned char *i_ptr, *i_end;
 
   int match_length, length_footer, extra, verbatim_bits, bytes_todo;
@@ -583,11 +642,18 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
 
 	  /* read 1-16 (not 0-15) bits to align to bytes */
 	  ENSURE_BITS(16);
-	  if (bits_left > 16) i_ptr -= 2;
+	  REMOVE_BITS((bits_left & 15) ? (bits_left & 15) : 16);
+
+	  /* read 12 bytes of stored R0 / R1 / R2 values, first from any
+	   * whole words still in the bit buffer (at most 6 bytes) */
+	  for (rundest = &buf[0], i = 0; bits_left >= 16; i += 2) {
+	    j = (int) PEEK_BITS(16);
+	    REMOVE_BITS(16);
+	    *rundest++ = j & 0xFF;
+	    *rundest++ = j >> 8;
+	  }
 	  bits_left = 0; bit_buffer = 0;
-
-	  /* read 12 bytes of stored R0 / R1 / R2 values */
-	  for (rundest = &buf[0], i = 0; i < 12; i++) {
+	  for (; i < 12; i++) {
 	    if (i_ptr == i_end) {
 	      if (lzxd_read_input(lzx)) return lzx->error;
 	      i_ptr = lzx->i_ptr;
@@ -619,6 +685,8 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
       switch (lzx->block_type) {
       case LZX_BLOCKTYPE_VERBATIM:
 	while (this_run > 0) {
+	  DECODE_LITERALS;
+	  if (this_run <= 0) break;
 	  READ_HUFFSYM(MAINTREE, main_element);
 	  if (main_element < LZX_NUM_CHARS) {
 	    /* literal: 0 to LZX_NUM_CHARS-1 */
@@ -676,7 +744,9 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
 	    }
 	    else {
 	      runsrc = rundest - match_offset;
-	      while (i-- > 0) *rundest++ = *runsrc++;
+	      /* only overlapping matches need a byte by byte copy */
+	      if (match_offset >= (unsigned int) i) lzx->sys->copy(runsrc, rundest, i);
+	      else while (i-- > 0) *rundest++ = *runsrc++;
 	    }
 
 	    this_run    -= match_length;
@@ -687,6 +757,8 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
 
       case LZX_BLOCKTYPE_ALIGNED:
 	while (this_run > 0) {
+	  DECODE_LITERALS;
+	  if (this_run <= 0) break;
 	  READ_HUFFSYM(MAINTREE, main_element);
 	  if (main_element < LZX_NUM_CHARS) {
 	    /* literal: 0 to LZX_NUM_CHARS-1 */
@@ -765,7 +837,9 @@ int lzxd_decompress(struct lzxd_stream *lzx, off_t out_bytes) {
 	    }
 	    else {
 	      runsrc = rundest - match_offset;
-	      while (i-- > 0) *rundest++ = *runsrc++;
+	      /* only overlapping matches need a byte by byte copy */
+	      if (match_offset >= (unsigned int) i) lzx->sys->copy(runsrc, rundest, i);
+	      else while (i-- > 0) *rundest++ = *runsrc++;
 	    }
 
 	    this_run    -= match_length;
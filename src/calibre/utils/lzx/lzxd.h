@@ -13,6 +13,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdint.h>
 
 
 /* LZX compression / decompression definitions */
@@ -30,6 +31,13 @@
 #define LZX_NUM_PRIMARY_LENGTHS      (7)   /* this one missing from spec! */
 #define LZX_NUM_SECONDARY_LENGTHS    (249) /* length tree #elements */
 
+/* Huffman decoding tables have a primary table of 2^TABLEBITS entries,
+ * each of which is either a symbol and its code length, or for longer codes,
+ * the position and size of a secondary table that is indexed with the
+ * remaining bits of the code. */
+#define LZX_HUFF_SUBTABLE       (0x80000000U)
+#define LZX_HUFF_INVALID        (LZX_HUFF_SUBTABLE | 0xFFFF)
+
 /* LZX huffman defines: tweak tablebits as desired */
 #define LZX_PRETREE_MAXSYMBOLS  (LZX_PRETREE_NUM_ELEMENTS)
 #define LZX_PRETREE_TABLEBITS   (6)
@@ -75,7 +83,8 @@ struct lzxd_stream {
 
   /* I/O buffering */
   unsigned char *inbuf, *i_ptr, *i_end, *o_ptr, *o_end;
-  unsigned int  bit_buffer, bits_left, inbuf_size;
+  uint64_t      bit_buffer;
+  unsigned int  bits_left, inbuf_size;
 
   /* huffman code lengths */
   unsigned char PRETREE_len  [LZX_PRETREE_MAXSYMBOLS  + LZX_LENTABLE_SAFETY];
@@ -83,15 +92,16 @@ struct lzxd_stream {
   unsigned char LENGTH_len   [LZX_LENGTH_MAXSYMBOLS   + LZX_LENTABLE_SAFETY];
   unsigned char ALIGNED_len  [LZX_ALIGNED_MAXSYMBOLS  + LZX_LENTABLE_SAFETY];
 
-  /* huffman decoding tables */
-  unsigned short PRETREE_table [(1 << LZX_PRETREE_TABLEBITS) +
-				(LZX_PRETREE_MAXSYMBOLS * 2)];
-  unsigned short MAINTREE_table[(1 << LZX_MAINTREE_TABLEBITS) +
-				(LZX_MAINTREE_MAXSYMBOLS * 2)];
-  unsigned short LENGTH_table  [(1 << LZX_LENGTH_TABLEBITS) +
-				(LZX_LENGTH_MAXSYMBOLS * 2)];
-  unsigned short ALIGNED_table [(1 << LZX_ALIGNED_TABLEBITS) +
-				(LZX_ALIGNED_MAXSYMBOLS * 2)];
+  /* huffman decoding tables. A secondary table of 2^k entries needs at
+   * least k+1 symbols, so these sizes are enough for any valid code */
+  uint32_t PRETREE_table [(1 << LZX_PRETREE_TABLEBITS) +
+			  (LZX_PRETREE_MAXSYMBOLS * 64)];
+  uint32_t MAINTREE_table[(1 << LZX_MAINTREE_TABLEBITS) +
+			  (LZX_MAINTREE_MAXSYMBOLS * 4)];
+  uint32_t LENGTH_table  [(1 << LZX_LENGTH_TABLEBITS) +
+			  (LZX_LENGTH_MAXSYMBOLS * 4)];
+  uint32_t ALIGNED_table [(1 << LZX_ALIGNED_TABLEBITS) +
+			  (LZX_ALIGNED_MAXSYMBOLS * 4)];
 
   /* this is used purely for doing the intel E8 transform */
   unsigned char  e8_buf[LZX_FRAME_SIZE];
@@ -12,6 +12,9 @@
  
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #undef D2_DES		
 #undef D3_DES		
  
@@ -38,6 +41,22 @@ typedef union {
 	unsigned char dbyte[16];
 	} M68K2;
  
+/* A cooked key schedule, as used by the reentrant functions below */
+typedef uint32_t des_key_schedule[32];
+
+extern void deskey_r(const unsigned char *, short, des_key_schedule);
+/*		      hexkey[8]     MODE	schedule
+ * Same as deskey() below, except that the key schedule is stored in
+ * schedule instead of the internal key register.
+ */
+
+extern void des_ecb(const des_key_schedule, const unsigned char *, unsigned char *, size_t);
+/*		      schedule		from[8*n]	to[8*n]		n
+ * Encrypts/Decrypts (according to schedule) n blocks of eight bytes at
+ * address 'from' into address 'to'. They can be the same. Does not use
+ * any global state, so is safe to call from multiple threads.
+ */
+
 extern void deskey(unsigned char *, short);
 /*		      hexkey[8]     MODE
  * Sets the internal key register according to the hexadecimal
@@ -17,10 +17,7 @@
 
 #include "d3des.h"
 
-static void scrunch(unsigned char *, unsigned long *);
-static void unscrun(unsigned long *, unsigned char *);
-static void desfunc(unsigned long *, unsigned long *);
-static void cookey(unsigned long *);
+static void cookey(unsigned long *, des_key_schedule);
 
 static unsigned long KnL[32] = { 0L };
 /*
@@ -60,7 +57,17 @@ static unsigned char pc2[48] = {
 	40, 51, 30, 36, 46, 54,	29, 39, 50, 44, 32, 47,
 	43, 48, 38, 55, 33, 52,	45, 41, 49, 35, 28, 31 };
 
-void deskey(unsigned char *key, short edf)	/* Thanks to James Gillogly & Phil Karn! */
+void deskey(unsigned char *key, short edf)
+{
+	des_key_schedule ks;
+	int i;
+
+	deskey_r(key, edf, ks);
+	for( i = 0; i < 32; i++ ) KnL[i] = ks[i];
+	return;
+	}
+
+void deskey_r(const unsigned char *key, short edf, des_key_schedule ks)	/* Thanks to James Gillogly & Phil Karn! */
 {
 	int i, j, l, m, n;
 	unsigned char pc1m[56], pcr[56];
@@ -91,17 +98,15 @@ void deskey(unsigned char *key, short edf)	/* Thanks to James Gillogly & Phil Ka
 			if( pcr[pc2[j+24]] ) kn[n] |= bigbyte[j];
 			}
 		}
-	cookey(kn);
+	cookey(kn, ks);
 	return;
 	}
 
-static void cookey(unsigned long *raw1)
+static void cookey(unsigned long *raw1, des_key_schedule cook)
 {
-	unsigned long *cook, *raw0;
-	unsigned long dough[32];
+	unsigned long *raw0;
 	int i;
 
-	cook = dough;
 	for( i = 0; i < 16; i++, raw1++ ) {
 		raw0 = raw1++;
 		*cook	 = (*raw0 & 0x00fc0000L) << 6;
@@ -113,7 +118,6 @@ static void cookey(unsigned long *raw1)
 		*cook	|= (*raw1 & 0x0003f000L) >> 4;
 		*cook++	|= (*raw1 & 0x0000003fL);
 		}
-	usekey(dough);
 	return;
 	}
 
@@ -137,39 +141,11 @@ void usekey(unsigned long *from)
 
 void des(unsigned char *inblock, unsigned char *outblock)
 {
-	unsigned long work[2];
-
-	scrunch(inblock, work);
-	desfunc(work, KnL);
-	unscrun(work, outblock);
-	return;
-	}
-
-
-static void scrunch(unsigned char *outof, unsigned long *into)
-{
-	*into 	 = (*outof++ & 0xffL) << 24;
-	*into 	|= (*outof++ & 0xffL) << 16;
-	*into 	|= (*outof++ & 0xffL) << 8;
-	*into++ |= (*outof++ & 0xffL);
-	*into 	 = (*outof++ & 0xffL) << 24;
-	*into 	|= (*outof++ & 0xffL) << 16;
-	*into 	|= (*outof++ & 0xffL) << 8;
-	*into	|= (*outof   & 0xffL);
-	return;
-	}
-
+	des_key_schedule ks;
+	int i;
 
-static void unscrun(unsigned long *outof, unsigned char *into)
-{
-	*into++ = (*outof >> 24) & 0xffL;
-	*into++ = (*outof >> 16) & 0xffL;
-	*into++ = (*outof >>  8) & 0xffL;
-	*into++ =  *outof++	 & 0xffL;
-	*into++ = (*outof >> 24) & 0xffL;
-	*into++ = (*outof >> 16) & 0xffL;
-	*into++ = (*outof >>  8) & 0xffL;
-	*into   =  *outof	 & 0xffL;
+	for( i = 0; i < 32; i++ ) ks[i] = (uint32_t)KnL[i];
+	des_ecb(ks, inblock, outblock, 1);
 	return;
 	}
 
@@ -321,79 +297,89 @@ static unsigned long SP8[64] = {
 */
 
 
-static void desfunc(unsigned long *block, unsigned long *keys)
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define F(x, k0, k1) ( \
+	SP7[(ROR(x, 4) ^ (k0)) & 0x3f] | SP5[((ROR(x, 4) ^ (k0)) >> 8) & 0x3f] | \
+	SP3[((ROR(x, 4) ^ (k0)) >> 16) & 0x3f] | SP1[((ROR(x, 4) ^ (k0)) >> 24) & 0x3f] | \
+	SP8[((x) ^ (k1)) & 0x3f] | SP6[(((x) ^ (k1)) >> 8) & 0x3f] | \
+	SP4[(((x) ^ (k1)) >> 16) & 0x3f] | SP2[(((x) ^ (k1)) >> 24) & 0x3f])
+
+/* Process nblocks eight byte blocks from inblock into outblock, which may be
+ * the same. Uses only the passed in key schedule, so it is safe to call from
+ * multiple threads at once. The round function is fully unrolled and works
+ * on 32 bit words, using the combined S-box/P-permutation tables. */
+void des_ecb(const des_key_schedule keys, const unsigned char *inblock, unsigned char *outblock, size_t nblocks)
 {
-	unsigned long fval, work, right, leftt;
-	int round;
-
-	leftt = block[0];
-	right = block[1];
-	work = ((leftt >> 4) ^ right) & 0x0f0f0f0fL;
-	right ^= work;
-	leftt ^= (work << 4);
-	work = ((leftt >> 16) ^ right) & 0x0000ffffL;
-	right ^= work;
-	leftt ^= (work << 16);
-	work = ((right >> 2) ^ leftt) & 0x33333333L;
-	leftt ^= work;
-	right ^= (work << 2);
-	work = ((right >> 8) ^ leftt) & 0x00ff00ffL;
-	leftt ^= work;
-	right ^= (work << 8);
-	right = ((right << 1) | ((right >> 31) & 1L)) & 0xffffffffL;
-	work = (leftt ^ right) & 0xaaaaaaaaL;
-	leftt ^= work;
-	right ^= work;
-	leftt = ((leftt << 1) | ((leftt >> 31) & 1L)) & 0xffffffffL;
-
-	for( round = 0; round < 8; round++ ) {
-		work  = (right << 28) | (right >> 4);
-		work ^= *keys++;
-		fval  = SP7[ work		 & 0x3fL];
-		fval |= SP5[(work >>  8) & 0x3fL];
-		fval |= SP3[(work >> 16) & 0x3fL];
-		fval |= SP1[(work >> 24) & 0x3fL];
-		work  = right ^ *keys++;
-		fval |= SP8[ work		 & 0x3fL];
-		fval |= SP6[(work >>  8) & 0x3fL];
-		fval |= SP4[(work >> 16) & 0x3fL];
-		fval |= SP2[(work >> 24) & 0x3fL];
-		leftt ^= fval;
-		work  = (leftt << 28) | (leftt >> 4);
-		work ^= *keys++;
-		fval  = SP7[ work		 & 0x3fL];
-		fval |= SP5[(work >>  8) & 0x3fL];
-		fval |= SP3[(work >> 16) & 0x3fL];
-		fval |= SP1[(work >> 24) & 0x3fL];
-		work  = leftt ^ *keys++;
-		fval |= SP8[ work		 & 0x3fL];
-		fval |= SP6[(work >>  8) & 0x3fL];
-		fval |= SP4[(work >> 16) & 0x3fL];
-		fval |= SP2[(work >> 24) & 0x3fL];
-		right ^= fval;
+	uint32_t work, right, leftt;
+	const unsigned char *in = inblock;
+	unsigned char *out = outblock;
+
+	for( ; nblocks > 0; nblocks--, in += 8, out += 8 ) {
+		leftt = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+		right = ((uint32_t)in[4] << 24) | ((uint32_t)in[5] << 16) | ((uint32_t)in[6] << 8) | in[7];
+
+		work = ((leftt >> 4) ^ right) & 0x0f0f0f0fU;
+		right ^= work;
+		leftt ^= (work << 4);
+		work = ((leftt >> 16) ^ right) & 0x0000ffffU;
+		right ^= work;
+		leftt ^= (work << 16);
+		work = ((right >> 2) ^ leftt) & 0x33333333U;
+		leftt ^= work;
+		right ^= (work << 2);
+		work = ((right >> 8) ^ leftt) & 0x00ff00ffU;
+		leftt ^= work;
+		right ^= (work << 8);
+		right = ROR(right, 31);
+		work = (leftt ^ right) & 0xaaaaaaaaU;
+		leftt ^= work;
+		right ^= work;
+		leftt = ROR(leftt, 31);
+
+		leftt ^= F(right, keys[0], keys[1]);
+		right ^= F(leftt, keys[2], keys[3]);
+		leftt ^= F(right, keys[4], keys[5]);
+		right ^= F(leftt, keys[6], keys[7]);
+		leftt ^= F(right, keys[8], keys[9]);
+		right ^= F(leftt, keys[10], keys[11]);
+		leftt ^= F(right, keys[12], keys[13]);
+		right ^= F(leftt, keys[14], keys[15]);
+		leftt ^= F(right, keys[16], keys[17]);
+		right ^= F(leftt, keys[18], keys[19]);
+		leftt ^= F(right, keys[20], keys[21]);
+		right ^= F(leftt, keys[22], keys[23]);
+		leftt ^= F(right, keys[24], keys[25]);
+		right ^= F(leftt, keys[26], keys[27]);
+		leftt ^= F(right, keys[28], keys[29]);
+		right ^= F(leftt, keys[30], keys[31]);
+
+		right = ROR(right, 1);
+		work = (leftt ^ right) & 0xaaaaaaaaU;
+		leftt ^= work;
+		right ^= work;
+		leftt = ROR(leftt, 1);
+		work = ((leftt >> 8) ^ right) & 0x00ff00ffU;
+		right ^= work;
+		leftt ^= (work << 8);
+		work = ((leftt >> 2) ^ right) & 0x33333333U;
+		right ^= work;
+		leftt ^= (work << 2);
+		work = ((right >> 16) ^ leftt) & 0x0000ffffU;
+		leftt ^= work;
+		right ^= (work << 16);
+		work = ((right >> 4) ^ leftt) & 0x0f0f0f0fU;
+		leftt ^= work;
+		right ^= (work << 4);
+
+		out[0] = (unsigned char)(right >> 24); out[1] = (unsigned char)(right >> 16);
+		out[2] = (unsigned char)(right >> 8); out[3] = (unsigned char)right;
+		out[4] = (unsigned char)(leftt >> 24); out[5] = (unsigned char)(leftt >> 16);
+		out[6] = (unsigned char)(leftt >> 8); out[7] = (unsigned char)leftt;
 		}
-
-	right = (right << 31) | (right >> 1);
-	work = (leftt ^ right) & 0xaaaaaaaaL;
-	leftt ^= work;
-	right ^= work;
-	leftt = (leftt << 31) | (leftt >> 1);
-	work = ((leftt >> 8) ^ right) & 0x00ff00ffL;
-	right ^= work;
-	leftt ^= (work << 8);
-	work = ((leftt >> 2) ^ right) & 0x33333333L;
-	right ^= work;
-	leftt ^= (work << 2);
-	work = ((right >> 16) ^ leftt) & 0x0000ffffL;
-	leftt ^= work;
-	right ^= (work << 16);
-	work = ((right >> 4) ^ leftt) & 0x0f0f0f0fL;
-	leftt ^= work;
-	right ^= (work << 4);
-	*block++ = right;
-	*block = leftt;
 	return;
 	}
+#undef F
+#undef ROR
 
 #ifdef D2_DES
 
@@ -71,6 +71,98 @@ msdes_des(PyObject *self, PyObject *args)
     return retval;
 }
 
+// KeySchedule {{{
+typedef struct {
+    PyObject_HEAD
+    des_key_schedule encrypt, decrypt;
+} KeySchedule;
+
+static PyObject *
+KeySchedule_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    unsigned char *key = NULL;
+    Py_ssize_t len = 0;
+    KeySchedule *self = NULL;
+
+    if (!PyArg_ParseTuple(args, "y#", &key, &len)) {
+        return NULL;
+    }
+
+    if (len != 8) {
+        PyErr_SetString(MsDesError, "Key length incorrect");
+        return NULL;
+    }
+
+    self = (KeySchedule *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    deskey_r(key, EN0, self->encrypt);
+    deskey_r(key, DE1, self->decrypt);
+    return (PyObject *)self;
+}
+
+static PyObject *
+KeySchedule_process(const uint32_t *schedule, PyObject *args)
+{
+    Py_buffer inbuf;
+    PyObject *retval = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*", &inbuf)) {
+        return NULL;
+    }
+
+    if ((inbuf.len == 0) || ((inbuf.len % 8) != 0)) {
+        PyErr_SetString(MsDesError,
+            "Input length not a multiple of the block size");
+        goto end;
+    }
+
+    retval = PyBytes_FromStringAndSize(NULL, inbuf.len);
+    if (retval == NULL) {
+        goto end;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    des_ecb(schedule, inbuf.buf, (unsigned char *)PyBytes_AS_STRING(retval), inbuf.len / 8);
+    Py_END_ALLOW_THREADS;
+
+end:
+    PyBuffer_Release(&inbuf);
+    return retval;
+}
+
+static PyObject *
+KeySchedule_encrypt(KeySchedule *self, PyObject *args)
+{
+    return KeySchedule_process(self->encrypt, args);
+}
+
+static PyObject *
+KeySchedule_decrypt(KeySchedule *self, PyObject *args)
+{
+    return KeySchedule_process(self->decrypt, args);
+}
+
+static PyMethodDef KeySchedule_methods[] = {
+    { "encrypt", (PyCFunction)KeySchedule_encrypt, METH_VARARGS,
+      "encrypt(data) -> Encrypt data, whose length must be a multiple of 8. Does not hold the GIL while encrypting." },
+    { "decrypt", (PyCFunction)KeySchedule_decrypt, METH_VARARGS,
+      "decrypt(data) -> Decrypt data, whose length must be a multiple of 8. Does not hold the GIL while decrypting." },
+    { NULL, NULL }
+};
+
+static PyTypeObject KeyScheduleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "msdes.KeySchedule",
+    .tp_basicsize = sizeof(KeySchedule),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "KeySchedule(key) -> DES key schedule for the 8 byte key. Unlike deskey()/des() it has no global state, so separate objects can be used from multiple threads at once.",
+    .tp_methods = KeySchedule_methods,
+    .tp_new = KeySchedule_new,
+};
+// }}}
+
 static PyMethodDef msdes_methods[] = {
     { "deskey", &msdes_deskey, METH_VARARGS, "Provide a new key for DES en/decryption." },
     { "des", &msdes_des, METH_VARARGS, "Perform DES en/decryption." },
@@ -84,6 +176,12 @@ exec_module(PyObject *m) {
     PyModule_AddObject(m, "MsDesError", MsDesError);
     PyModule_AddObject(m, "EN0", PyLong_FromLong(EN0));
     PyModule_AddObject(m, "DE1", PyLong_FromLong(DE1));
+    if (PyType_Ready(&KeyScheduleType) < 0) return -1;
+    Py_INCREF(&KeyScheduleType);
+    if (PyModule_AddObject(m, "KeySchedule", (PyObject *)&KeyScheduleType) != 0) {
+        Py_DECREF(&KeyScheduleType);
+        return -1;
+    }
 
 	return 0;
 }
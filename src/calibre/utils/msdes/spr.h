@@ -23,7 +23,7 @@
 
 #pragma once
 
-static unsigned long SP1[64] = {
+static const uint32_t SP1[64] = {
 0x02080800L, 0x00080000L, 0x02000002L, 0x02080802L,
 0x02000000L, 0x00080802L, 0x00080002L, 0x02000002L,
 0x00080802L, 0x02080800L, 0x02080000L, 0x00000802L,
@@ -41,7 +41,7 @@ static unsigned long SP1[64] = {
 0x00080000L, 0x02000000L, 0x02000802L, 0x02080800L,
 0x00000002L, 0x02080002L, 0x00000800L, 0x00080802L
 };
-static unsigned long SP2[64] = {
+static const uint32_t SP2[64] = {
 0x40108010L, 0x00000000L, 0x00108000L, 0x40100000L,
 0x40000010L, 0x00008010L, 0x40008000L, 0x00108000L,
 0x00008000L, 0x40100010L, 0x00000010L, 0x40008000L,
@@ -59,7 +59,7 @@ static unsigned long SP2[64] = {
 0x40100010L, 0x00100000L, 0x00008010L, 0x40008000L,
 0x40008010L, 0x00000010L, 0x40100000L, 0x00108000L
 };
-static unsigned long SP3[64] = {
+static const uint32_t SP3[64] = {
 0x04000001L, 0x04040100L, 0x00000100L, 0x04000101L,
 0x00040001L, 0x04000000L, 0x04000101L, 0x00040100L,
 0x04000100L, 0x00040000L, 0x04040000L, 0x00000001L,
@@ -77,7 +77,7 @@ static unsigned long SP3[64] = {
 0x04000100L, 0x00000000L, 0x04040001L, 0x00000101L,
 0x04000001L, 0x00040101L, 0x00000100L, 0x04040000L
 };
-static unsigned long SP4[64] = {
+static const uint32_t SP4[64] = {
 0x00401008L, 0x10001000L, 0x00000008L, 0x10401008L,
 0x00000000L, 0x10400000L, 0x10001008L, 0x00400008L,
 0x10401000L, 0x10000008L, 0x10000000L, 0x00001008L,
@@ -95,7 +95,7 @@ static unsigned long SP4[64] = {
 0x00400008L, 0x00401000L, 0x10400000L, 0x10001008L,
 0x00001008L, 0x10000000L, 0x10000008L, 0x10401000L
 };
-static unsigned long SP5[64] = {
+static const uint32_t SP5[64] = {
 0x08000000L, 0x00010000L, 0x00000400L, 0x08010420L,
 0x08010020L, 0x08000400L, 0x00010420L, 0x08010000L,
 0x00010000L, 0x00000020L, 0x08000020L, 0x00010400L,
@@ -113,7 +113,7 @@ static unsigned long SP5[64] = {
 0x00010400L, 0x08010020L, 0x08000400L, 0x00000420L,
 0x00000020L, 0x00010420L, 0x08010000L, 0x08000020L
 };
-static unsigned long SP6[64] = {
+static const uint32_t SP6[64] = {
 0x80000040L, 0x00200040L, 0x00000000L, 0x80202000L,
 0x00200040L, 0x00002000L, 0x80002040L, 0x00200000L,
 0x00002040L, 0x80202040L, 0x00202000L, 0x80000000L,
@@ -131,7 +131,7 @@ static unsigned long SP6[64] = {
 0x00002000L, 0x80000040L, 0x80002040L, 0x80202000L,
 0x80200000L, 0x00002040L, 0x00000040L, 0x80200040L,
 };
-static unsigned long SP7[64] = {
+static const uint32_t SP7[64] = {
 0x00004000L, 0x00000200L, 0x01000200L, 0x01000004L,
 0x01004204L, 0x00004004L, 0x00004200L, 0x00000000L,
 0x01000000L, 0x01000204L, 0x00000204L, 0x01004000L,
@@ -149,7 +149,7 @@ static unsigned long SP7[64] = {
 0x01004200L, 0x00000004L, 0x00004004L, 0x01004204L,
 0x01000004L, 0x01004200L, 0x01004000L, 0x00004004L,
 };
-static unsigned long SP8[64] = {
+static const uint32_t SP8[64] = {
 0x20800080L, 0x20820000L, 0x00020080L, 0x00000000L,
 0x20020000L, 0x00800080L, 0x20800000L, 0x20820080L,
 0x00000080L, 0x20000000L, 0x00820000L, 0x00020080L,
@@ -2,6 +2,7 @@
 # License: GPLv3 Copyright: 2009, Kovid Goyal <kovid at kovidgoyal.net>
 
 
+import mmap
 import os
 import shutil
 import sys
@@ -17,6 +18,24 @@ def get_podofo():
     return podofo
 
 
+def map_file(path):
+    # mmap refuses to map empty files, for which an empty bytes object is
+    # returned instead so that podofo reports them as invalid PDFs
+    with open(path, 'rb') as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            return b''
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+
+def load_pdf_doc(path):
+    # The file is memory mapped rather than read, PDFDoc.load() does not copy
+    # its buffer. The map is closed when the returned document is freed.
+    podofo = get_podofo()
+    p = podofo.PDFDoc()
+    p.load(map_file(path))
+    return p
+
+
 def prep(val):
     if not val:
         return ''
@@ -104,31 +123,29 @@ def set_metadata_(tdir, title, authors, bkp, tags, xmp_packet):
 
 
 def get_xmp_metadata(path):
-    podofo = get_podofo()
-    p = podofo.PDFDoc()
-    with open(path, 'rb') as f:
-        raw = f.read()
-    p.load(raw)
+    p = load_pdf_doc(path)
     return p.get_xmp_metadata()
 
 
+def read_pdf_metadata(path):
+    podofo = get_podofo()
+    raw = map_file(path)
+    try:
+        return podofo.read_pdf_metadata(raw)
+    finally:
+        if isinstance(raw, mmap.mmap):
+            raw.close()
+
+
 def get_outline(path=None):
     if path is None:
         path = sys.argv[-1]
-    podofo = get_podofo()
-    p = podofo.PDFDoc()
-    with open(path, 'rb') as f:
-        raw = f.read()
-    p.load(raw)
+    p = load_pdf_doc(path)
     return p.get_outline()['children']
 
 
 def get_image_count(path):
-    podofo = get_podofo()
-    p = podofo.PDFDoc()
-    with open(path, 'rb') as f:
-        raw = f.read()
-    p.load(raw)
+    p = load_pdf_doc(path)
     return p.image_count()
 
 
@@ -183,6 +200,55 @@ def test_add_image_page(image='/t/t.jpg', dest='/t/t.pdf', **kw):
     p.save(dest)
 
 
+def test_downsample_images(src, dest, max_dpi=150, jpeg_quality=85):
+    podofo = get_podofo()
+    p = podofo.PDFDoc()
+    p.open(src)
+    num, saved = p.downsample_images(max_dpi, jpeg_quality)
+    print(f'Downsampled {num} images saving {saved} bytes')
+    p.save(dest)
+
+
+# A 32x32 CMYK JPEG with an Adobe marker, zlib compressed
+CMYK_JPEG = (
+    b'eNr7f+P/OwY+x5T8pFSGFAYQ+H+bwZmBg42NnY2Vg52dnZOTg4tHhJeHm5tHUkiYX0RWSl5OVkpGRkFFT11BSUdZRkbDXFPHwNDE'
+    b'xERe3dLWwshGz9jE6P8BBhEOBgUGBRZnQQZfQYZIQQZvQYb/RxjkGRgYWRnBgAEKGJmYWVjZ2Dk4ubiBCrYKMDAxMjMzsTCzsrKw'
+    b'AGVrgfIMLIKsQoqGjmzCgYnsSoUiRo0TF3IoO208KBp08YOKcVJREyeXmLiEpJSqmrqGppaJqZm5haWVs4urm7uHp1dwSGhYeERk'
+    b'VHJKalp6RmZWcUlpWXlFZVVzS2tbe0dn16TJU6ZOmz5j5qxFi5csXbZ8xcpVmzZv2bpt+46duw4dPnL02PETJ09dunzl6rXrN27e'
+    b'evjo8ZOnz56/ePnq46fPX75++/7j56//txj4WJwZfBkiGbwZGOwZPu6V/5F97D/Dxv8MN9dL/2eYkP47ej/v/Mdz/jPMu/e48t5e'
+    b'Zvd/UvZgWQdU2Tt/n1d94ZX/kfHv+H+GtL3M/xznv837Y1bfV/yvuvj73NcXTOofLv4t/3fWF/6fbPVbd3+4+c/y/M+35++Vr+//'
+    b'Uv9wvQNY3756NDsPothpj8/OfQfwye75z4DupMd/gZ69ADZ5MbJcNSuRXvmBaSaR3mwg35t78Fj6+T8Duq3/bwIAU2GKeg=='
+)
+
+
+def generate_pdf_with_image(width=400, height=400, display_size=72, jpeg=b'', colorspace='DeviceRGB'):
+    import zlib
+    if jpeg:
+        image, image_filter = jpeg, 'DCTDecode'
+    else:
+        pixels = bytes((x * 255 // width) for y in range(height) for x in range(width) for c in range(3))
+        image, image_filter = zlib.compress(pixels), 'FlateDecode'
+    content = b'q %d 0 0 %d 0 0 cm /Im1 Do Q' % (display_size, display_size)
+    objects = [
+        b'<</Type/Catalog/Pages 2 0 R>>',
+        b'<</Type/Pages/Count 1/Kids[3 0 R]>>',
+        b'<</Type/Page/Parent 2 0 R/MediaBox[0 0 300 400]/Contents 4 0 R/Resources<</XObject<</Im1 5 0 R>>>>>>',
+        b'<</Length %d>>\nstream\n%s\nendstream' % (len(content), content),
+        b'<</Type/XObject/Subtype/Image/Width %d/Height %d/ColorSpace/%s/BitsPerComponent 8/Filter/%s/Length %d>>\nstream\n%s\nendstream' % (
+            width, height, colorspace.encode(), image_filter.encode(), len(image), image),
+    ]
+    out = [b'%PDF-1.4\n']
+    offsets = []
+    for i, obj in enumerate(objects):
+        offsets.append(sum(map(len, out)))
+        out.append(b'%d 0 obj\n%s\nendobj\n' % (i + 1, obj))
+    xref_offset = sum(map(len, out))
+    out.append(b'xref\n0 %d\n0000000000 65535 f \n' % (len(objects) + 1))
+    out.extend(b'%010d 00000 n \n' % o for o in offsets)
+    out.append(b'trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n' % (len(objects) + 1, xref_offset))
+    return b''.join(out)
+
+
 def test_list_fonts(src):
     podofo = get_podofo()
     p = podofo.PDFDoc()
@@ -211,6 +277,97 @@ def test_roundtrip(src, dest):
     p.save(dest)
 
 
+def generate_pdf_with_links(num_pages=500, links_per_page=50, uri_links=False):
+    objects = [b'<</Type/Catalog/Pages 2 0 R>>', None]
+    kids = []
+    for p in range(num_pages):
+        page_num = len(objects) + 1
+        kids.append(page_num)
+        annots = tuple(range(page_num + 2, page_num + 2 + links_per_page))
+        objects.append(b'<</Type/Page/Parent 2 0 R/MediaBox[0 0 300 400]/Contents %d 0 R/Annots[%s]>>' % (
+            page_num + 1, b' '.join(b'%d 0 R' % x for x in annots)))
+        content = b'BT /F1 12 Tf 10 10 Td (Page %d) Tj ET' % p
+        objects.append(b'<</Length %d>>\nstream\n%s\nendstream' % (len(content), content))
+        for i in range(links_per_page):
+            if uri_links:
+                target = b'/A<</Type/Action/S/URI/URI(https://calibre-pdf-anchor.a#a%d)>>' % ((p + i) % num_pages)
+            else:
+                target = b'/Dest[%d 0 R/XYZ 0 400 0]' % (3 + ((p + i) % num_pages) * (links_per_page + 2))
+            objects.append(b'<</Type/Annot/Subtype/Link/Border[0 0 0]/Rect[10 %d 100 %d]%s>>' % (i * 5, i * 5 + 4, target))
+    objects[1] = b'<</Type/Pages/Count %d/Kids[%s]>>' % (num_pages, b' '.join(b'%d 0 R' % k for k in kids))
+    out = [b'%PDF-1.4\n']
+    offsets = []
+    for i, obj in enumerate(objects):
+        offsets.append(sum(map(len, out)))
+        out.append(b'%d 0 obj\n%s\nendobj\n' % (i + 1, obj))
+    xref_offset = sum(map(len, out))
+    out.append(b'xref\n0 %d\n0000000000 65535 f \n' % (len(objects) + 1))
+    out.extend(b'%010d 00000 n \n' % o for o in offsets)
+    out.append(b'trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n' % (len(objects) + 1, xref_offset))
+    return b''.join(out)
+
+
+def generate_pdf_with_inherited_resources(contents=(b'BT /F1 12 Tf 10 10 Td <0001> Tj ET',)):
+    # A page that gets its fonts from the Resources of the page tree node, one
+    # of which is used by the default page content and the other is not
+    def type0_font(name, descendant):
+        return b'<</Type/Font/Subtype/Type0/BaseFont/%s/Encoding/Identity-H/DescendantFonts[%d 0 R]>>' % (name, descendant)
+
+    def cid_font(name):
+        return b'<</Type/Font/Subtype/CIDFontType2/BaseFont/%s/CIDSystemInfo<</Registry(Adobe)/Ordering(Identity)/Supplement 0>>>>' % name
+    objects = [
+        b'<</Type/Catalog/Pages 2 0 R>>',
+        b'<</Type/Pages/Count 1/Kids[3 0 R]/MediaBox[0 0 300 400]/Resources<</Font<</F1 4 0 R/F2 6 0 R>>>>>>',
+        b'<</Type/Page/Parent 2 0 R/Contents[%s]>>' % b' '.join(b'%d 0 R' % (8 + i) for i in range(len(contents))),
+        type0_font(b'Used', 5), cid_font(b'Used'), type0_font(b'Unused', 7), cid_font(b'Unused'),
+    ]
+    objects.extend(b'<</Length %d>>\nstream\n%s\nendstream' % (len(content), content) for content in contents)
+    out = [b'%PDF-1.4\n']
+    offsets = []
+    for i, obj in enumerate(objects):
+        offsets.append(sum(map(len, out)))
+        out.append(b'%d 0 obj\n%s\nendobj\n' % (i + 1, obj))
+    xref_offset = sum(map(len, out))
+    out.append(b'xref\n0 %d\n0000000000 65535 f \n' % (len(objects) + 1))
+    out.extend(b'%010d 00000 n \n' % o for o in offsets)
+    out.append(b'trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n' % (len(objects) + 1, xref_offset))
+    return b''.join(out)
+
+
+def benchmark_object_streams(num_pages=500, links_per_page=50):
+    import time
+    podofo = get_podofo()
+    raw = generate_pdf_with_links(num_pages, links_per_page)
+    p = podofo.PDFDoc()
+    p.load(raw)
+    for object_streams in (False, True):
+        st = time.monotonic()
+        data = p.write(object_streams)
+        write_time = time.monotonic() - st
+        st = time.monotonic()
+        q = podofo.PDFDoc()
+        q.load(data)
+        q.page_count()
+        load_time = time.monotonic() - st
+        print(f'object_streams={object_streams}: size: {len(data)} bytes write: {write_time:.3f}s load: {load_time:.3f}s')
+
+
+def benchmark_resolve_links(num_pages=500, links_per_page=50):
+    import time
+    podofo = get_podofo()
+    raw = generate_pdf_with_links(num_pages, links_per_page, uri_links=True)
+    anchor_map = {f'https://calibre-pdf-anchor.a#a{i}': (i + 1, 0., 400., 0) for i in range(num_pages)}
+    for name in ('alter_links', 'resolve_links'):
+        p = podofo.PDFDoc()
+        p.load(raw)
+        st = time.monotonic()
+        if name == 'alter_links':
+            p.alter_links(anchor_map.get, False)
+        else:
+            p.resolve_links(anchor_map)
+        print(f'{name}: {time.monotonic() - st:.3f}s for {num_pages * links_per_page} links')
+
+
 def test_podofo():
     import tempfile
     from calibre.ebooks.metadata.book.base import Metadata
@@ -220,6 +377,9 @@ def test_podofo():
     # }}}
     mi = Metadata('title1', ['xmp_author'])
     podofo = get_podofo()
+    m = podofo.read_pdf_metadata(raw)
+    if m['page_count'] != 1 or m['info'].get('Title') != 'newt' or b'<x:xmpmeta' not in m['xmp_metadata']:
+        raise ValueError(f'Failed to read PDF metadata natively: {m}')
     p = podofo.PDFDoc()
     p.load(raw)
     p.title = 'info title'
@@ -227,6 +387,8 @@ def test_podofo():
     p.keywords = 'a, b'
     if p.version != '1.1':
         raise ValueError('Incorrect PDF version')
+    if 'Hello World' not in p.extract_text()[0]:
+        raise ValueError('Failed to extract text from PDF, got: {!r}'.format(p.extract_text()))
     xmp_packet = metadata_to_xmp_packet(mi)
     # print(p.get_xmp_metadata().decode())
     p.set_xmp_metadata(xmp_packet)
@@ -257,6 +419,111 @@ def test_podofo():
     a.append(b)
     if a.page_count() != 2 * b.page_count():
         raise ValueError('Appending failed')
+    if not a.compress_streams():
+        raise ValueError('Failed to compress the content streams')
+    before = a.write()
+    c = podofo.PDFDoc()
+    c.load(a.write(True))
+    if a.write() != before:
+        raise ValueError('Writing with object streams modified the document')
+    if 'Hello World' not in c.extract_text()[0]:
+        raise ValueError('Compressed content stream is corrupted')
+    if c.page_count() != a.page_count() or c.title != a.title:
+        raise ValueError('Writing with object streams failed')
+    d = podofo.PDFDoc()
+    d.load(raw)
+    data = d.write(True)
+    if b'Hello World' in data:
+        raise ValueError('Writing with object streams left an unfiltered stream uncompressed')
+    d = podofo.PDFDoc()
+    d.load(data)
+    if 'Hello World' not in d.extract_text()[0]:
+        raise ValueError('Stream compressed while writing with object streams is corrupted')
+    m = podofo.PDFDoc()
+    m.load(memoryview(bytearray(raw)))
+    if m.page_count() != 1 or 'Hello World' not in m.extract_text()[0]:
+        raise ValueError('Loading from a memoryview failed')
+    with tempfile.NamedTemporaryFile(suffix='.pdf', delete=False) as f:
+        pass
+    try:
+        try:
+            load_pdf_doc(f.name)
+        except podofo.Error:
+            pass
+        else:
+            raise ValueError('Loading an empty file did not fail')
+    finally:
+        os.remove(f.name)
+    # The second call is served from the cache of content stream font usage
+    if c.remove_unused_fonts() or c.remove_unused_fonts(1) or 'Hello World' not in c.extract_text()[0]:
+        raise ValueError('Removing unused fonts removed a font in use')
+    for contents, num_removed, msg in (
+        (None, 1, 'did not use resources inherited from the page tree'),
+        ((b'BT /F1', b'12 Tf 10 10 Td <0001> Tj ET'), 1, 'did not handle an operator split across content streams'),
+        ((b'q BI /W 1 /H 1 /CS /G /BPC 8 ID \x80EIQ BT /F1 12 Tf ET',), 1, 'did not handle an inline image followed by Q'),
+        ((b'q BI /W 1 /H 1 /CS /G /BPC 8 ID \x80 EI/F1 12 Tf',), 1, 'did not handle an inline image followed by a delimiter'),
+        ((b'q BI /W 1 /H 1 /CS /G /BPC 8 ID \x80\x80 /F1 12 Tf',), 0, 'removed fonts from content with an unterminated inline image'),
+    ):
+        p = podofo.PDFDoc()
+        p.load(generate_pdf_with_inherited_resources(*((contents,) if contents else ())))
+        remaining = ['Used'] if num_removed else ['Unused', 'Used']
+        if p.remove_unused_fonts() != num_removed or sorted(f['BaseFont'] for f in p.list_fonts() if f['Subtype'] == 'Type0') != remaining:
+            raise ValueError('Removing unused fonts ' + msg)
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_links(2, 1))
+    p.impose(1, 2, 1)
+    if b' Do\nQ\n' in p.write():
+        raise ValueError('Imposing pages stored an unfiltered content stream')
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_links(2, 1))
+    p.impose(1, 2, 1, False)
+    if b' Do\nQ\n' not in p.write() or not p.compress_streams() or b' Do\nQ\n' in p.write():
+        raise ValueError('Deferred compression of imposed pages failed')
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_links(4, 4, uri_links=True))
+    anchor_map = {f'https://calibre-pdf-anchor.a#a{i}': (i + 1, 0., 400., 0) for i in range(0, 4, 2)}
+    num_resolved, unresolved = p.resolve_links(anchor_map, False, ('https://calibre-pdf-anchor.',), True)
+    if num_resolved != 8 or sorted(unresolved) != ['https://calibre-pdf-anchor.a#a1', 'https://calibre-pdf-anchor.a#a3']:
+        raise ValueError(f'Resolving links failed: {num_resolved} {unresolved}')
+    q = podofo.PDFDoc()
+    q.load(p.write())
+    if q.resolve_links(anchor_map, False, ('https://calibre-pdf-anchor.',)) != (0, []):
+        raise ValueError('Resolving links did not remove unresolved links')
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_links(3, 1))
+    clamped, skipped = p.create_outline_tree((
+        (0, 'one', 1, 0, 0), (1, 'one.one', 2, 0, 0), (3, 'one.one.one', 9, 0, 0), (1, 'one.two', 0, 0, 0), (2, 'skipped', 1, 0, 0),
+        (0, 'two', 3, 0, 10, 0)))
+    if (clamped, skipped) != ([2], [3]):
+        raise ValueError(f'Incorrect clamped and skipped outline entries: {clamped} {skipped}')
+
+    def outline_titles(node):
+        return [(c['title'], outline_titles(c)) for c in node['children']]
+    titles = outline_titles(p.get_outline())
+    if titles != [('one', [('one.one', [('one.one.one', [])])]), ('two', [])]:
+        raise ValueError(f'Incorrect outline created: {titles}')
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_image())
+    if p.downsample_images(600)[0] != 0:
+        raise ValueError('Downsampled an image that is already at a low enough resolution')
+    num, saved = p.downsample_images(100)
+    if num != 1 or saved <= 0:
+        raise ValueError(f'Failed to downsample image: {num} {saved}')
+    q = podofo.PDFDoc()
+    q.load(p.write())
+    if q.downsample_images(100)[0] != 0:
+        raise ValueError('Downsampling did not change the image dimensions')
+    import base64
+    import zlib
+    cmyk = zlib.decompress(base64.standard_b64decode(CMYK_JPEG))
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_image(32, 32, 18, cmyk, 'DeviceCMYK'))
+    if p.downsample_images(48)[0] != 1:
+        raise ValueError('Failed to downsample CMYK JPEG')
+    p = podofo.PDFDoc()
+    p.load(generate_pdf_with_image(32, 32, 18, cmyk, 'DeviceRGB'))
+    if p.downsample_images(48)[0] != 0:
+        raise ValueError('Downsampled a JPEG that does not match its color space')
 
 
 def develop(path=sys.argv[-1]):
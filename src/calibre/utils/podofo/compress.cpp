@@ -0,0 +1,98 @@
+/*
+ * compress.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "global.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+using namespace pdf;
+
+struct PendingStream {
+    PdfObject *obj;
+    charbuff data;
+    std::string compressed;
+};
+
+static bool
+needs_compression(const PdfObject &obj) {
+    const PdfDictionary &d = obj.GetDictionary();
+    if (d.HasKey("Filter")) return false;
+    // XMP packets are meant to be readable by tools that do not understand PDF
+    if (dictionary_has_key_name(d, PdfName::KeyType, "Metadata")) return false;
+    return true;
+}
+
+void
+pdf::run_in_thread_pool(size_t count, unsigned int num_threads, const std::function<void(size_t)> &func) {
+    std::atomic<size_t> next(0);
+    std::exception_ptr err;
+    std::mutex err_lock;
+    auto worker = [&]() {
+        try {
+            for (size_t i = next++; i < count; i = next++) func(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(err_lock);
+            if (!err) err = std::current_exception();
+            next = count;
+        }
+    };
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = static_cast<unsigned int>(std::min<size_t>(num_threads, count));
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (unsigned int i = 1; i < num_threads; i++) threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads) t.join();
+    if (err) std::rethrow_exception(err);
+}
+
+static PyObject*
+compress_streams(PDFDoc *self, PyObject *args) {
+    int level = Z_DEFAULT_COMPRESSION;
+    unsigned int num_threads = 0;
+    if (!PyArg_ParseTuple(args, "|iI", &level, &num_threads)) return NULL;
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        PyErr_SetString(PyExc_ValueError, "level must be between -1 and 9"); return NULL;
+    }
+    unsigned long count = 0;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        // Reading and writing stream data goes through the PoDoFo object
+        // graph, which is not thread safe, so only the deflating happens
+        // concurrently.
+        std::vector<PendingStream> pending;
+        for (PdfObject *obj : self->doc->GetObjects()) {
+            const PdfObjectStream *stream = obj->GetStream();
+            if (stream == nullptr || !obj->IsDictionary() || !needs_compression(*obj)) continue;
+            charbuff data = stream->GetCopy(true);
+            if (data.empty()) continue;
+            pending.push_back(PendingStream{obj, std::move(data), std::string()});
+        }
+        run_in_thread_pool(pending.size(), num_threads, [&](size_t i) {
+            pending[i].compressed = deflate_data(pending[i].data, level);
+        });
+        for (auto &p : pending) {
+            if (p.compressed.size() >= p.data.size()) continue;
+            p.obj->GetStream()->SetData(bufferview(p.compressed.data(), p.compressed.size()), true);
+            p.obj->GetDictionary().AddKey("Filter", PdfName("FlateDecode"));
+            count++;
+        }
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
+    return PyLong_FromUnsignedLong(count);
+}
+
+PYWRAP(compress_streams)
@@ -0,0 +1,142 @@
+/*
+ * content.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "content.h"
+#include <stdexcept>
+#include <unordered_set>
+
+namespace pdf {
+
+static inline bool
+is_white(char ch) {
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t' || ch == '\f' || ch == 0;
+}
+
+static inline bool
+is_delimiter(char ch) {
+    switch (ch) {
+        case '(': case ')': case '<': case '>': case '[': case ']': case '{': case '}': case '/': case '%':
+            return true;
+    }
+    return false;
+}
+
+// Whether the EI ending at pos is followed by something that can come after
+// an operator: the end of the stream, whitespace, a delimiter or the Q
+// operator, which usually follows inline images
+static inline bool
+ends_inline_image(std::string_view content, size_t pos) {
+    if (pos >= content.size() || is_white(content[pos]) || is_delimiter(content[pos])) return true;
+    return content[pos] == 'Q' && (pos + 1 == content.size() || is_white(content[pos+1]) || is_delimiter(content[pos+1]));
+}
+
+static inline int
+hex_value(char ch) {
+    if ('0' <= ch && ch <= '9') return ch - '0';
+    if ('a' <= ch && ch <= 'f') return ch - 'a' + 10;
+    if ('A' <= ch && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static bool
+parse_number(std::string_view token, double &ans) {
+    // Not strtod() as that is locale dependent
+    size_t i = 0;
+    bool negative = false, has_digits = false;
+    if (i < token.size() && (token[i] == '+' || token[i] == '-')) negative = token[i++] == '-';
+    double val = 0;
+    for (; i < token.size() && '0' <= token[i] && token[i] <= '9'; i++) { val = val * 10 + (token[i] - '0'); has_digits = true; }
+    if (i < token.size() && token[i] == '.') {
+        double place = 0.1;
+        for (i++; i < token.size() && '0' <= token[i] && token[i] <= '9'; i++, place /= 10) { val += (token[i] - '0') * place; has_digits = true; }
+    }
+    if (i != token.size() || !has_digits) return false;
+    ans = negative ? -val : val;
+    return true;
+}
+
+void
+tokenize_content_stream(std::string_view content, const operator_callback &on_operator) {
+    const size_t n = content.size();
+    std::vector<ContentOperand> operands;
+    size_t i = 0;
+    while (i < n) {
+        const char ch = content[i];
+        if (is_white(ch)) { i++; continue; }
+        switch (ch) {
+            case '%':
+                while (i < n && content[i] != '\r' && content[i] != '\n') i++;
+                continue;
+            case '(': {
+                unsigned depth = 1;
+                for (i++; i < n && depth; i++) {
+                    if (content[i] == '\\') i++;
+                    else if (content[i] == '(') depth++;
+                    else if (content[i] == ')') depth--;
+                }
+                operands.push_back(ContentOperand{ContentOperand::Other, 0, ""});
+                continue;
+            }
+            case '<':
+                if (i + 1 < n && content[i + 1] == '<') i += 2;
+                else { while (i < n && content[i] != '>') i++; i++; }
+                operands.push_back(ContentOperand{ContentOperand::Other, 0, ""});
+                continue;
+            case '>': case '[': case ']': case '{': case '}': case ')':
+                i++;
+                operands.push_back(ContentOperand{ContentOperand::Other, 0, ""});
+                continue;
+            case '/': {
+                std::string name;
+                for (i++; i < n && !is_white(content[i]) && !is_delimiter(content[i]); i++) {
+                    int hi, lo;
+                    if (content[i] == '#' && i + 2 < n && (hi = hex_value(content[i+1])) > -1 && (lo = hex_value(content[i+2])) > -1) {
+                        name.push_back(static_cast<char>(hi * 16 + lo)); i += 2;
+                    } else name.push_back(content[i]);
+                }
+                operands.push_back(ContentOperand{ContentOperand::Name, 0, std::move(name)});
+                continue;
+            }
+        }
+        const size_t start = i;
+        while (i < n && !is_white(content[i]) && !is_delimiter(content[i])) i++;
+        const std::string_view token = content.substr(start, i - start);
+        double num;
+        if (parse_number(token, num)) { operands.push_back(ContentOperand{ContentOperand::Number, num, ""}); continue; }
+        on_operator(token, operands);
+        if (token == "ID") {
+            // Inline image data, skip to the EI operator. Writers are not
+            // consistent about what follows EI, so accept a delimiter or an
+            // operator directly after it, not just whitespace. Without an EI
+            // nothing after the image can be trusted, so fail.
+            size_t pos = i + 1;
+            while (true) {
+                if (pos + 1 >= n) throw std::runtime_error("Inline image without an EI operator");
+                if (content[pos] == 'E' && content[pos+1] == 'I' && is_white(content[pos-1]) && ends_inline_image(content, pos + 2)) break;
+                pos++;
+            }
+            i = pos + 2;
+        }
+        operands.clear();
+    }
+}
+
+std::vector<std::string>
+fonts_used_by_content_stream(std::string_view content) {
+    std::vector<std::string> ans;
+    std::unordered_set<std::string> seen;
+    tokenize_content_stream(content, [&](std::string_view op, const std::vector<ContentOperand> &operands) {
+        // Tf is valid outside BT/ET blocks as well, so it is not enough to look inside them
+        if (op == "Tf" && operands.size() >= 2) {
+            const ContentOperand &name = operands[operands.size() - 2];
+            if (name.type == ContentOperand::Name && seen.insert(name.name).second) ans.push_back(name.name);
+        }
+    });
+    return ans;
+}
+
+}
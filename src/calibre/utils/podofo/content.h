@@ -0,0 +1,36 @@
+/*
+ * content.h
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A minimal PDF content stream tokenizer. It does not touch PoDoFo or the
+// Python interpreter, so it is safe to use from worker threads without the GIL
+
+namespace pdf {
+
+struct ContentOperand {
+    enum Type { Number, Name, Other } type;
+    double number;
+    std::string name;
+};
+
+// Call on_operator for every operator in the content stream with the operands
+// preceding it. Operands other than numbers and names are only recorded as
+// placeholders and inline image data is skipped. Throws std::runtime_error if
+// the end of an inline image cannot be found.
+typedef std::function<void(std::string_view op, const std::vector<ContentOperand> &operands)> operator_callback;
+void tokenize_content_stream(std::string_view content, const operator_callback &on_operator);
+
+// The names of the font resources selected with the Tf operator
+std::vector<std::string> fonts_used_by_content_stream(std::string_view content);
+
+}
@@ -7,7 +7,13 @@
 
 #include "global.h"
 #include <algorithm>
+#include <deque>
+#include <exception>
 #include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 using namespace pdf;
 
@@ -16,7 +22,8 @@ static void
 PDFDoc_dealloc(PDFDoc* self)
 {
     if (self->doc != NULL) delete self->doc;
-    Py_CLEAR(self->load_buffer_ref);
+    free_content_usage_cache(self->content_usage_cache);
+    PyBuffer_Release(&self->load_buffer);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -38,19 +45,38 @@ PDFDoc_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 // Loading/Opening of PDF files {{{
 static PyObject *
 PDFDoc_load(PDFDoc *self, PyObject *args) {
-    char *buffer; Py_ssize_t size;
-
-    if (!PyArg_ParseTuple(args, "y#", &buffer, &size)) return NULL;
-
-	try {
-		self->doc->LoadFromBuffer(bufferview(buffer, size));
-        Py_CLEAR(self->load_buffer_ref);
-        self->load_buffer_ref = args;
-        Py_INCREF(args);
-	} catch(const PdfError & err) {
-		podofo_set_exception(err);
-		return NULL;
-	}
+    Py_buffer buf;
+
+    // Any object supporting the buffer protocol, such as bytes or mmap, is
+    // accepted. PoDoFo reads objects lazily from the buffer, so it is not
+    // copied; instead the buffer is held until the document is reloaded or
+    // freed.
+    if (!PyArg_ParseTuple(args, "y*", &buf)) return NULL;
+
+    std::exception_ptr err;
+    {
+        DocumentBusy busy(self);
+        Py_BEGIN_ALLOW_THREADS;
+        try {
+            self->doc->LoadFromBuffer(bufferview(static_cast<const char*>(buf.buf), buf.len));
+        } catch (...) { err = std::current_exception(); }
+        Py_END_ALLOW_THREADS;
+    }
+    if (err) {
+        PyBuffer_Release(&buf);
+        try {
+            std::rethrow_exception(err);
+        } catch(const PdfError & e) {
+            podofo_set_exception(e);
+        } catch(const std::exception & e) {
+            PyErr_Format(Error, "An error occurred while trying to load PDF: %s", e.what());
+        } catch (...) {
+            PyErr_SetString(Error, "An unknown error occurred while trying to load PDF");
+        }
+        return NULL;
+    }
+    PyBuffer_Release(&self->load_buffer);
+    self->load_buffer = buf;
 
     Py_RETURN_NONE;
 }
@@ -82,10 +108,14 @@ PDFDoc_open(PDFDoc *self, PyObject *args) {
 static PyObject *
 PDFDoc_save(PDFDoc *self, PyObject *args) {
     char *buffer;
+    int object_streams = 0;
 
-    if (PyArg_ParseTuple(args, "s", &buffer)) {
+    if (PyArg_ParseTuple(args, "s|p", &buffer, &object_streams)) {
         try {
-            self->doc->Save(buffer, save_options);
+            if (object_streams) {
+                FileStreamDevice device(buffer, FileMode::Create);
+                save_doc(self->doc, device, true);
+            } else self->doc->Save(buffer, save_options);
         } catch(const PdfError & err) {
             podofo_set_exception(err);
             return NULL;
@@ -139,9 +169,11 @@ static PyObject *
 PDFDoc_write(PDFDoc *self, PyObject *args) {
     PyObject *ans;
     BytesOutputDevice d;
+    int object_streams = 0;
+    if (!PyArg_ParseTuple(args, "|p", &object_streams)) return NULL;
 
     try {
-        self->doc->Save(d, save_options);
+        save_doc(self->doc, d, object_streams);
         return d.Release();
     } catch(const PdfError &err) {
         podofo_set_exception(err);
@@ -156,9 +188,10 @@ PDFDoc_write(PDFDoc *self, PyObject *args) {
 static PyObject *
 PDFDoc_save_to_fileobj(PDFDoc *self, PyObject *args) {
     PyObject *f;
+    int object_streams = 0;
 
-    if (!PyArg_ParseTuple(args, "O", &f)) return NULL;
-    return write_doc(self->doc, f);
+    if (!PyArg_ParseTuple(args, "O|p", &f, &object_streams)) return NULL;
+    return write_doc(self->doc, f, object_streams);
 }
 
 static PyObject *
@@ -379,10 +412,16 @@ PDFDoc_append(PDFDoc *self, PyObject *args) {
         int typ = PyObject_IsInstance(doc, (PyObject*)&PDFDocType);
         if (typ == -1) return NULL;
         if (typ == 0) { PyErr_SetString(PyExc_TypeError, "You must pass a PDFDoc instance to this method"); return NULL; }
+        if (document_is_busy((PDFDoc*)doc)) return NULL;
         docs[i] = ((PDFDoc*)doc)->doc;
     }
 
-    PyThreadState *_save; _save = PyEval_SaveThread();
+    std::exception_ptr err;
+    // The source documents are read with the GIL released, so they are marked busy as well
+    std::deque<DocumentBusy> busy;
+    busy.emplace_back(self);
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) busy.emplace_back((PDFDoc*)PyTuple_GET_ITEM(args, i));
+    Py_BEGIN_ALLOW_THREADS;
     try {
         unsigned total_pages_to_append = 0;
         for (auto src : docs)  total_pages_to_append += src->GetPages().GetCount();
@@ -444,16 +483,21 @@ PDFDoc_append(PDFDoc *self, PyObject *args) {
                 }
             }
         }
-    } catch (const PdfError & err) {
-        PyEval_RestoreThread(_save);
-        podofo_set_exception(err);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    busy.clear();
+    try {
+        if (err) std::rethrow_exception(err);
+    } catch (const PdfError & e) {
+        podofo_set_exception(e);
         return NULL;
-    } catch (std::exception & err) {
-        PyEval_RestoreThread(_save);
-        PyErr_Format(PyExc_ValueError, "An error occurred while trying to append pages: %s", err.what());
+    } catch (const std::exception & e) {
+        PyErr_Format(PyExc_ValueError, "An error occurred while trying to append pages: %s", e.what());
+        return NULL;
+    } catch (...) {
+        PyErr_SetString(PyExc_ValueError, "An unknown error occurred while trying to append pages");
         return NULL;
     }
-    PyEval_RestoreThread(_save);
     Py_RETURN_NONE;
 } // }}}
 
@@ -687,6 +731,132 @@ PDFDoc_alter_links(PDFDoc *self, PyObject *args) {
     return Py_BuildValue("i", count);
 } // }}}
 
+// resolve_links() {{{
+
+struct LinkDestination {
+    unsigned int pagenum;
+    double left, top, zoom;
+};
+typedef std::unordered_map<std::string, LinkDestination> link_destination_map;
+
+static bool
+is_internal_link(const std::string &uri, const std::vector<std::string> &prefixes) {
+    for (const auto &p : prefixes) {
+        if (uri.compare(0, p.size(), p) == 0) return true;
+    }
+    return false;
+}
+
+static unsigned long
+resolve_links_in_doc(PdfMemDocument *doc, const link_destination_map &destinations, const std::vector<std::string> &prefixes, bool mark_links, bool remove_unresolved, std::vector<std::string> &unresolved) {
+    PdfArray border, link_color;
+    border.Add(int64_t(16)); border.Add(int64_t(16)); border.Add(int64_t(1));
+    link_color.Add(1.); link_color.Add(0.); link_color.Add(0.);
+    PdfIndirectObjectList &objects = doc->GetObjects();
+    std::vector<PdfObject*> links;
+    for (PdfObject *obj : objects) {
+        PdfDictionary *link, *A; PdfObject *akey, *uo;
+        if (obj->TryGetDictionary(link) && dictionary_has_key_name(*link, PdfName::KeyType, "Annot") && dictionary_has_key_name(*link, PdfName::KeySubtype, "Link") &&
+                (akey = link->GetKey("A")) && akey->TryGetDictionary(A) &&
+                dictionary_has_key_name(*A, PdfName::KeyType, "Action") && dictionary_has_key_name(*A, "S", "URI") &&
+                (uo = A->GetKey("URI")) && uo->IsString()) links.push_back(obj);
+    }
+    const unsigned int num_pages = doc->GetPages().GetCount();
+    std::unordered_set<std::string> seen_unresolved;
+    unordered_reference_set to_remove;
+    unsigned long count = 0;
+    for (PdfObject *lo : links) {
+        PdfDictionary &link = lo->GetDictionary();
+        const std::string uri = link.GetKey("A")->GetDictionary().GetKey("URI")->GetString().GetString();
+        auto it = destinations.find(uri);
+        if (it == destinations.end()) {
+            if (is_internal_link(uri, prefixes)) {
+                if (seen_unresolved.insert(uri).second) unresolved.push_back(uri);
+                if (remove_unresolved) { to_remove.insert(lo->GetIndirectReference()); continue; }
+            }
+        } else {
+            const LinkDestination &d = it->second;
+            if (d.pagenum < 1 || d.pagenum > num_pages) throw std::out_of_range(
+                    "No page number " + std::to_string(d.pagenum) + " in the PDF file of " + std::to_string(num_pages) + " pages");
+            link.RemoveKey("A");
+            PdfDestination dest(doc->GetPages().GetPageAt(d.pagenum - 1), d.left, d.top, d.zoom);
+            dest.AddToDictionary(link);
+            count++;
+        }
+        if (mark_links) {
+            link.AddKey("Border", border);
+            link.AddKey("C", link_color);
+        }
+    }
+    if (to_remove.size()) {
+        PdfPageCollection &pages = doc->GetPages();
+        for (unsigned int i = 0; i < num_pages; i++) {
+            PdfObject *annots = pages.GetPageAt(i).GetObject().GetDictionary().FindKey("Annots");
+            PdfArray *arr;
+            if (!annots || !annots->TryGetArray(arr)) continue;
+            for (unsigned int j = arr->GetSize(); j-- > 0;) {
+                const PdfObject &item = (*arr)[j];
+                if (item.IsReference() && to_remove.find(item.GetReference()) != to_remove.end()) arr->RemoveAt(j);
+            }
+        }
+        for (const auto &ref : to_remove) objects.RemoveObject(ref).reset();
+    }
+    return count;
+}
+
+static PyObject *
+PDFDoc_resolve_links(PDFDoc *self, PyObject *args) {
+    PyObject *anchor_map, *py_prefixes = NULL;
+    int mark_links = 0, remove_unresolved = 0;
+    if (!PyArg_ParseTuple(args, "O!|pO!p", &PyDict_Type, &anchor_map, &mark_links, &PyTuple_Type, &py_prefixes, &remove_unresolved)) return NULL;
+    link_destination_map destinations;
+    destinations.reserve(PyDict_Size(anchor_map));
+    Py_ssize_t pos = 0, sz;
+    PyObject *key, *value;
+    while (PyDict_Next(anchor_map, &pos, &key, &value)) {
+        const char *uri = PyUnicode_AsUTF8AndSize(key, &sz);
+        if (!uri) return NULL;
+        LinkDestination d;
+        if (!PyArg_ParseTuple(value, "Iddd", &d.pagenum, &d.left, &d.top, &d.zoom)) return NULL;
+        destinations.emplace(std::string(uri, sz), d);
+    }
+    std::vector<std::string> prefixes;
+    for (Py_ssize_t i = 0; py_prefixes && i < PyTuple_GET_SIZE(py_prefixes); i++) {
+        const char *prefix = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(py_prefixes, i), &sz);
+        if (!prefix) return NULL;
+        prefixes.emplace_back(prefix, sz);
+    }
+    std::vector<std::string> unresolved;
+    unsigned long count = 0;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        count = resolve_links_in_doc(self->doc, destinations, prefixes, mark_links, remove_unresolved, unresolved);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    try {
+        if (err) std::rethrow_exception(err);
+    } catch(const PdfError & e) {
+        podofo_set_exception(e);
+        return NULL;
+    } catch(const std::exception & e) {
+        PyErr_Format(PyExc_ValueError, "An error occurred while trying to resolve links: %s", e.what());
+        return NULL;
+    } catch (...) {
+        PyErr_SetString(PyExc_ValueError, "An unknown error occurred while trying to resolve links");
+        return NULL;
+    }
+    pyunique_ptr ans(PyList_New(unresolved.size()));
+    if (!ans) return NULL;
+    for (size_t i = 0; i < unresolved.size(); i++) {
+        PyObject *t = PyUnicode_DecodeUTF8(unresolved[i].data(), unresolved[i].size(), "replace");
+        if (!t) return NULL;
+        PyList_SET_ITEM(ans.get(), i, t);
+    }
+    return Py_BuildValue("kO", count, ans.get());
+} // }}}
+
 // Properties {{{
 
 static PyObject *
@@ -893,19 +1063,23 @@ static PyGetSetDef PDFDoc_getsetters[] = {
 
 static PyMethodDef PDFDoc_methods[] = {
     {"load", (PyCFunction)PDFDoc_load, METH_VARARGS,
-     "Load a PDF document from a byte buffer (string)"
+     "load(buffer) -> Load a PDF document from any object supporting the buffer protocol, such as bytes or mmap."
+     " The buffer is not copied and is held by the document until it is reloaded or freed."
     },
     {"open", (PyCFunction)PDFDoc_open, METH_VARARGS,
      "Load a PDF document from a file path (string)"
     },
     {"save", (PyCFunction)PDFDoc_save, METH_VARARGS,
-     "Save the PDF document to a path on disk"
+     "save(path, object_streams=False) -> Save the PDF document to a path on disk"
     },
     {"write", (PyCFunction)PDFDoc_write, METH_VARARGS,
-     "Return the PDF document as a bytestring."
+     "write(object_streams=False) -> Return the PDF document as a bytestring. If object_streams is True, objects are packed into compressed object streams with a cross reference stream, producing a PDF 1.5 file. That mode does not modify the document, so unreferenced objects are kept, and streams without a filter are compressed as they are written."
     },
     {"save_to_fileobj", (PyCFunction)PDFDoc_save_to_fileobj, METH_VARARGS,
-     "Write the PDF document to the soecified file-like object."
+     "save_to_fileobj(f, object_streams=False) -> Write the PDF document to the specified file-like object."
+    },
+    {"compress_streams", (PyCFunction)py_compress_streams, METH_VARARGS,
+     "compress_streams(level=-1, num_threads=0) -> Flate compress all streams that have no filters, in parallel. Returns the number of streams compressed."
     },
     {"uncompress", (PyCFunction)PDFDoc_uncompress_pdf, METH_NOARGS,
      "Uncompress the PDF"
@@ -919,33 +1093,48 @@ static PyMethodDef PDFDoc_methods[] = {
     {"image_count", (PyCFunction)PDFDoc_image_count, METH_VARARGS,
      "image_count() -> Number of images in the PDF."
     },
+    {"extract_text", (PyCFunction)py_extract_text, METH_NOARGS,
+     "extract_text() -> Extract the plain text of every page in the PDF, as a list of strings, one per page."
+    },
     {"extract_anchors", (PyCFunction)PDFDoc_extract_anchors, METH_VARARGS,
      "extract_anchors() -> Extract information about links in the document."
     },
     {"alter_links", (PyCFunction)PDFDoc_alter_links, METH_VARARGS,
      "alter_links() -> Change links in the document."
     },
+    {"resolve_links", (PyCFunction)PDFDoc_resolve_links, METH_VARARGS,
+     "resolve_links(anchor_map, mark_links=False, internal_prefixes=(), remove_unresolved=False) -> Change all links whose URI is in anchor_map to point to the (pagenum, left, top, zoom) location it maps to."
+     " Links whose URI starts with one of internal_prefixes but is not in anchor_map are removed if remove_unresolved is True."
+     " Returns the number of links changed and the list of unresolved URIs."
+    },
     {"list_fonts", (PyCFunction)py_list_fonts, METH_VARARGS,
      "list_fonts() -> Get list of fonts in document"
     },
-    {"remove_unused_fonts", (PyCFunction)py_remove_unused_fonts, METH_NOARGS,
-     "remove_unused_fonts() -> Remove unused font objects."
+    {"remove_unused_fonts", (PyCFunction)py_remove_unused_fonts, METH_VARARGS,
+     "remove_unused_fonts(num_threads=0) -> Remove unused font objects. Returns the number of fonts removed."
+     " Content streams are scanned in parallel and the fonts they use are cached, so repeated calls only re-scan changed streams."
     },
     {"merge_fonts", (PyCFunction)py_merge_fonts, METH_VARARGS,
-     "merge_fonts() -> Merge the specified fonts."
+     "merge_fonts(data, references, compress=True) -> Merge the specified fonts. If compress is False the font data is stored without any filters, and PDFDoc.compress_streams() must be called before saving."
     },
     {"replace_font_data", (PyCFunction)py_replace_font_data, METH_VARARGS,
-     "replace_font_data() -> Replace the data stream for the specified font."
+     "replace_font_data(data, num, gen, compress=True) -> Replace the data stream for the specified font. If compress is False the data is stored without any filters, and PDFDoc.compress_streams() must be called before saving."
+    },
+    {"merge_truetype_fonts", (PyCFunction)py_merge_truetype_fonts, METH_VARARGS,
+     "merge_truetype_fonts(compress=True) -> Merge and subset the TrueType fonts with the same BaseFont in the document. Returns the lists (base_font, num_fonts, old_size, new_size, subsetted) and (base_font, error). If compress is False the merged font data is stored without any filters, and PDFDoc.compress_streams() must be called before saving."
     },
     {"dedup_type3_fonts", (PyCFunction)py_dedup_type3_fonts, METH_VARARGS,
      "dedup_type3_fonts() -> De-duplicate repeated glyphs in Type3 fonts"
     },
     {"impose", (PyCFunction)py_impose, METH_VARARGS,
-     "impose() -> impose pages onto each other"
+     "impose(dest_page_num, src_page_num, count, compress=True) -> impose pages onto each other. If compress is False the new content streams are stored without any filters, and PDFDoc.compress_streams() must be called before saving."
     },
     {"dedup_images", (PyCFunction)py_dedup_images, METH_VARARGS,
      "dedup_images() -> Remove duplicated images"
     },
+    {"downsample_images", (PyCFunction)py_downsample_images, METH_VARARGS,
+     "downsample_images(max_dpi, jpeg_quality=85, num_threads=0) -> Resample and recompress JPEG and Flate images that are drawn at a resolution higher than max_dpi. Returns the number of images changed and the number of bytes saved."
+    },
     {"delete_pages", (PyCFunction)PDFDoc_delete_pages, METH_VARARGS,
      "delete_page(page_num, count=1) -> Delete the specified pages from the pdf."
     },
@@ -970,6 +1159,10 @@ static PyMethodDef PDFDoc_methods[] = {
     {"create_outline", (PyCFunction)py_create_outline, METH_VARARGS,
      "create_outline(title, pagenum) -> Create an outline, return the first outline item."
     },
+    {"create_outline_tree", (PyCFunction)py_create_outline_tree, METH_VARARGS,
+     "create_outline_tree(entries) -> Create the complete outline from a flat, depth first list of (level, title, pagenum, left, top[, zoom]) entries where level is zero for top level entries."
+     " Entries pointing past the last page point to the last page instead and entries with a pagenum of zero are skipped, along with their children. Returns the lists of indices of such clamped and skipped entries."
+    },
     {"get_outline", (PyCFunction)py_get_outline, METH_NOARGS,
      "get_outline() -> Get the outline if any in the PDF file."
     },
@@ -987,6 +1180,27 @@ static PyMethodDef PDFDoc_methods[] = {
     {NULL}  /* Sentinel */
 };
 
+// Concurrent use {{{
+bool
+pdf::document_is_busy(PDFDoc *self) {
+    if (!self->busy) return false;
+    PyErr_SetString(Error, "This PDFDoc is in use by another thread, PDFDoc objects can only be used from one thread at a time");
+    return true;
+}
+
+static PyObject*
+PDFDoc_getattro(PDFDoc *self, PyObject *name) {
+    if (document_is_busy(self)) return NULL;
+    return PyObject_GenericGetAttr((PyObject*)self, name);
+}
+
+static int
+PDFDoc_setattro(PDFDoc *self, PyObject *name, PyObject *value) {
+    if (document_is_busy(self)) return -1;
+    return PyObject_GenericSetAttr((PyObject*)self, name, value);
+}
+// }}}
+
 // Type definition {{{
 PyTypeObject pdf::PDFDocType = {
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -1005,11 +1219,11 @@ PyTypeObject pdf::PDFDocType = {
     /* tp_hash           */ 0,
     /* tp_call           */ 0,
     /* tp_str            */ 0,
-    /* tp_getattro       */ 0,
-    /* tp_setattro       */ 0,
+    /* tp_getattro       */ (getattrofunc)PDFDoc_getattro,
+    /* tp_setattro       */ (setattrofunc)PDFDoc_setattro,
     /* tp_as_buffer      */ 0,
     /* tp_flags          */ Py_TPFLAGS_DEFAULT,
-    /* tp_doc            */ "PDF Documents",
+    /* tp_doc            */ "PDF Documents. A document can only be used from one thread at a time, accessing it while another thread is running one of its methods raises an error.",
     /* tp_traverse       */ 0,
     /* tp_clear          */ 0,
     /* tp_richcompare    */ 0,
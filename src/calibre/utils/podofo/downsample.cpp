@@ -0,0 +1,224 @@
+/*
+ * downsample.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "downsample.h"
+#include "content.h"
+#include <algorithm>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <jpeglib.h>
+
+namespace pdf {
+
+double Matrix::x_scale() const { return std::sqrt(a * a + b * b); }
+double Matrix::y_scale() const { return std::sqrt(c * c + d * d); }
+
+// Content stream scanning {{{
+void
+scan_content_stream(std::string_view content, const Matrix &initial_ctm, const xobject_callback &on_do) {
+    std::vector<Matrix> saved_states;
+    Matrix ctm = initial_ctm;
+    tokenize_content_stream(content, [&](std::string_view op, const std::vector<ContentOperand> &operands) {
+        if (op == "q") saved_states.push_back(ctm);
+        else if (op == "Q") {
+            if (saved_states.size()) { ctm = saved_states.back(); saved_states.pop_back(); }
+        } else if (op == "cm") {
+            const size_t sz = operands.size();
+            if (sz >= 6 && std::all_of(operands.end() - 6, operands.end(), [](const ContentOperand &o) { return o.type == ContentOperand::Number; })) {
+                const ContentOperand *o = operands.data() + sz - 6;
+                ctm = Matrix{o[0].number, o[1].number, o[2].number, o[3].number, o[4].number, o[5].number} * ctm;
+            }
+        } else if (op == "Do") {
+            if (operands.size() && operands.back().type == ContentOperand::Name) on_do(operands.back().name, ctm);
+        }
+    });
+}
+// }}}
+
+// JPEG {{{
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+    char msg[JMSG_LENGTH_MAX];
+};
+
+static void
+jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorManager *err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->msg);
+    longjmp(err->jmp, 1);
+}
+
+static void
+jpeg_ignore_message(j_common_ptr cinfo, int level) { (void)cinfo; (void)level; }
+
+// These functions must not create any objects with destructors as errors are
+// reported by libjpeg via longjmp
+
+static bool
+decode_jpeg_impl(const unsigned char *data, size_t sz, Pixels &ans, char *errmsg) {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.emit_message = jpeg_ignore_message;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        memcpy(errmsg, jerr.msg, JMSG_LENGTH_MAX);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(sz));
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.num_components == 1) cinfo.out_color_space = JCS_GRAYSCALE;
+    else if (cinfo.num_components == 3) cinfo.out_color_space = JCS_RGB;
+    else if (cinfo.num_components == 4) cinfo.out_color_space = JCS_CMYK;
+    else {
+        snprintf(jerr.msg, sizeof(jerr.msg), "Unsupported number of color components: %d", cinfo.num_components);
+        longjmp(jerr.jmp, 1);
+    }
+    jpeg_start_decompress(&cinfo);
+    ans.width = cinfo.output_width; ans.height = cinfo.output_height; ans.channels = cinfo.output_components;
+    // libjpeg returns the CMYK samples as stored, so keep track of whether they are inverted
+    ans.inverted_cmyk = ans.channels == 4 && cinfo.saw_Adobe_marker;
+    const size_t stride = static_cast<size_t>(ans.width) * ans.channels;
+    ans.data.resize(stride * ans.height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = reinterpret_cast<JSAMPROW>(&ans.data[cinfo.output_scanline * stride]);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+static bool
+encode_jpeg_impl(const Pixels &img, int quality, unsigned char **output, unsigned long *output_size, char *errmsg) {
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.emit_message = jpeg_ignore_message;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        memcpy(errmsg, jerr.msg, JMSG_LENGTH_MAX);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, output, output_size);
+    cinfo.image_width = img.width; cinfo.image_height = img.height;
+    cinfo.input_components = img.channels;
+    cinfo.in_color_space = img.channels == 1 ? JCS_GRAYSCALE : (img.channels == 4 ? JCS_CMYK : JCS_RGB);
+    jpeg_set_defaults(&cinfo);
+    // libjpeg writes an Adobe marker for CMYK, which readers take to mean the data is inverted
+    if (img.channels == 4) cinfo.write_Adobe_marker = img.inverted_cmyk ? TRUE : FALSE;
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    const size_t stride = static_cast<size_t>(img.width) * img.channels;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = reinterpret_cast<JSAMPROW>(const_cast<char*>(img.data.data() + cinfo.next_scanline * stride));
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return true;
+}
+
+Pixels
+decode_jpeg(std::string_view data) {
+    Pixels ans;
+    char errmsg[JMSG_LENGTH_MAX] = {0};
+    if (!decode_jpeg_impl(reinterpret_cast<const unsigned char*>(data.data()), data.size(), ans, errmsg)) {
+        throw ImageError(std::string("Failed to decode JPEG image: ") + errmsg);
+    }
+    return ans;
+}
+
+std::string
+encode_jpeg(const Pixels &img, int quality) {
+    if (img.channels != 1 && img.channels != 3 && img.channels != 4) throw ImageError("Can only encode grayscale, RGB and CMYK images as JPEG");
+    unsigned char *output = NULL;
+    unsigned long output_size = 0;
+    char errmsg[JMSG_LENGTH_MAX] = {0};
+    const bool ok = encode_jpeg_impl(img, quality, &output, &output_size, errmsg);
+    std::string ans;
+    if (ok) ans.assign(reinterpret_cast<char*>(output), output_size);
+    free(output);
+    if (!ok) throw ImageError(std::string("Failed to encode JPEG image: ") + errmsg);
+    return ans;
+}
+// }}}
+
+// Resampling {{{
+struct Contribution {
+    unsigned int first;
+    std::vector<float> weights;
+};
+
+static std::vector<Contribution>
+contributions(unsigned int src_size, unsigned int dest_size) {
+    // Every destination pixel is the average of the source pixels it covers,
+    // with partially covered pixels weighted by the fraction covered.
+    std::vector<Contribution> ans(dest_size);
+    const double scale = static_cast<double>(src_size) / dest_size;
+    for (unsigned int i = 0; i < dest_size; i++) {
+        const double start = i * scale, end = std::min(static_cast<double>(src_size), start + scale);
+        const unsigned int first = static_cast<unsigned int>(start);
+        const unsigned int last = std::max(first + 1, std::min(src_size, static_cast<unsigned int>(std::ceil(end))));
+        Contribution &c = ans[i];
+        c.first = first;
+        double total = 0;
+        for (unsigned int s = first; s < last; s++) {
+            const double w = std::min(end, s + 1.0) - std::max(start, static_cast<double>(s));
+            c.weights.push_back(static_cast<float>(w)); total += w;
+        }
+        for (auto &w : c.weights) w = static_cast<float>(w / total);
+    }
+    return ans;
+}
+
+Pixels
+downsample(const Pixels &img, unsigned int width, unsigned int height) {
+    if (!img.width || !img.height || !img.channels || img.data.size() != static_cast<size_t>(img.width) * img.height * img.channels) throw ImageError("Invalid image");
+    if (!width || !height || width > img.width || height > img.height) throw ImageError("Can only downsample images");
+    const unsigned int channels = img.channels;
+    const std::vector<Contribution> cols = contributions(img.width, width), rows = contributions(img.height, height);
+    const size_t src_stride = static_cast<size_t>(img.width) * channels, dest_stride = static_cast<size_t>(width) * channels;
+    const unsigned char *src = reinterpret_cast<const unsigned char*>(img.data.data());
+    Pixels ans;
+    ans.width = width; ans.height = height; ans.channels = channels; ans.inverted_cmyk = img.inverted_cmyk;
+    ans.data.resize(dest_stride * height);
+    std::vector<float> row_sum(dest_stride), scaled_row(dest_stride);
+    for (unsigned int y = 0; y < height; y++) {
+        const Contribution &rc = rows[y];
+        std::fill(row_sum.begin(), row_sum.end(), 0.f);
+        for (size_t r = 0; r < rc.weights.size(); r++) {
+            // Scale the source row horizontally then accumulate it vertically
+            const unsigned char *line = src + (rc.first + r) * src_stride;
+            for (unsigned int x = 0; x < width; x++) {
+                const Contribution &cc = cols[x];
+                for (unsigned int ch = 0; ch < channels; ch++) {
+                    float sum = 0;
+                    for (size_t k = 0; k < cc.weights.size(); k++) sum += cc.weights[k] * line[(cc.first + k) * channels + ch];
+                    scaled_row[x * channels + ch] = sum;
+                }
+            }
+            const float w = rc.weights[r];
+            for (size_t i = 0; i < dest_stride; i++) row_sum[i] += w * scaled_row[i];
+        }
+        unsigned char *out = reinterpret_cast<unsigned char*>(&ans.data[y * dest_stride]);
+        for (size_t i = 0; i < dest_stride; i++) out[i] = static_cast<unsigned char>(std::min(255.f, std::max(0.f, row_sum[i] + 0.5f)));
+    }
+    return ans;
+}
+// }}}
+
+}
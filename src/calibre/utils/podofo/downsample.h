@@ -0,0 +1,59 @@
+/*
+ * downsample.h
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Nothing in here touches PoDoFo or the Python interpreter, so it is all safe
+// to use from worker threads without the GIL
+
+namespace pdf {
+
+class ImageError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+};
+
+// A PDF transformation matrix [a b c d e f]
+struct Matrix {
+    double a = 1, b = 0, c = 0, d = 1, e = 0, f = 0;
+    // Returns this * other, i.e. this transformation followed by other
+    Matrix operator*(const Matrix &o) const {
+        return Matrix{a * o.a + b * o.c, a * o.b + b * o.d, c * o.a + d * o.c, c * o.b + d * o.d, e * o.a + f * o.c + o.e, e * o.b + f * o.d + o.f};
+    }
+    // The size in user space of the unit square an image is drawn into
+    double x_scale() const;
+    double y_scale() const;
+};
+
+// Call on_do for every XObject painted by the content stream with the name of
+// the XObject and the current transformation matrix at the time it is painted.
+// Only the graphics state operators that affect the CTM are interpreted.
+typedef std::function<void(const std::string &name, const Matrix &ctm)> xobject_callback;
+void scan_content_stream(std::string_view content, const Matrix &initial_ctm, const xobject_callback &on_do);
+
+struct Pixels {
+    unsigned int width = 0, height = 0, channels = 0;
+    // CMYK JPEGs written by Adobe software store the components inverted,
+    // which is signalled by an Adobe marker
+    bool inverted_cmyk = false;
+    std::string data;
+};
+
+// Raise ImageError if the JPEG cannot be decoded or is not grayscale, RGB or CMYK
+Pixels decode_jpeg(std::string_view data);
+std::string encode_jpeg(const Pixels &img, int quality);
+
+// Area averaging resample, suitable only for downsampling
+Pixels downsample(const Pixels &img, unsigned int width, unsigned int height);
+
+}
@@ -6,9 +6,14 @@
  */
 
 #include "global.h"
+#include "sfnt.h"
+#include "content.h"
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <stack>
+#include <unordered_map>
 
 using namespace pdf;
 
@@ -57,42 +62,145 @@ remove_font(PdfIndirectObjectList &objects, PdfObject *font) {
     objects.RemoveObject(object_as_reference(font)).reset();
 }
 
+// Font usage analysis {{{
+// The fonts selected by the content of each page and form XObject, cached by
+// the page or form object and a hash of its content so that unchanged
+// content is not re-scanned
+struct pdf::ContentUsageCache {
+    struct Entry {
+        size_t size, hash;
+        std::vector<std::string> fonts;
+    };
+    std::unordered_map<PdfReference, Entry, PdfReferenceHasher> entries;
+};
+
+void
+pdf::free_content_usage_cache(ContentUsageCache *cache) { delete cache; }
+
+struct ContentStreamData {
+    charbuff data;
+    bool needs_inflate;
+};
+
+// The content of a page or form XObject. A page can have an array of content
+// streams, which must be treated as a single stream since tokens and
+// operators can be split across them.
+struct ContentJob {
+    PdfReference ref;
+    const PdfDictionary *fonts;
+    std::vector<ContentStreamData> streams;
+    bool failed = false;
+    size_t size = 0, hash = 0;
+    std::vector<std::string> used;
+};
+
 static void
-used_fonts_in_canvas(const PdfCanvas &canvas, unordered_reference_set &ans) {
-    PdfPostScriptTokenizer tokenizer;
-    PdfCanvasInputDevice input(canvas);
-    bool in_text_block = false;
-    PdfPostScriptTokenType contents_type;
-    PdfVariant var;
-    std::stack<PdfVariant> stack;
-    const PdfDictionary &resources = canvas.GetResources()->GetDictionary();
-    if (!resources.HasKey("Font")) return;
-    const PdfDictionary &fonts_dict = resources.GetKey("Font")->GetDictionary();
-    std::string_view keyword;
-
-    while (tokenizer.TryReadNext(input, contents_type, keyword, var)) {
-        if (contents_type == PdfPostScriptTokenType::Variant) stack.push(var);
-        if (contents_type != PdfPostScriptTokenType::Keyword) continue;
-        const char *token = keyword.data();
-        if (strcmp(token, "BT") == 0) {
-            in_text_block = true;
-            continue;
-        } else if (strcmp(token, "ET") == 0) {
-            in_text_block = false;
-            continue;
+add_content_stream(const PdfObject *obj, ContentJob &job) {
+    if (!obj || !obj->GetStream() || !obj->IsDictionary()) return;
+    const PdfDictionary &dict = obj->GetDictionary();
+    const PdfObject *filter = dict.FindKey("Filter");
+    const PdfArray *arr;
+    if (filter && filter->TryGetArray(arr)) filter = arr->GetSize() == 1 ? &(*arr)[0] : arr->GetSize() == 0 ? nullptr : filter;
+    try {
+        if (!filter) job.streams.push_back(ContentStreamData{obj->GetStream()->GetCopy(true), false});
+        else if (filter->IsName() && filter->GetName().GetString() == "FlateDecode" && !dict.HasKey("DecodeParms")) {
+            // Decompress in the worker threads, the common case
+            job.streams.push_back(ContentStreamData{obj->GetStream()->GetCopy(true), true});
+        } else job.streams.push_back(ContentStreamData{obj->GetStream()->GetCopy(), false});
+    } catch (const PdfError &) { job.failed = true; }
+}
+
+static const PdfDictionary*
+fonts_in_resources(const PdfDictionary *resources) {
+    const PdfDictionary *fd;
+    const PdfObject *fonts;
+    if (resources && (fonts = resources->FindKey("Font")) && fonts->TryGetDictionary(fd)) return fd;
+    return nullptr;
+}
+
+static const PdfDictionary*
+fonts_in_resources(const PdfObject *resources) {
+    const PdfDictionary *rd;
+    return resources && resources->TryGetDictionary(rd) ? fonts_in_resources(rd) : nullptr;
+}
+
+static unordered_reference_set
+used_fonts_in_doc(PDFDoc *self, unsigned int num_threads) {
+    PdfIndirectObjectList &objects = self->doc->GetObjects();
+    PdfPageCollection &pages = self->doc->GetPages();
+    std::vector<ContentJob> jobs;
+    // Reading stream data goes through PoDoFo which is not thread safe, so
+    // collect it all first
+    for (unsigned int i = 0; i < pages.GetCount(); i++) {
+        PdfPage &page = pages.GetPageAt(i);
+        // Pages can inherit their resources from the page tree, which
+        // GetResources() takes care of
+        const PdfResources *resources = page.GetResources();
+        ContentJob job;
+        job.fonts = fonts_in_resources(resources ? &resources->GetDictionary() : nullptr);
+        PdfContents *contents = page.GetContents();
+        if (!job.fonts || !contents) continue;
+        job.ref = page.GetObject().GetIndirectReference();
+        const PdfObject &cobj = contents->GetObject();
+        const PdfArray *arr;
+        if (cobj.TryGetArray(arr)) {
+            for (const auto &x : *arr) {
+                if (x.IsReference()) add_content_stream(objects.GetObject(x.GetReference()), job);
+            }
+        } else add_content_stream(&cobj, job);
+        jobs.push_back(std::move(job));
+    }
+    for (PdfObject *k : objects) {
+        const PdfDictionary *dict;
+        if (k->TryGetDictionary(dict) && dictionary_has_key_name(*dict, PdfName::KeySubtype, "Form") && k->GetStream()) {
+            ContentJob job;
+            job.fonts = fonts_in_resources(dict->FindKey("Resources"));
+            if (!job.fonts) continue;
+            job.ref = k->GetIndirectReference();
+            add_content_stream(k, job);
+            jobs.push_back(std::move(job));
         }
-        if (!in_text_block) continue;
-        if (strcmp(token, "Tf") == 0) {
-            stack.pop();
-            if (stack.size() > 0 && stack.top().IsName()) {
-                const PdfName &reference_name = stack.top().GetName();
-                const PdfObject *f = fonts_dict.GetKey(reference_name);
-                if (f) ans.insert(object_as_reference(f));
+    }
+
+    if (!self->content_usage_cache) self->content_usage_cache = new ContentUsageCache();
+    const auto &cache = self->content_usage_cache->entries;
+    run_in_thread_pool(jobs.size(), num_threads, [&](size_t i) {
+        ContentJob &job = jobs[i];
+        if (job.failed) return;
+        try {
+            std::string content;
+            for (auto &s : job.streams) {
+                if (s.needs_inflate) content += inflate_data(s.data);
+                else content.append(s.data.data(), s.data.size());
+                content.push_back('\n');
+                s.data = charbuff();
             }
+            job.size = content.size();
+            job.hash = std::hash<std::string_view>()(content);
+            auto it = cache.find(job.ref);
+            if (it != cache.end() && it->second.size == job.size && it->second.hash == job.hash) job.used = it->second.fonts;
+            else job.used = fonts_used_by_content_stream(content);
+        } catch (const std::runtime_error &) { job.failed = true; }
+    });
+    std::unordered_map<PdfReference, ContentUsageCache::Entry, PdfReferenceHasher> entries;
+    for (auto &job : jobs) {
+        if (!job.failed) entries[job.ref] = ContentUsageCache::Entry{job.size, job.hash, job.used};
+    }
+    self->content_usage_cache->entries.swap(entries);
+
+    unordered_reference_set ans;
+    for (const auto &job : jobs) {
+        if (job.failed) {
+            // Cannot tell what broken content uses, so assume it uses everything
+            for (const auto &x : *job.fonts) ans.insert(object_as_reference(x.second));
+        } else for (const auto &name : job.used) {
+            const PdfObject *f = job.fonts->GetKey(name);
+            if (f) ans.insert(object_as_reference(f));
         }
     }
-    return;
+    return ans;
 }
+// }}}
 
 static PyObject*
 convert_w_array(const PdfArray &w) {
@@ -195,26 +303,11 @@ list_fonts(PDFDoc *self, PyObject *args) {
 
 typedef std::unordered_map<PdfReference, unsigned long, PdfReferenceHasher> charprocs_usage_map;
 
-static PyObject*
-remove_unused_fonts(PDFDoc *self, PyObject *args) {
+static unsigned long
+remove_unused_fonts_in_doc(PDFDoc *self, unsigned int num_threads) {
     unsigned long count = 0;
-    unordered_reference_set used_fonts;
-    // Look in Pages
-    PdfPageCollection *pages = &self->doc->GetPages();
-    for (unsigned i = 0; i < pages->GetCount(); i++) {
-        used_fonts_in_canvas(self->doc->GetPages().GetPageAt(i), used_fonts);
-    }
-    // Look in XObjects
+    const unordered_reference_set used_fonts = used_fonts_in_doc(self, num_threads);
     PdfIndirectObjectList &objects = self->doc->GetObjects();
-    for (PdfObject *k : objects) {
-        if (k->IsDictionary()) {
-            const PdfDictionary &dict = k->GetDictionary();
-            if (dictionary_has_key_name(dict, PdfName::KeyType, "XObject") && dictionary_has_key_name(dict, PdfName::KeySubtype, "Form")) {
-                std::unique_ptr<PdfXObjectForm> xo;
-                if (PdfXObject::TryCreateFromObject<PdfXObjectForm>(*k, xo)) used_fonts_in_canvas(*xo, used_fonts);
-            }
-        }
-    }
     unordered_reference_set all_fonts;
     unordered_reference_set type3_fonts;
     charprocs_usage_map charprocs_usage;
@@ -265,7 +358,22 @@ remove_unused_fonts(PDFDoc *self, PyObject *args) {
             objects.RemoveObject(x.first).reset();
         }
     }
+    return count;
+}
 
+static PyObject*
+remove_unused_fonts(PDFDoc *self, PyObject *args) {
+    unsigned int num_threads = 0;
+    if (!PyArg_ParseTuple(args, "|I", &num_threads)) return NULL;
+    unsigned long count = 0;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        count = remove_unused_fonts_in_doc(self, num_threads);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
     return Py_BuildValue("k", count);
 }
 
@@ -273,7 +381,8 @@ PyObject*
 replace_font_data(PDFDoc *self, PyObject *args) {
     const char *data; Py_ssize_t sz;
     unsigned long num, gen;
-    if (!PyArg_ParseTuple(args, "y#kk", &data, &sz, &num, &gen)) return NULL;
+    int compress = 1;
+    if (!PyArg_ParseTuple(args, "y#kk|p", &data, &sz, &num, &gen, &compress)) return NULL;
     const PdfIndirectObjectList &objects = self->doc->GetObjects();
     PdfObject *font = objects.GetObject(PdfReference(num, static_cast<uint16_t>(gen)));
     if (!font) { PyErr_SetString(PyExc_KeyError, "No font with the specified reference found"); return NULL; }
@@ -282,8 +391,7 @@ replace_font_data(PDFDoc *self, PyObject *args) {
     PdfObject *descriptor = dict->FindKey("FontDescriptor");
     if (!descriptor) { PyErr_SetString(PyExc_ValueError, "Font does not have a descriptor"); return NULL; }
     PdfObject *ff = get_font_file(descriptor);
-    PdfObjectStream *stream = ff->GetStream();
-    stream->SetData(bufferview(data, sz));
+    set_stream_data(*ff, std::string_view(data, sz), compress);
     Py_RETURN_NONE;
 }
 
@@ -291,7 +399,8 @@ PyObject*
 merge_fonts(PDFDoc *self, PyObject *args) {
     const char *data; Py_ssize_t sz;
 	PyObject *references;
-    if (!PyArg_ParseTuple(args, "y#O!", &data, &sz, &PyTuple_Type, &references)) return NULL;
+    int compress = 1;
+    if (!PyArg_ParseTuple(args, "y#O!|p", &data, &sz, &PyTuple_Type, &references, &compress)) return NULL;
     PdfIndirectObjectList &objects = self->doc->GetObjects();
 	PdfObject *font_file = NULL;
     PdfDictionary *dict;
@@ -314,8 +423,7 @@ merge_fonts(PDFDoc *self, PyObject *args) {
         else { PyErr_SetString(PyExc_ValueError, "Font descriptor does not have file data"); return NULL; }
 		if (i == 0) {
 			font_file = ff;
-			PdfObjectStream *stream = ff->GetStream();
-			stream->SetData(bufferview(data, sz));
+			set_stream_data(*ff, std::string_view(data, sz), compress);
 		} else {
 			objects.RemoveObject(object_as_reference(ff)).reset();
 			descriptor.AddKey(font_file_key, object_as_reference(font_file));
@@ -324,6 +432,169 @@ merge_fonts(PDFDoc *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
+static inline bool
+glyph_id_from_object(const PdfObject &o, int64_t &ans) {
+    if (o.IsNumber()) { ans = o.GetNumber(); return true; }
+    if (o.IsRealStrict()) { ans = static_cast<int64_t>(o.GetReal()); return true; }
+    return false;
+}
+
+static void
+glyph_ids_in_w_array(const PdfArray &w, std::vector<uint32_t> &ans, const size_t values_per_glyph) {
+    // W arrays are made up of: c [w1 w2 ...] and c_first c_last w entries.
+    // W2 arrays are the same except that there are three values per glyph
+    // instead of one. We assume an Identity CIDToGIDMap.
+    size_t i = 0;
+    while (i + 1 < w.size()) {
+        int64_t first, last;
+        if (!glyph_id_from_object(w[i], first)) break;
+        const PdfObject &next = w[i + 1];
+        if (next.IsArray()) {
+            last = first + static_cast<int64_t>(next.GetArray().size() / values_per_glyph) - 1;
+            i += 2;
+        } else {
+            if (!glyph_id_from_object(next, last)) break;
+            i += 2 + values_per_glyph;
+        }
+        first = std::max(first, (int64_t)0); last = std::min(last, (int64_t)0xffff);
+        for (int64_t x = first; x <= last; x++) ans.push_back(static_cast<uint32_t>(x));
+    }
+}
+
+struct DescendantFont {
+    PdfObject *font;
+    const char *font_file_key;
+    PdfReference font_file_ref;
+    charbuff data;
+};
+
+struct TrueTypeFontGroup {
+    std::string base_font;
+    bool mergeable, has_type0;
+    size_t num_fonts;
+    std::vector<DescendantFont> descendants;
+    std::vector<uint32_t> glyph_ids;
+    TrueTypeFontGroup(const std::string &name) : base_font(name), mergeable(true), has_type0(false), num_fonts(0), descendants(), glyph_ids() {}
+};
+
+struct TrueTypeMergeResult {
+    std::string base_font, error;
+    size_t num_fonts, old_size, new_size;
+    bool subsetted;
+};
+
+static void
+add_font_to_group(PdfObject *font, PdfDictionary &dict, TrueTypeFontGroup &group) {
+    group.num_fonts++;
+    if (!group.mergeable) return;
+    if (dictionary_has_key_name(dict, PdfName::KeySubtype, "Type0")) {
+        group.has_type0 = true;
+        const PdfObject *encoding = dict.FindKey("Encoding");
+        if (!encoding || !encoding->IsName() || encoding->GetName().GetString().rfind("Identity-", 0) != 0) group.mergeable = false;
+        return;
+    }
+    PdfObject *descriptor = dict.FindKey("FontDescriptor");
+    PdfDictionary *ddict;
+    if (!descriptor || !descriptor->TryGetDictionary(ddict)) { group.mergeable = false; return; }
+    DescendantFont df{font, NULL, PdfReference(), charbuff()};
+    PdfObject *ff = NULL;
+    if ((ff = ddict->FindKey("FontFile"))) { df.font_file_key = "FontFile"; }
+    else if ((ff = ddict->FindKey("FontFile2"))) { df.font_file_key = "FontFile2"; }
+    else if ((ff = ddict->FindKey("FontFile3"))) { df.font_file_key = "FontFile3"; }
+    if (!ff || !ff->HasStream()) { group.mergeable = false; return; }
+    df.font_file_ref = object_as_reference(ff);
+    try {
+        df.data = ff->GetStream()->GetCopySafe();
+    } catch (const PdfError &) { group.mergeable = false; return; }
+    if (!is_truetype_font(df.data)) { group.mergeable = false; return; }
+    const PdfObject *w = dict.FindKey("W");
+    if (w && w->IsArray()) glyph_ids_in_w_array(w->GetArray(), group.glyph_ids, 1);
+    w = dict.FindKey("W2");
+    if (w && w->IsArray()) glyph_ids_in_w_array(w->GetArray(), group.glyph_ids, 3);
+    group.descendants.push_back(std::move(df));
+}
+
+static void
+merge_truetype_font_group(PdfIndirectObjectList &objects, TrueTypeFontGroup &group, TrueTypeMergeResult &result, bool compress) {
+    // Use the largest font as the base font
+    std::stable_sort(group.descendants.begin(), group.descendants.end(), [](const DescendantFont &a, const DescendantFont &b) {
+        return a.data.size() > b.data.size();
+    });
+    std::vector<std::string_view> fonts;
+    for (const auto &df : group.descendants) { fonts.emplace_back(df.data); result.old_size += df.data.size(); }
+    const std::string data = merge_truetype_fonts_for_pdf(fonts, group.glyph_ids, result.subsetted);
+    result.new_size = data.size();
+
+    const PdfReference &base_ref = group.descendants[0].font_file_ref;
+    PdfObject *base = objects.GetObject(base_ref);
+    if (!base) throw std::runtime_error("Font file for " + group.base_font + " no longer exists");
+    set_stream_data(*base, data, compress);
+    if (base->GetDictionary().HasKey("Length1")) base->GetDictionary().AddKey("Length1", PdfObject(static_cast<int64_t>(data.size())));
+    for (size_t i = 1; i < group.descendants.size(); i++) {
+        const DescendantFont &df = group.descendants[i];
+        if (df.font_file_ref == base_ref) continue;
+        if (objects.GetObject(df.font_file_ref)) objects.RemoveObject(df.font_file_ref).reset();
+        df.font->GetDictionary().FindKey("FontDescriptor")->GetDictionary().AddKey(df.font_file_key, base_ref);
+    }
+}
+
+static void
+merge_truetype_fonts_in_doc(PdfMemDocument *doc, std::vector<TrueTypeMergeResult> &results, bool compress) {
+    std::vector<TrueTypeFontGroup> groups;
+    std::unordered_map<std::string, size_t> group_map;
+    PdfIndirectObjectList &objects = doc->GetObjects();
+    for (PdfObject *k : objects) {
+        PdfDictionary *dict;
+        if (!k->TryGetDictionary(dict) || !dictionary_has_key_name(*dict, PdfName::KeyType, "Font")) continue;
+        const PdfObject *base_font = dict->FindKey("BaseFont");
+        if (!base_font || !base_font->IsName()) continue;
+        const std::string &name = base_font->GetName().GetString();
+        auto it = group_map.find(name);
+        if (it == group_map.end()) {
+            it = group_map.emplace(name, groups.size()).first;
+            groups.emplace_back(name);
+        }
+        add_font_to_group(k, *dict, groups[it->second]);
+    }
+    for (auto &group : groups) {
+        if (!group.mergeable || !group.has_type0 || group.descendants.empty()) continue;
+        results.push_back(TrueTypeMergeResult{group.base_font, "", group.num_fonts, 0, 0, true});
+        try {
+            merge_truetype_font_group(objects, group, results.back(), compress);
+        } catch (const std::runtime_error &err) {
+            // Covers SfntError as well as fonts whose data has gone missing,
+            // neither of which should stop the remaining groups being merged
+            results.back().error = err.what();
+        }
+        group.descendants.clear();  // release the font data
+    }
+}
+
+static PyObject*
+merge_truetype_fonts(PDFDoc *self, PyObject *args) {
+    int compress = 1;
+    if (!PyArg_ParseTuple(args, "|p", &compress)) return NULL;
+    std::vector<TrueTypeMergeResult> results;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        merge_truetype_fonts_in_doc(self->doc, results, compress);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
+    pyunique_ptr merged(PyList_New(0)), failed(PyList_New(0));
+    if (!merged || !failed) return NULL;
+    for (const auto &r : results) {
+        pyunique_ptr item;
+        if (r.error.size()) item.reset(Py_BuildValue("ss", r.base_font.c_str(), r.error.c_str()));
+        else item.reset(Py_BuildValue("snnnO", r.base_font.c_str(), (Py_ssize_t)r.num_fonts, (Py_ssize_t)r.old_size, (Py_ssize_t)r.new_size, r.subsetted ? Py_True : Py_False));
+        if (!item) return NULL;
+        if (PyList_Append(r.error.size() ? failed.get() : merged.get(), item.get()) != 0) return NULL;
+    }
+    return Py_BuildValue("OO", merged.get(), failed.get());
+}
+
 class CharProc {
     charbuff buf;
     PdfReference ref;
@@ -424,3 +695,4 @@ PYWRAP(merge_fonts)
 PYWRAP(remove_unused_fonts)
 PYWRAP(dedup_type3_fonts)
 PYWRAP(replace_font_data)
+PYWRAP(merge_truetype_fonts)
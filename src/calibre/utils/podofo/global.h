@@ -12,6 +12,7 @@
 
 #define USING_SHARED_PODOFO
 #include <podofo.h>
+#include <functional>
 #include <unordered_set>
 using namespace PoDoFo;
 using namespace std::literals;
@@ -21,14 +22,35 @@ namespace pdf {
 // Module exception types
 extern PyObject *Error;
 
+struct ContentUsageCache;
+
 typedef struct {
     PyObject_HEAD
     /* Type-specific fields go here. */
     PdfMemDocument *doc;
-    PyObject *load_buffer_ref;
+    Py_buffer load_buffer;
+    ContentUsageCache *content_usage_cache;
+    // Number of running methods that have released the GIL, see DocumentBusy
+    unsigned int busy;
 
 } PDFDoc;
 
+// A PDFDoc can only be used from one thread at a time. Methods that release
+// the GIL hold one of these, constructed and destroyed with the GIL held, for
+// as long as they run. Attribute access on a busy document raises an error
+// instead of racing on doc and load_buffer.
+class DocumentBusy {
+    private:
+        PDFDoc *self;
+        DocumentBusy(const DocumentBusy&) = delete;
+        DocumentBusy& operator=(const DocumentBusy&) = delete;
+    public:
+        DocumentBusy(PDFDoc *self) : self(self) { self->busy++; }
+        ~DocumentBusy() { self->busy--; }
+};
+// Returns true and sets a Python exception if self is in use by another thread
+bool document_is_busy(PDFDoc *self);
+
 typedef struct {
     PyObject_HEAD
     PdfMemDocument *doc;
@@ -43,7 +65,15 @@ extern PyObject *Error;
 void podofo_set_exception(const PdfError &err);
 PyObject * podofo_convert_pdfstring(const PdfString &s);
 const PdfString podofo_convert_pystring(PyObject *py);
-PyObject* write_doc(PdfMemDocument *doc, PyObject *f);
+void free_content_usage_cache(ContentUsageCache *cache);
+PyObject* write_doc(PdfMemDocument *doc, PyObject *f, bool object_streams=false);
+void save_doc(PdfMemDocument *doc, OutputStreamDevice &device, bool object_streams);
+std::string deflate_data(std::string_view data, int level);
+std::string inflate_data(std::string_view data);
+PyObject* read_pdf_metadata(PyObject *self, PyObject *args);
+// Call func(i) for i in [0, count) on num_threads threads (zero means one per
+// core). The first exception raised by func is re-raised after all threads finish.
+void run_in_thread_pool(size_t count, unsigned int num_threads, const std::function<void(size_t)> &func);
 
 struct PyObjectDeleter {
     void operator()(PyObject *obj) {
@@ -129,6 +159,18 @@ object_as_reference(const PdfObject *o) {
     return o->IsReference() ? o->GetReference() : o->GetIndirectReference();
 }
 
+// Replace the data in a stream. When compress is false the data is stored
+// without any filters, leaving compression to PDFDoc.compress_streams(), which
+// does it for all such streams in parallel. Callers that do not run that pass
+// must compress.
+static inline void
+set_stream_data(PdfObject &obj, std::string_view data, bool compress) {
+    if (compress) { obj.GetOrCreateStream().SetData(data); return; }
+    obj.GetOrCreateStream().SetData(data, true);
+    PdfDictionary &d = obj.GetDictionary();
+    d.RemoveKey("Filter"); d.RemoveKey("DecodeParms");
+}
+
 // NoMetadataUpdate needed to avoid PoDoFo clobbering the /Info and XMP metadata with its own nonsense
 static const PdfSaveOptions save_options = PdfSaveOptions::NoMetadataUpdate;
 
@@ -146,11 +188,16 @@ PyObject* py_list_fonts(PDFDoc*, PyObject*);
 PyObject* py_remove_unused_fonts(PDFDoc *self, PyObject *args);
 PyObject* py_merge_fonts(PDFDoc *self, PyObject *args);
 PyObject* py_replace_font_data(PDFDoc *self, PyObject *args);
+PyObject* py_merge_truetype_fonts(PDFDoc *self, PyObject *args);
 PyObject* py_dedup_type3_fonts(PDFDoc *self, PyObject *args);
 PyObject* py_impose(PDFDoc *self, PyObject *args);
 PyObject* py_dedup_images(PDFDoc *self, PyObject *args);
+PyObject* py_downsample_images(PDFDoc *self, PyObject *args);
 PyObject* py_create_outline(PDFDoc *self, PyObject *args);
+PyObject* py_create_outline_tree(PDFDoc *self, PyObject *args);
 PyObject* py_get_outline(PDFDoc *self, PyObject *args);
+PyObject* py_extract_text(PDFDoc *self, PyObject *args);
+PyObject* py_compress_streams(PDFDoc *self, PyObject *args);
 }
 }
 
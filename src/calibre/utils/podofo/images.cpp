@@ -6,8 +6,13 @@
  */
 
 #include "global.h"
+#include "downsample.h"
+#include <algorithm>
+#include <cmath>
+#include <exception>
 #include <functional>
 #include <string>
+#include <zlib.h>
 
 using namespace pdf;
 
@@ -148,3 +153,202 @@ dedup_images(PDFDoc *self, PyObject *args) {
 }
 
 PYWRAP(dedup_images)
+
+// downsample_images() {{{
+struct ImagePlacement {
+    // The largest size, in user space units, the image is drawn at
+    double width = 0, height = 0;
+};
+typedef std::unordered_map<PdfReference, ImagePlacement, PdfReferenceHasher> image_placement_map;
+
+static void
+find_image_placements(const PdfIndirectObjectList &objects, std::string_view content, const PdfDictionary *resources, const Matrix &ctm, image_placement_map &placements, unsigned int depth) {
+    scan_content_stream(content, ctm, [&](const std::string &name, const Matrix &m) {
+        const PdfObject *xobjects; const PdfDictionary *xd, *dict;
+        if (!resources || !(xobjects = resources->FindKey("XObject")) || !xobjects->TryGetDictionary(xd)) return;
+        const PdfObject *entry = xd->GetKey(name);
+        if (!entry || !entry->IsReference()) return;
+        const PdfObject *xobj = objects.GetObject(entry->GetReference());
+        if (!xobj || !xobj->TryGetDictionary(dict)) return;
+        if (dictionary_has_key_name(*dict, PdfName::KeySubtype, "Image")) {
+            ImagePlacement &p = placements[entry->GetReference()];
+            p.width = std::max(p.width, m.x_scale()); p.height = std::max(p.height, m.y_scale());
+        } else if (dictionary_has_key_name(*dict, PdfName::KeySubtype, "Form") && depth < 16 && xobj->GetStream()) {
+            Matrix fm;
+            const PdfObject *mo = dict->FindKey("Matrix");
+            const PdfArray *arr;
+            if (mo && mo->TryGetArray(arr) && arr->GetSize() == 6 && std::all_of(arr->begin(), arr->end(), [](const PdfObject &x) { return x.IsNumberOrReal(); })) {
+                const PdfArray &a = *arr;
+                fm = Matrix{a[0].GetReal(), a[1].GetReal(), a[2].GetReal(), a[3].GetReal(), a[4].GetReal(), a[5].GetReal()};
+            }
+            const PdfObject *ro = dict->FindKey("Resources");
+            const PdfDictionary *form_resources;
+            if (!ro || !ro->TryGetDictionary(form_resources)) form_resources = resources;
+            charbuff data;
+            try { data = xobj->GetStream()->GetCopy(); } catch (const PdfError &) { return; }
+            find_image_placements(objects, data, form_resources, fm * m, placements, depth + 1);
+        }
+    });
+}
+
+static unsigned int
+color_components(const PdfIndirectObjectList &objects, const PdfObject *cs) {
+    if (!cs) return 0;
+    if (cs->IsName()) {
+        const std::string &name = cs->GetName().GetString();
+        if (name == "DeviceGray") return 1;
+        if (name == "DeviceRGB") return 3;
+        if (name == "DeviceCMYK") return 4;
+        return 0;
+    }
+    const PdfArray *arr; const PdfDictionary *d; const PdfObject *n;
+    // Indexed and the other special color spaces cannot be interpolated
+    if (cs->TryGetArray(arr) && arr->GetSize() == 2 && (*arr)[0].IsName() && (*arr)[0].GetName().GetString() == "ICCBased" &&
+            (*arr)[1].IsReference()) {
+        const PdfObject *icc = objects.GetObject((*arr)[1].GetReference());
+        if (icc && icc->TryGetDictionary(d) && (n = d->FindKey("N")) && n->IsNumber()) return static_cast<unsigned int>(n->GetNumber());
+    }
+    return 0;
+}
+
+struct DownsampleJob {
+    PdfObject *obj;
+    bool is_jpeg;
+    Pixels pixels;  // for JPEG images pixels.data is the JPEG data
+    unsigned int channels;  // the number of components of the image color space
+    unsigned int new_width, new_height;
+    size_t old_size;
+    std::string result;
+};
+
+static bool
+image_filter(const PdfDictionary &dict, bool &is_jpeg) {
+    const PdfObject *f = dict.FindKey("Filter");
+    const PdfArray *arr;
+    if (f && f->TryGetArray(arr)) {
+        if (arr->GetSize() != 1) return false;
+        f = &(*arr)[0];
+    }
+    if (!f) { is_jpeg = false; return true; }
+    if (!f->IsName()) return false;
+    const std::string &name = f->GetName().GetString();
+    if (name == "FlateDecode") { is_jpeg = false; return true; }
+    // DecodeParms for DCT images can change how the color components are interpreted
+    if (name == "DCTDecode" && !dict.HasKey("DecodeParms")) { is_jpeg = true; return true; }
+    return false;
+}
+
+static bool
+prepare_downsample_job(const PdfIndirectObjectList &objects, PdfObject *obj, const ImagePlacement &p, double max_dpi, DownsampleJob &job) {
+    const PdfDictionary &dict = obj->GetDictionary();
+    const PdfObject *w = dict.FindKey("Width"), *h = dict.FindKey("Height"), *bpc = dict.FindKey("BitsPerComponent"), *im = dict.FindKey("ImageMask");
+    if (!w || !h || !bpc || !w->IsNumber() || !h->IsNumber() || !bpc->IsNumber() || bpc->GetNumber() != 8) return false;
+    // Color key masks would not survive lossy recompression
+    if ((im && im->IsBool() && im->GetBool()) || dict.HasKey("Mask") || !obj->GetStream()) return false;
+    if (!image_filter(dict, job.is_jpeg)) return false;
+    // A soft mask with Matte must have the same dimensions as the image
+    const PdfObject *smask = dict.FindKey("SMask");
+    if (smask && smask->IsDictionary() && smask->GetDictionary().HasKey("Matte")) return false;
+    const int64_t width = w->GetNumber(), height = h->GetNumber();
+    if (width < 1 || height < 1 || p.width <= 0 || p.height <= 0) return false;
+    // The default user space unit is 1/72 of an inch
+    const double needed_width = std::ceil(p.width / 72. * max_dpi), needed_height = std::ceil(p.height / 72. * max_dpi);
+    const double scale = std::max(needed_width / width, needed_height / height);
+    // Not worth the quality loss for small reductions
+    if (scale > 0.9) return false;
+    job.obj = obj;
+    job.new_width = static_cast<unsigned int>(std::max(1., std::round(width * scale)));
+    job.new_height = static_cast<unsigned int>(std::max(1., std::round(height * scale)));
+    const unsigned int channels = color_components(objects, dict.FindKey("ColorSpace"));
+    job.channels = channels;
+    const PdfObjectStream &stream = *obj->GetStream();
+    if (job.is_jpeg) {
+        if (channels != 1 && channels != 3 && channels != 4) return false;
+        job.pixels.data = stream.GetCopy(true);
+        job.old_size = job.pixels.data.size();
+    } else {
+        if (!channels) return false;
+        job.pixels.width = static_cast<unsigned int>(width); job.pixels.height = static_cast<unsigned int>(height); job.pixels.channels = channels;
+        job.pixels.data = stream.GetCopy();
+        if (job.pixels.data.size() != static_cast<size_t>(width) * height * channels) return false;
+        job.old_size = stream.GetCopy(true).size();
+    }
+    return true;
+}
+
+static PyObject*
+downsample_images(PDFDoc *self, PyObject *args) {
+    double max_dpi;
+    int jpeg_quality = 85;
+    unsigned int num_threads = 0;
+    if (!PyArg_ParseTuple(args, "d|iI", &max_dpi, &jpeg_quality, &num_threads)) return NULL;
+    if (max_dpi <= 0) { PyErr_SetString(PyExc_ValueError, "max_dpi must be positive"); return NULL; }
+    if (jpeg_quality < 1 || jpeg_quality > 100) { PyErr_SetString(PyExc_ValueError, "jpeg_quality must be between 1 and 100"); return NULL; }
+    unsigned long count = 0;
+    unsigned long long bytes_saved = 0;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        // Find the largest size each image is drawn at by interpreting the
+        // page content streams, including any nested form XObjects. Images
+        // used only in annotation appearances or patterns are not found, so
+        // they are left alone.
+        PdfIndirectObjectList &objects = self->doc->GetObjects();
+        PdfPageCollection &pages = self->doc->GetPages();
+        image_placement_map placements;
+        for (unsigned int i = 0; i < pages.GetCount(); i++) {
+            try {
+                PdfPage &page = pages.GetPageAt(i);
+                PdfContents *contents = page.GetContents();
+                const PdfResources *resources = page.GetResources();
+                if (!contents || !resources) continue;
+                const charbuff content = contents->GetCopy();
+                find_image_placements(objects, content, &resources->GetDictionary(), Matrix{}, placements, 0);
+            } catch (const PdfError &) { continue; }
+        }
+        std::vector<DownsampleJob> jobs;
+        for (const auto &x : placements) {
+            PdfObject *obj = objects.GetObject(x.first);
+            if (!obj) continue;
+            DownsampleJob job;
+            try {
+                if (prepare_downsample_job(objects, obj, x.second, max_dpi, job)) jobs.push_back(std::move(job));
+            } catch (const PdfError &) { continue; }
+        }
+        // Decoding, resampling and encoding do not touch PoDoFo so can all happen in parallel
+        run_in_thread_pool(jobs.size(), num_threads, [&](size_t i) {
+            DownsampleJob &job = jobs[i];
+            try {
+                if (job.is_jpeg) {
+                    Pixels decoded = decode_jpeg(job.pixels.data);
+                    job.pixels = Pixels();
+                    // The color space must describe the components actually in the JPEG
+                    if (decoded.channels != job.channels) throw ImageError("JPEG does not match the image color space");
+                    job.result = encode_jpeg(downsample(decoded, job.new_width, job.new_height), jpeg_quality);
+                } else {
+                    Pixels scaled = downsample(job.pixels, job.new_width, job.new_height);
+                    job.pixels = Pixels();
+                    job.result = deflate_data(scaled.data, Z_DEFAULT_COMPRESSION);
+                }
+            } catch (const ImageError &) { job.result.clear(); }
+        });
+        for (auto &job : jobs) {
+            if (job.result.empty() || job.result.size() >= job.old_size) continue;
+            PdfDictionary &dict = job.obj->GetDictionary();
+            job.obj->GetStream()->SetData(bufferview(job.result.data(), job.result.size()), true);
+            dict.AddKey("Width", PdfObject(static_cast<int64_t>(job.new_width)));
+            dict.AddKey("Height", PdfObject(static_cast<int64_t>(job.new_height)));
+            dict.AddKey("Filter", PdfName(job.is_jpeg ? "DCTDecode" : "FlateDecode"));
+            dict.RemoveKey("DecodeParms");
+            count++;
+            bytes_saved += job.old_size - job.result.size();
+        }
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
+    return Py_BuildValue("kK", count, bytes_saved);
+}
+
+PYWRAP(downsample_images)
+// }}}
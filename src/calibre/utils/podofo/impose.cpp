@@ -12,7 +12,7 @@
 using namespace pdf;
 
 static void
-impose_page(PdfMemDocument *doc, unsigned int dest_page_num, unsigned int src_page_num) {
+impose_page(PdfMemDocument *doc, unsigned int dest_page_num, unsigned int src_page_num, bool compress) {
     auto &src_page = doc->GetPages().GetPageAt(src_page_num);
     auto xobj = doc->CreateXObjectForm(src_page.GetMediaBox(), "HeaderFooter");
     xobj->FillFromPage(src_page);
@@ -24,15 +24,16 @@ impose_page(PdfMemDocument *doc, unsigned int dest_page_num, unsigned int src_pa
     std::ostringstream s;
     s << "q\n1 0 0 1 0 0 cm\n/" << xobj->GetIdentifier().GetString() << " Do\nQ\n" << contents->GetCopy();
     contents->Reset();
-    contents->GetStreamForAppending().SetData(s.str());
+    set_stream_data(contents->GetObject(), s.str(), compress);
 }
 
 static PyObject*
 impose(PDFDoc *self, PyObject *args) {
     unsigned long dest_page_num, src_page_num, count;
-    if (!PyArg_ParseTuple(args, "kkk", &dest_page_num, &src_page_num, &count)) return NULL;
+    int compress = 1;
+    if (!PyArg_ParseTuple(args, "kkk|p", &dest_page_num, &src_page_num, &count, &compress)) return NULL;
     for (unsigned long i = 0; i < count; i++) {
-        impose_page(self->doc, dest_page_num - 1 + i, src_page_num - 1 + i);
+        impose_page(self->doc, dest_page_num - 1 + i, src_page_num - 1 + i, compress);
     }
     auto& pages = self->doc->GetPages();
     while (count-- && src_page_num <= pages.GetCount()) pages.RemovePageAt(src_page_num - 1);
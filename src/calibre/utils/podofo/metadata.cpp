@@ -0,0 +1,85 @@
+/*
+ * metadata.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "global.h"
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace pdf;
+
+struct PDFMetadata {
+    std::vector<std::pair<std::string, std::string>> info;
+    std::string xmp;
+    bool has_xmp = false;
+    unsigned int page_count = 0;
+};
+
+static void
+read_metadata(std::string_view data, PDFMetadata &ans) {
+    // PoDoFo parses only the cross reference table and trailer on load,
+    // other objects are read when first accessed, so this only touches the
+    // Info dictionary, the catalog, the metadata stream and the page tree root.
+    PdfMemDocument doc;
+    doc.LoadFromBuffer(bufferview(data.data(), data.size()));
+    const PdfObject *info = doc.GetTrailer().GetDictionary().FindKey("Info");
+    const PdfDictionary *dict;
+    if (info && info->TryGetDictionary(dict)) {
+        for (const auto &x : *dict) {
+            const PdfString *str;
+            if (x.second.TryGetString(str)) ans.info.emplace_back(x.first.GetString(), str->GetString());
+        }
+    }
+    const PdfObject *metadata = doc.GetCatalog().GetDictionary().FindKey("Metadata");
+    if (metadata && metadata->GetStream()) {
+        StringStreamDevice output(ans.xmp);
+        metadata->GetStream()->CopyTo(output);
+        ans.has_xmp = true;
+    }
+    ans.page_count = doc.GetPages().GetCount();
+}
+
+PyObject*
+pdf::read_pdf_metadata(PyObject *self, PyObject *args) {
+    Py_buffer buf;
+    if (!PyArg_ParseTuple(args, "y*", &buf)) return NULL;
+    PDFMetadata m;
+    std::exception_ptr err;
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        read_metadata(std::string_view(static_cast<const char*>(buf.buf), buf.len), m);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    PyBuffer_Release(&buf);
+    if (err) {
+        try {
+            std::rethrow_exception(err);
+        } catch (const PdfError &e) {
+            podofo_set_exception(e); return NULL;
+        } catch (const std::exception &e) {
+            PyErr_Format(Error, "Failed to read PDF metadata: %s", e.what()); return NULL;
+        } catch (...) {
+            PyErr_SetString(Error, "An unknown error occurred while trying to read PDF metadata"); return NULL;
+        }
+    }
+    pyunique_ptr info(PyDict_New());
+    if (!info) return NULL;
+    for (const auto &x : m.info) {
+        pyunique_ptr key(PyUnicode_DecodeUTF8(x.first.data(), x.first.size(), "replace"));
+        if (!key) return NULL;
+        pyunique_ptr val(PyUnicode_DecodeUTF8(x.second.data(), x.second.size(), "replace"));
+        if (!val) return NULL;
+        if (PyDict_SetItem(info.get(), key.get(), val.get()) != 0) return NULL;
+    }
+    pyunique_ptr xmp;
+    if (m.has_xmp) {
+        xmp.reset(PyBytes_FromStringAndSize(m.xmp.data(), m.xmp.size()));
+        if (!xmp) return NULL;
+    } else { Py_INCREF(Py_None); xmp.reset(Py_None); }
+    return Py_BuildValue("{sO sO sI}", "info", info.get(), "xmp_metadata", xmp.get(), "page_count", m.page_count);
+}
@@ -6,6 +6,10 @@
  */
 
 #include "global.h"
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <vector>
 using namespace pdf;
 
 
@@ -47,6 +51,86 @@ create_outline(PDFDoc *self, PyObject *args) {
     return decref_ans_on_exit.release();
 }
 
+struct OutlineEntry {
+    unsigned int level, pagenum;
+    PdfString title;
+    double left, top, zoom;
+};
+
+static void
+build_outline_tree(PdfMemDocument *doc, const std::vector<OutlineEntry> &entries, std::vector<size_t> &clamped, std::vector<size_t> &skipped) {
+    PdfPageCollection &pages = doc->GetPages();
+    const unsigned int num_pages = pages.GetCount();
+    if (!num_pages) throw std::runtime_error("Cannot create an outline for a document with no pages");
+    PdfOutlines &outlines = doc->GetOrCreateOutlines();
+    // parents[n] is the most recently created item at level n
+    std::vector<PdfOutlineItem*> parents;
+    unsigned int skip_level = 0; bool skipping = false;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const OutlineEntry &e = entries[i];
+        if (skipping) {
+            if (e.level > skip_level) continue;
+            skipping = false;
+        }
+        if (e.pagenum < 1) {
+            // Also skip all descendants of this entry
+            skipped.push_back(i); skipping = true; skip_level = e.level;
+            continue;
+        }
+        unsigned int pagenum = e.pagenum;
+        if (pagenum > num_pages) { clamped.push_back(i); pagenum = num_pages; }
+        auto dest = std::make_shared<PdfDestination>(pages.GetPageAt(pagenum - 1), e.left, e.top, e.zoom);
+        // An entry can be at most one level below the previous entry
+        const size_t level = std::min(static_cast<size_t>(e.level), parents.size());
+        PdfOutlineItem *item;
+        if (level == parents.size()) {
+            if (level == 0) {
+                item = outlines.CreateRoot(e.title);
+                item->SetDestination(dest);
+            } else item = parents[level - 1]->CreateChild(e.title, dest);
+            parents.push_back(item);
+        } else {
+            item = parents[level]->CreateNext(e.title, dest);
+            parents.resize(level + 1);
+            parents[level] = item;
+        }
+    }
+}
+
+static PyObject *
+create_outline_tree(PDFDoc *self, PyObject *args) {
+    PyObject *py_entries;
+    if (!PyArg_ParseTuple(args, "O", &py_entries)) return NULL;
+    pyunique_ptr seq(PySequence_Fast(py_entries, "entries must be a sequence"));
+    if (!seq) return NULL;
+    const Py_ssize_t num = PySequence_Fast_GET_SIZE(seq.get());
+    std::vector<OutlineEntry> entries;
+    entries.reserve(num);
+    for (Py_ssize_t i = 0; i < num; i++) {
+        OutlineEntry e;
+        PyObject *title;
+        e.zoom = 0;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq.get(), i), "IUIdd|d", &e.level, &title, &e.pagenum, &e.left, &e.top, &e.zoom)) return NULL;
+        e.title = podofo_convert_pystring(title);
+        entries.push_back(std::move(e));
+    }
+    std::vector<size_t> clamped, skipped;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        build_outline_tree(self->doc, entries, clamped, skipped);
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
+    pyunique_ptr pc(PyList_New(clamped.size())), ps(PyList_New(skipped.size()));
+    if (!pc || !ps) return NULL;
+    for (size_t i = 0; i < clamped.size(); i++) PyList_SET_ITEM(pc.get(), i, PyLong_FromSize_t(clamped[i]));
+    for (size_t i = 0; i < skipped.size(); i++) PyList_SET_ITEM(ps.get(), i, PyLong_FromSize_t(skipped[i]));
+    if (PyErr_Occurred()) return NULL;
+    return Py_BuildValue("OO", pc.get(), ps.get());
+}
+
 static PyObject*
 create_outline_node() {
 	pyunique_ptr ans(PyDict_New());
@@ -100,4 +184,5 @@ get_outline(PDFDoc *self, PyObject *args) {
 }
 
 PYWRAP(create_outline)
+PYWRAP(create_outline_tree)
 PYWRAP(get_outline)
@@ -37,6 +37,14 @@ exec_module(PyObject *m) {
 	return 0;
 }
 
+static PyMethodDef methods[] = {
+    {"read_pdf_metadata", (PyCFunction)pdf::read_pdf_metadata, METH_VARARGS,
+     "read_pdf_metadata(buffer) -> Read the Info dictionary, XMP metadata and page count from the PDF in buffer"
+     " without loading the rest of the document. Returns a dict with the keys info, xmp_metadata and page_count."
+    },
+    {NULL}  /* Sentinel */
+};
+
 static PyModuleDef_Slot slots[] = { {Py_mod_exec, (void*)exec_module}, {0, NULL} };
 
 static struct PyModuleDef module_def = {PyModuleDef_HEAD_INIT};
@@ -45,5 +53,6 @@ CALIBRE_MODINIT_FUNC PyInit_podofo(void) {
 	module_def.m_name = "podofo";
 	module_def.m_doc = podofo_doc;
 	module_def.m_slots = slots;
+	module_def.m_methods = methods;
 	return PyModuleDef_Init(&module_def);
 }
@@ -0,0 +1,304 @@
+/*
+ * sfnt.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "sfnt.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace pdf;
+
+#define TAG(a, b, c, d) ((uint32_t(a) << 24) | (uint32_t(b) << 16) | (uint32_t(c) << 8) | uint32_t(d))
+
+// Tables that are used when rendering a font embedded in a PDF, everything
+// else is dropped, same as pdf_subset()
+static const uint32_t core_tables[] = {
+    TAG('h', 'h', 'e', 'a'), TAG('h', 'e', 'a', 'd'), TAG('h', 'm', 't', 'x'), TAG('m', 'a', 'x', 'p'),
+    TAG('O', 'S', '/', '2'), TAG('p', 'o', 's', 't'), TAG('c', 'v', 't', ' '), TAG('f', 'p', 'g', 'm'),
+    TAG('g', 'l', 'y', 'f'), TAG('l', 'o', 'c', 'a'), TAG('p', 'r', 'e', 'p'), TAG('C', 'F', 'F', ' '),
+    TAG('V', 'O', 'R', 'G'),
+};
+
+static inline uint16_t
+read_u16(const char *p) { const uint8_t *q = reinterpret_cast<const uint8_t*>(p); return (uint16_t(q[0]) << 8) | q[1]; }
+
+static inline uint32_t
+read_u32(const char *p) { const uint8_t *q = reinterpret_cast<const uint8_t*>(p); return (uint32_t(q[0]) << 24) | (uint32_t(q[1]) << 16) | (uint32_t(q[2]) << 8) | q[3]; }
+
+static inline void
+write_u16(char *p, uint16_t val) { p[0] = char(val >> 8); p[1] = char(val & 0xff); }
+
+static inline void
+write_u32(char *p, uint32_t val) { write_u16(p, uint16_t(val >> 16)); write_u16(p + 2, uint16_t(val & 0xffff)); }
+
+static inline void
+append_u16(std::string &out, uint16_t val) { char b[2]; write_u16(b, val); out.append(b, 2); }
+
+static inline void
+append_u32(std::string &out, uint32_t val) { char b[4]; write_u32(b, val); out.append(b, 4); }
+
+static uint32_t
+checksum_of_block(const char *data, size_t sz) {
+    uint32_t ans = 0;
+    size_t i = 0;
+    for (; i + 4 <= sz; i += 4) ans += read_u32(data + i);
+    if (i < sz) {
+        char last[4] = {0};
+        memcpy(last, data + i, sz - i);
+        ans += read_u32(last);
+    }
+    return ans;
+}
+
+struct Table {
+    uint32_t tag;
+    std::string_view data;
+};
+
+class Sfnt {
+    public:
+        uint32_t version;
+        std::vector<Table> tables;
+
+        explicit Sfnt(std::string_view raw) : version(0), tables() {
+            if (raw.size() < 12) throw SfntError("Font data too short");
+            version = read_u32(raw.data());
+            if (version != 0x00010000 && version != TAG('O', 'T', 'T', 'O') && version != TAG('t', 'r', 'u', 'e')) throw SfntError("Font has unknown sfnt version");
+            size_t num_tables = read_u16(raw.data() + 4);
+            if (12 + 16 * num_tables > raw.size()) throw SfntError("Font has truncated table directory");
+            tables.reserve(num_tables);
+            for (size_t i = 0; i < num_tables; i++) {
+                const char *p = raw.data() + 12 + 16 * i;
+                size_t offset = read_u32(p + 8), length = read_u32(p + 12);
+                if (offset > raw.size()) offset = raw.size();
+                length = std::min(length, raw.size() - offset);
+                tables.push_back({read_u32(p), raw.substr(offset, length)});
+            }
+        }
+
+        std::string_view operator[](uint32_t tag) const {
+            for (const auto &t : tables) if (t.tag == tag) return t.data;
+            return std::string_view();
+        }
+
+        bool has(uint32_t tag) const {
+            for (const auto &t : tables) if (t.tag == tag) return true;
+            return false;
+        }
+};
+
+// The glyph data and horizontal metrics of a single TrueType font
+class TrueTypeFont {
+    public:
+        Sfnt sfnt;
+        std::string_view head, maxp, hhea, glyf;
+        std::vector<uint32_t> offsets;
+        std::vector<uint16_t> advances;
+        std::vector<int16_t> bearings;
+
+        explicit TrueTypeFont(std::string_view raw) : sfnt(raw), head(), maxp(), hhea(), glyf(), offsets(), advances(), bearings() {
+            head = sfnt[TAG('h', 'e', 'a', 'd')]; maxp = sfnt[TAG('m', 'a', 'x', 'p')]; hhea = sfnt[TAG('h', 'h', 'e', 'a')];
+            glyf = sfnt[TAG('g', 'l', 'y', 'f')];
+            std::string_view loca = sfnt[TAG('l', 'o', 'c', 'a')], hmtx = sfnt[TAG('h', 'm', 't', 'x')];
+            if (head.size() < 54 || maxp.size() < 6) throw SfntError("Font does not contain head and/or maxp tables");
+            if (read_u32(maxp.data()) > 0x00010000) throw SfntError("Font has an unsupported maxp table version");
+            if (!sfnt.has(TAG('g', 'l', 'y', 'f')) || !sfnt.has(TAG('l', 'o', 'c', 'a'))) throw SfntError("Font does not contain TrueType outlines");
+            if (hhea.size() < 36) throw SfntError("Font does not contain a hhea table");
+
+            if (read_u16(head.data() + 50) == 0) {
+                offsets.resize(loca.size() / 2);
+                for (size_t i = 0; i < offsets.size(); i++) offsets[i] = 2 * uint32_t(read_u16(loca.data() + 2 * i));
+            } else {
+                offsets.resize(loca.size() / 4);
+                for (size_t i = 0; i < offsets.size(); i++) offsets[i] = read_u32(loca.data() + 4 * i);
+            }
+
+            size_t num_of_metrics = read_u16(hhea.data() + 34), num_glyphs = read_u16(maxp.data() + 4);
+            if (hmtx.size() < 4 * num_of_metrics) throw SfntError("The hmtx table has insufficient data");
+            advances.resize(num_of_metrics); bearings.resize(std::max(num_of_metrics, num_glyphs));
+            for (size_t i = 0; i < num_of_metrics; i++) {
+                advances[i] = read_u16(hmtx.data() + 4 * i);
+                bearings[i] = int16_t(read_u16(hmtx.data() + 4 * i + 2));
+            }
+            if (num_glyphs > num_of_metrics) {
+                size_t extra = num_glyphs - num_of_metrics;
+                if (hmtx.size() < 4 * num_of_metrics + 2 * extra) throw SfntError("The hmtx table has insufficient data for trailing bearings");
+                for (size_t i = 0; i < extra; i++) bearings[num_of_metrics + i] = int16_t(read_u16(hmtx.data() + 4 * num_of_metrics + 2 * i));
+            }
+        }
+
+        size_t num_glyphs() const { return offsets.size() ? offsets.size() - 1 : 0; }
+
+        std::string_view glyph_data(size_t glyph_id) const {
+            size_t offset = offsets[glyph_id], next_offset = offsets[glyph_id + 1];
+            if (next_offset <= offset || offset >= glyf.size()) return std::string_view();
+            return glyf.substr(offset, next_offset - offset);
+        }
+
+        void metrics_for(size_t glyph_id, uint16_t &advance, int16_t &bearing) const {
+            if (glyph_id >= bearings.size() || advances.empty()) throw SfntError("Glyph has no horizontal metrics");
+            bearing = bearings[glyph_id];
+            advance = advances[std::min(glyph_id, advances.size() - 1)];
+        }
+};
+
+struct Glyph {
+    std::string_view data;
+    uint16_t advance;
+    int16_t bearing;
+};
+
+static void
+add_composite_components(std::string_view data, std::vector<uint32_t> &pending) {
+    static const uint16_t ARG_1_AND_2_ARE_WORDS = 0x0001, WE_HAVE_A_SCALE = 0x0008, MORE_COMPONENTS = 0x0020;
+    static const uint16_t WE_HAVE_AN_X_AND_Y_SCALE = 0x0040, WE_HAVE_A_TWO_BY_TWO = 0x0080;
+    if (data.size() < 2 || int16_t(read_u16(data.data())) >= 0) return;
+    size_t offset = 10;
+    uint16_t flags = MORE_COMPONENTS;
+    while ((flags & MORE_COMPONENTS) && offset + 4 <= data.size()) {
+        flags = read_u16(data.data() + offset);
+        pending.push_back(read_u16(data.data() + offset + 2));
+        offset += (flags & ARG_1_AND_2_ARE_WORDS) ? 8 : 6;
+        if (flags & WE_HAVE_A_SCALE) offset += 2;
+        else if (flags & WE_HAVE_AN_X_AND_Y_SCALE) offset += 4;
+        else if (flags & WE_HAVE_A_TWO_BY_TWO) offset += 8;
+    }
+}
+
+static std::string
+serialize_sfnt(uint32_t version, std::vector<std::pair<uint32_t, std::string>> &tables) {
+    std::sort(tables.begin(), tables.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    const uint16_t num_tables = uint16_t(tables.size());
+    uint16_t ln2 = 0;
+    for (uint16_t x = num_tables; x > 1; x >>= 1) ln2++;
+    const uint16_t search_range = uint16_t((1u << ln2) * 16);
+    std::string ans;
+    size_t total = 12 + 16 * tables.size();
+    for (const auto &t : tables) total += (t.second.size() + 3) & ~size_t(3);
+    ans.reserve(total);
+    append_u32(ans, version); append_u16(ans, num_tables); append_u16(ans, search_range);
+    append_u16(ans, ln2); append_u16(ans, uint16_t(num_tables * 16 - search_range));
+    size_t offset = 12 + 16 * tables.size(), head_offset = 0;
+    bool has_head = false;
+    for (auto &t : tables) {
+        if (t.first == TAG('h', 'e', 'a', 'd')) {
+            has_head = true; head_offset = offset;
+            if (t.second.size() >= 12) write_u32(&t.second[8], 0);
+        }
+        append_u32(ans, t.first); append_u32(ans, checksum_of_block(t.second.data(), t.second.size()));
+        append_u32(ans, uint32_t(offset)); append_u32(ans, uint32_t(t.second.size()));
+        offset += (t.second.size() + 3) & ~size_t(3);
+    }
+    for (const auto &t : tables) {
+        ans.append(t.second);
+        ans.append((4 - t.second.size() % 4) % 4, '\0');
+    }
+    if (has_head && head_offset + 12 <= ans.size()) write_u32(&ans[head_offset + 8], 0xB1B0AFBA - checksum_of_block(ans.data(), ans.size()));
+    return ans;
+}
+
+bool
+pdf::is_truetype_font(std::string_view data) {
+    try {
+        Sfnt sfnt(data);
+        if (!sfnt.has(TAG('g', 'l', 'y', 'f'))) return false;
+        std::string_view maxp = sfnt[TAG('m', 'a', 'x', 'p')];
+        return maxp.size() >= 6 && read_u32(maxp.data()) <= 0x00010000;
+    } catch (const SfntError &) {}
+    return false;
+}
+
+std::string
+pdf::merge_truetype_fonts_for_pdf(const std::vector<std::string_view> &raw_fonts, const std::vector<uint32_t> &glyph_ids, bool &subsetted) {
+    if (raw_fonts.empty()) throw SfntError("No fonts to merge");
+    std::vector<TrueTypeFont> fonts;
+    fonts.reserve(raw_fonts.size());
+    for (const auto &raw : raw_fonts) fonts.emplace_back(raw);
+
+    // Merge: the first non-empty version of every glyph wins, along with its metrics
+    std::vector<Glyph> glyphs;
+    for (const auto &font : fonts) {
+        const size_t num_glyphs = font.num_glyphs();
+        if (glyphs.size() < num_glyphs) glyphs.resize(num_glyphs, Glyph{std::string_view(), 0, 0});
+        for (size_t glyph_id = 0; glyph_id < num_glyphs; glyph_id++) {
+            Glyph &g = glyphs[glyph_id];
+            if (g.data.empty()) {
+                g.data = font.glyph_data(glyph_id);
+                font.metrics_for(glyph_id, g.advance, g.bearing);
+            }
+        }
+    }
+
+    // Subset: keep .notdef, the requested glyphs and the glyphs they are composed of
+    std::vector<bool> keep(glyphs.size(), false);
+    std::vector<uint32_t> pending(glyph_ids);
+    pending.push_back(0);
+    size_t num_kept = 0; bool has_non_notdef = false;
+    while (!pending.empty()) {
+        uint32_t glyph_id = pending.back(); pending.pop_back();
+        if (glyph_id >= glyphs.size() || keep[glyph_id]) continue;
+        keep[glyph_id] = true; num_kept++;
+        if (glyph_id) has_non_notdef = true;
+        add_composite_components(glyphs[glyph_id].data, pending);
+    }
+    subsetted = num_kept > 0 && has_non_notdef;
+    if (!subsetted) std::fill(keep.begin(), keep.end(), true);
+
+    const TrueTypeFont &base = fonts[0];
+    std::string glyf;
+    std::vector<uint32_t> offsets(glyphs.size() + 1, 0);
+    for (size_t glyph_id = 0; glyph_id < glyphs.size(); glyph_id++) {
+        if (keep[glyph_id]) {
+            const std::string_view &d = glyphs[glyph_id].data;
+            glyf.append(d);
+            glyf.append((4 - d.size() % 4) % 4, '\0');
+        }
+        offsets[glyph_id + 1] = uint32_t(glyf.size());
+    }
+    const bool short_loca = glyf.size() < 0x20000;
+    std::string loca;
+    loca.reserve(offsets.size() * (short_loca ? 2 : 4));
+    for (uint32_t x : offsets) {
+        if (short_loca) append_u16(loca, uint16_t(x / 2));
+        else append_u32(loca, x);
+    }
+
+    std::string head(base.head.substr(0, 54));
+    write_u16(&head[50], short_loca ? 0 : 1);
+    std::string maxp(base.maxp.substr(0, read_u32(base.maxp.data()) == 0x00010000 ? 32 : 6));
+    write_u16(&maxp[4], uint16_t(glyphs.size()));
+
+    std::string hmtx;
+    hmtx.reserve(4 * glyphs.size());
+    uint16_t advance_width_max = 0; int16_t min_left_side_bearing = 0;
+    for (size_t i = 0; i < glyphs.size(); i++) {
+        const Glyph &g = glyphs[i];
+        append_u16(hmtx, g.advance); append_u16(hmtx, uint16_t(g.bearing));
+        advance_width_max = std::max(advance_width_max, g.advance);
+        min_left_side_bearing = i ? std::min(min_left_side_bearing, g.bearing) : g.bearing;
+    }
+    std::string hhea(base.hhea.substr(0, 36));
+    write_u16(&hhea[10], advance_width_max); write_u16(&hhea[12], uint16_t(min_left_side_bearing));
+    write_u16(&hhea[34], uint16_t(glyphs.size()));
+
+    std::vector<std::pair<uint32_t, std::string>> tables;
+    for (const auto &t : base.sfnt.tables) {
+        if (std::find(std::begin(core_tables), std::end(core_tables), t.tag) == std::end(core_tables)) continue;
+        bool seen = false;
+        for (const auto &x : tables) if (x.first == t.tag) { seen = true; break; }
+        if (seen) continue;
+        switch (t.tag) {
+            case TAG('g', 'l', 'y', 'f'): tables.emplace_back(t.tag, std::move(glyf)); break;
+            case TAG('l', 'o', 'c', 'a'): tables.emplace_back(t.tag, std::move(loca)); break;
+            case TAG('h', 'e', 'a', 'd'): tables.emplace_back(t.tag, std::move(head)); break;
+            case TAG('m', 'a', 'x', 'p'): tables.emplace_back(t.tag, std::move(maxp)); break;
+            case TAG('h', 'h', 'e', 'a'): tables.emplace_back(t.tag, std::move(hhea)); break;
+            case TAG('h', 'm', 't', 'x'): tables.emplace_back(t.tag, std::move(hmtx)); break;
+            default: tables.emplace_back(t.tag, std::string(t.data)); break;
+        }
+    }
+    return serialize_sfnt(base.sfnt.version, tables);
+}
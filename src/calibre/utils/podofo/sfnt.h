@@ -0,0 +1,36 @@
+/*
+ * sfnt.h
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pdf {
+
+class SfntError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+};
+
+// True if data is an sfnt with TrueType (glyf) outlines, this does not touch
+// the Python interpreter so it is safe to call without the GIL
+bool is_truetype_font(std::string_view data);
+
+// Merge the glyphs from all the specified TrueType fonts into the first one
+// and subset the result to contain only glyph_ids (plus .notdef and any
+// composite glyph components). Glyph ids are preserved. Equivalent to
+// merge_truetype_fonts_for_pdf() followed by pdf_subset() from
+// calibre.utils.fonts.sfnt. If none of glyph_ids are present in the fonts,
+// the merged font is returned without subsetting and subsetted is set to
+// false. Raises SfntError if the fonts cannot be parsed.
+std::string merge_truetype_fonts_for_pdf(const std::vector<std::string_view> &fonts, const std::vector<uint32_t> &glyph_ids, bool &subsetted);
+
+}
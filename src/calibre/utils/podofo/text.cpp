@@ -0,0 +1,66 @@
+/*
+ * text.cpp
+ * Copyright (C) 2023 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "global.h"
+#include <cmath>
+#include <exception>
+#include <string>
+#include <vector>
+
+using namespace pdf;
+
+static void
+page_text(const PdfPage &page, std::string &ans) {
+    // PoDoFo tokenizes the content stream and decodes the text via the font
+    // encodings and ToUnicode maps, giving us one entry per run of text on a
+    // line. We only need plain text for indexing so runs on the same line
+    // are separated by spaces and lines by newlines.
+    std::vector<PdfTextEntry> entries;
+    page.ExtractTextTo(entries);
+    bool first = true;
+    double prev_y = 0;
+    for (const auto &e : entries) {
+        if (e.Text.empty()) continue;
+        if (!first) {
+            if (std::fabs(e.Y - prev_y) > 1) ans.push_back('\n');
+            else if (ans.back() != ' ' && e.Text.front() != ' ') ans.push_back(' ');
+        }
+        ans.append(e.Text);
+        prev_y = e.Y; first = false;
+    }
+}
+
+static PyObject*
+extract_text(PDFDoc *self, PyObject *args) {
+    std::vector<std::string> pages;
+    std::exception_ptr err;
+    DocumentBusy busy(self);
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        const PdfPageCollection &collection = self->doc->GetPages();
+        const unsigned count = collection.GetCount();
+        pages.resize(count);
+        for (unsigned i = 0; i < count; i++) {
+            // A single broken page should not prevent indexing of the rest of the document
+            try {
+                page_text(collection.GetPageAt(i), pages[i]);
+            } catch (const PdfError &) { pages[i].clear(); }
+        }
+    } catch (...) { err = std::current_exception(); }
+    Py_END_ALLOW_THREADS;
+    if (err) std::rethrow_exception(err);
+    pyunique_ptr ans(PyList_New(pages.size()));
+    if (!ans) return NULL;
+    for (size_t i = 0; i < pages.size(); i++) {
+        PyObject *t = PyUnicode_DecodeUTF8(pages[i].data(), pages[i].size(), "replace");
+        if (!t) return NULL;
+        PyList_SET_ITEM(ans.get(), i, t);
+    }
+    return ans.release();
+}
+
+PYWRAP(extract_text)
@@ -288,6 +288,12 @@ def find_tests(which_tests=None, exclude_tests=None):
         a(find_tests())
         from calibre.ebooks.compression.palmdoc import find_tests
         a(find_tests())
+        from calibre.ebooks.mobi.huffcdic import find_tests
+        a(find_tests())
+        from calibre.ebooks.djvu.test_bzz import find_tests
+        a(find_tests())
+        from calibre.ebooks.lit.test_msdes import find_tests
+        a(find_tests())
         from calibre.gui2.viewer.convert_book import find_tests
         a(find_tests())
         from calibre.utils.hyphenation.test_hyphenation import find_tests